@@ -0,0 +1,81 @@
+// Compile throughput of the embedding API under contention: every thread
+// compiles, calls and unloads its own small modules against one shared
+// Engine, for 1, 2, 4, ... threads.
+//
+// Usage: kaleidoscope_engine_stress [max threads] [modules per thread]
+
+#include "llvm/Support/Error.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kaleidoscope/engine.hpp"
+
+static llvm::ExitOnError exit_on_err;
+
+static void compile_modules(Engine &engine, unsigned round, unsigned thread_index, unsigned num_modules, std::atomic<unsigned> &failures) {
+	for (unsigned i = 0; i < num_modules; ++i) {
+		std::string name = "kernel" + std::to_string(round) + "t" + std::to_string(thread_index) + "m" + std::to_string(i);
+		std::string source = "def " + name + "(a b) helper(a) * b + " + std::to_string(i) + " - (a - b) / (a + 1);";
+
+		llvm::Expected<Engine::ModuleHandle> handle = engine.compile(source);
+		if (!handle) {
+			llvm::consumeError(handle.takeError());
+			++failures;
+			continue;
+		}
+
+		llvm::Expected<double (*)(double, double)> kernel = engine.lookup<double(double, double)>(name);
+		if (!kernel || (*kernel)(1, 2) != 4.0 + i - (1.0 - 2.0) / 2.0) {
+			if (!kernel)
+				llvm::consumeError(kernel.takeError());
+			++failures;
+		}
+
+		if (llvm::Error err = engine.unload(*handle)) {
+			llvm::consumeError(std::move(err));
+			++failures;
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	unsigned max_threads = argc > 1 ? std::atoi(argv[1]) : std::max(1u, std::thread::hardware_concurrency());
+	unsigned modules_per_thread = argc > 2 ? std::atoi(argv[2]) : 200;
+
+	llvm::InitializeNativeTarget();
+	llvm::InitializeNativeTargetAsmPrinter();
+	llvm::InitializeNativeTargetAsmParser();
+
+	std::unique_ptr<Engine> engine = exit_on_err(Engine::create());
+	exit_on_err(engine->compile("def helper(x) x*x + 1;").takeError());
+
+	double single_thread_rate = 0;
+	for (unsigned num_threads = 1, round = 0; num_threads <= max_threads; num_threads *= 2, ++round) {
+		std::atomic<unsigned> failures{0};
+		std::vector<std::thread> threads;
+
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned t = 0; t < num_threads; ++t)
+			threads.emplace_back(compile_modules, std::ref(*engine), round, t, modules_per_thread, std::ref(failures));
+		for (std::thread &thread : threads)
+			thread.join();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		double rate = num_threads * modules_per_thread / seconds;
+		if (num_threads == 1)
+			single_thread_rate = rate;
+		printf("threads=%u modules=%u seconds=%.3f modules_per_sec=%.1f speedup=%.2f failures=%u\n", 
+			num_threads, num_threads * modules_per_thread, seconds, rate, rate / single_thread_rate, failures.load());
+		if (failures)
+			return 1;
+	}
+
+	return 0;
+}
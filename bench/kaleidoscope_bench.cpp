@@ -0,0 +1,622 @@
+// Benchmark suite: front end throughput, codegen/optimization cost, JIT
+// latency in its different modes, and speed of the generated code.
+//
+// Every workload comes from ProgramGenerator with a fixed seed, nothing
+// is read from the network and only the lexer reads from disk, a file it
+// writes itself. Each measurement is the best of
+// --repetitions runs, printed as one JSON object per line:
+//
+//     {"benchmark":"lexer","metric":"mb_per_sec","value":412.5,"unit":"MB/s"}
+//
+// so that runs on different commits can be compared with a plain diff
+// or any JSON tool.
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "parser.cpp"
+#include "program_generator.hpp"
+#include "kaleidoscope/codegen_visitor.hpp"
+#include "kaleidoscope/function_library.hpp"
+#include "kaleidoscope/kaleidoscope_jit.hpp"
+#include "kaleidoscope/parallel_runtime.hpp"
+#include "kaleidoscope/stats.hpp"
+
+static llvm::cl::opt<std::string> filter(
+	"filter",
+	llvm::cl::desc("Only run the benchmarks whose name contains <substring>"),
+	llvm::cl::value_desc("substring"),
+	llvm::cl::init("")
+);
+
+static llvm::cl::opt<unsigned> repetitions(
+	"repetitions",
+	llvm::cl::desc("Runs of each measurement, the fastest one is reported"),
+	llvm::cl::init(3)
+);
+
+static llvm::cl::opt<double> scale(
+	"scale",
+	llvm::cl::desc("Multiplies the size of every workload"),
+	llvm::cl::init(1.0)
+);
+
+static llvm::ExitOnError exit_on_err;
+
+using clock_type = std::chrono::steady_clock;
+
+static unsigned scaled(unsigned size) {
+	return std::max(1u, (unsigned)(size * scale));
+}
+
+static void report(const char *benchmark, const char *metric, double value, const char *unit) {
+	printf("{\"benchmark\":\"%s\",\"metric\":\"%s\",\"value\":%.6g,\"unit\":\"%s\"}\n", benchmark, metric, value, unit);
+	fflush(stdout);
+}
+
+static bool selected(const char *benchmark) {
+	return std::string_view(benchmark).find(filter.getValue()) != std::string_view::npos;
+}
+
+// Fastest of 'repetitions' runs of 'body', in seconds. 'setup' runs
+// before each of them, untimed.
+template <typename Setup, typename Body>
+static double best_seconds(Setup setup, Body body) {
+	double best = 1e300;
+	for (unsigned i = 0; i < std::max(1u, repetitions.getValue()); ++i) {
+		setup();
+		clock_type::time_point start = clock_type::now();
+		body();
+		best = std::min(best, std::chrono::duration<double>(clock_type::now() - start).count());
+	}
+	return best;
+}
+
+template <typename Body>
+static double best_seconds(Body body) {
+	return best_seconds([] {}, body);
+}
+
+struct ParsedProgram {
+	std::vector<std::unique_ptr<FunctionAST>> functions;
+	std::vector<std::unique_ptr<FunctionAST>> exprs;
+	std::vector<std::string> function_names;
+};
+
+static ParsedProgram parse_program(std::string_view source, Stats *stats = nullptr) {
+	ParsedProgram program;
+	Parser parser;
+	parser.stats = stats;
+	parser.lexer.set_input(std::make_unique<StringSourceInput>(source));
+	for (parser.get_next_token(); parser.curr_tok != tok_eof; ) {
+		if (parser.curr_tok == ';') {
+			parser.get_next_token();
+		} else if (parser.curr_tok == tok_def) {
+			program.functions.push_back(parser.parse_definition());
+			if (!program.functions.back())
+				exit(1);
+			program.function_names.push_back(program.functions.back()->proto->name);
+		} else {
+			program.exprs.push_back(parser.parse_top_level_expr());
+			if (!program.exprs.back())
+				exit(1);
+		}
+	}
+	return program;
+}
+
+static std::shared_ptr<llvm::orc::KaleidoscopeJIT> make_jit(const llvm::orc::KaleidoscopeJITOptions &options = {}) {
+	return exit_on_err(llvm::orc::KaleidoscopeJIT::Create(options));
+}
+
+static std::unique_ptr<CodegenVisitor> make_visitor(std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit,
+		std::optional<llvm::OptimizationLevel> opt_level = std::nullopt) {
+	std::unique_ptr<CodegenVisitor> visitor = std::make_unique<CodegenVisitor>(jit);
+	visitor->opt_level = opt_level;
+	visitor->initialize_module_and_managers();
+	return visitor;
+}
+
+static void codegen_functions(CodegenVisitor &visitor, ParsedProgram &program) {
+	for (std::unique_ptr<FunctionAST> &function : program.functions)
+		if (!function->codegen(visitor))
+			exit(1);
+}
+
+// Optimized module with every function of 'program', ready for the JIT
+static llvm::orc::ThreadSafeModule build_module(std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit, ParsedProgram &program,
+		std::optional<llvm::OptimizationLevel> opt_level = std::nullopt) {
+	std::unique_ptr<CodegenVisitor> visitor = make_visitor(jit, opt_level);
+	codegen_functions(*visitor, program);
+	return visitor->take_module();
+}
+
+// The lexer as it was before SourceInput: one getc() per character, and a
+// std::string built for every identifier and number
+static int getc_gettok(FILE *file, int &last_char, std::string &identifier_str, double &num_val) {
+	while (isspace(last_char))
+		last_char = getc(file);
+
+	if (isalpha(last_char)) {
+		identifier_str = last_char;
+		while (isalnum((last_char = getc(file))))
+			identifier_str += last_char;
+		if (identifier_str == "def")
+			return tok_def;
+		if (identifier_str == "extern")
+			return tok_extern;
+		return tok_identifier;
+	}
+
+	if (isdigit(last_char) || last_char == '.') {
+		std::string num_str;
+		bool has_decimal_point = last_char == '.';
+		do {
+			num_str += last_char;
+			last_char = getc(file);
+		} while (isdigit(last_char) || (!has_decimal_point && last_char == '.'));
+		num_val = strtod(num_str.c_str(), 0);
+		return tok_number;
+	}
+
+	if (last_char == '#') {
+		do {
+			last_char = getc(file);
+		} while (last_char != EOF && last_char != '\n' && last_char != '\r');
+		if (last_char != EOF)
+			return getc_gettok(file, last_char, identifier_str, num_val);
+	}
+
+	if (last_char == EOF)
+		return tok_eof;
+
+	int ascii_char = last_char;
+	last_char = getc(file);
+	return ascii_char;
+}
+
+static void bench_lexer() {
+	if (!selected("lexer"))
+		return;
+
+	std::string source = ProgramGenerator(1).many_small_functions(scaled(50000));
+	uint64_t tokens = 0;
+	double seconds = best_seconds([&] { tokens = 0; }, [&] {
+		Lexer lexer(std::make_unique<StringSourceInput>(std::string_view(source)));
+		while (lexer.gettok() != tok_eof)
+			++tokens;
+	});
+	report("lexer", "mb_per_sec", source.size() / seconds / 1e6, "MB/s");
+	report("lexer", "tokens_per_sec", tokens / seconds, "tokens/s");
+
+	// The same source read from a file descriptor, as a script piped or
+	// redirected to stdin, against the getc() lexer it replaced
+	int fd;
+	llvm::SmallString<128> path;
+	if (llvm::sys::fs::createTemporaryFile("kaleidoscope-bench-lexer", "kal", fd, path))
+		return;
+	{
+		llvm::raw_fd_ostream file(fd, /*shouldClose=*/true);
+		file << source;
+	}
+
+	fd = -1;
+	seconds = best_seconds([&] {
+		tokens = 0;
+		if (fd >= 0)
+			close(fd);
+		fd = open(path.c_str(), O_RDONLY);
+	}, [&] {
+		Lexer lexer(std::make_unique<StreamSourceInput>(fd));
+		while (lexer.gettok() != tok_eof)
+			++tokens;
+	});
+	close(fd);
+	report("lexer.stream", "mb_per_sec", source.size() / seconds / 1e6, "MB/s");
+	report("lexer.stream", "tokens_per_sec", tokens / seconds, "tokens/s");
+
+	FILE *file = nullptr;
+	double getc_seconds = best_seconds([&] {
+		if (file)
+			fclose(file);
+		file = fopen(path.c_str(), "r");
+	}, [&] {
+		int last_char = ' ';
+		std::string identifier_str;
+		double num_val;
+		while (getc_gettok(file, last_char, identifier_str, num_val) != tok_eof)
+			;
+	});
+	fclose(file);
+	report("lexer.getc", "mb_per_sec", source.size() / getc_seconds / 1e6, "MB/s");
+	report("lexer.stream", "speedup", getc_seconds / seconds, "x");
+
+	llvm::sys::fs::remove(path);
+}
+
+static void bench_parser() {
+	if (!selected("parser"))
+		return;
+
+	struct Workload {
+		const char *name;
+		std::string source;
+	};
+	Workload workloads[] = {
+		{"parser.small_functions", ProgramGenerator(2).many_small_functions(scaled(20000))},
+		{"parser.deep_expression", ProgramGenerator(3).deep_expression(14)},
+	};
+	for (Workload &workload : workloads) {
+		Stats stats;
+		parse_program(workload.source, &stats);
+		uint64_t nodes = stats.get(Counter::ast_nodes);
+
+		double seconds = best_seconds([&] { parse_program(workload.source); });
+		report(workload.name, "nodes_per_sec", nodes / seconds, "nodes/s");
+		report(workload.name, "mb_per_sec", workload.source.size() / seconds / 1e6, "MB/s");
+	}
+}
+
+static void bench_codegen() {
+	if (!selected("codegen"))
+		return;
+
+	struct Workload {
+		const char *name;
+		std::string source;
+	};
+	Workload workloads[] = {
+		{"codegen.small_functions", ProgramGenerator(4).many_small_functions(scaled(2000))},
+		{"codegen.wide_call_graph", ProgramGenerator(5).wide_call_graph(scaled(2000), 4)},
+	};
+	std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit = make_jit();
+
+	for (Workload &workload : workloads) {
+		ParsedProgram program = parse_program(workload.source);
+		double num_functions = program.functions.size();
+		std::unique_ptr<CodegenVisitor> visitor;
+		std::string name = workload.name;
+
+		// IR emission alone (-O0 defers the passes to the module pipeline)
+		double seconds = best_seconds([&] { visitor = make_visitor(jit, llvm::OptimizationLevel::O0); }, [&] {
+			codegen_functions(*visitor, program);
+		});
+		report((name + ".emit").c_str(), "us_per_function", seconds / num_functions * 1e6, "us");
+
+		// Default mode: a few function passes right after each function
+		seconds = best_seconds([&] { visitor = make_visitor(jit); }, [&] {
+			codegen_functions(*visitor, program);
+		});
+		report((name + ".function_passes").c_str(), "us_per_function", seconds / num_functions * 1e6, "us");
+
+		for (auto [level_name, level] : {std::pair{"O2", llvm::OptimizationLevel::O2}, std::pair{"O3", llvm::OptimizationLevel::O3}}) {
+			seconds = best_seconds([&] {
+				visitor = make_visitor(jit, level);
+				codegen_functions(*visitor, program);
+			}, [&] {
+				visitor->optimize_module();
+			});
+			report((name + "." + level_name).c_str(), "us_per_function", seconds / num_functions * 1e6, "us");
+		}
+	}
+}
+
+static void bench_jit() {
+	if (!selected("jit"))
+		return;
+
+	ParsedProgram program = parse_program(ProgramGenerator(6).many_small_functions(scaled(500), 12));
+	std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit;
+	llvm::orc::ThreadSafeModule module;
+
+	// Everything compiled up front, then the first function called
+	auto time_to_first_call = [&](const llvm::orc::KaleidoscopeJITOptions &options) {
+		return best_seconds([&] {
+			jit = make_jit(options);
+			module = build_module(jit, program);
+		}, [&] {
+			exit_on_err(jit->addModule(std::move(module)));
+			auto function = exit_on_err(jit->lookup(program.function_names[0])).toPtr<double (*)(double, double)>();
+			function(1, 2);
+		});
+	};
+	llvm::orc::KaleidoscopeJITOptions lazy_options;
+	lazy_options.Lazy = true;
+	report("jit.eager", "ms_to_first_call", time_to_first_call({}) * 1e3, "ms");
+	report("jit.lazy", "ms_to_first_call", time_to_first_call(lazy_options) * 1e3, "ms");
+
+	// Whole module materialized, with 0 (in place), 2, 4... compile threads
+	double in_place_seconds = 0;
+	for (unsigned threads = 0; threads <= std::max(4u, std::thread::hardware_concurrency()); threads = threads ? threads * 2 : 2) {
+		llvm::orc::KaleidoscopeJITOptions options;
+		options.CompileThreads = threads;
+		double seconds = best_seconds([&] {
+			jit = make_jit(options);
+			module = build_module(jit, program);
+		}, [&] {
+			exit_on_err(jit->addModule(std::move(module)));
+			exit_on_err(jit->lookupAll(program.function_names).takeError());
+		});
+		if (threads == 0)
+			in_place_seconds = seconds;
+		std::string name = "jit.threads" + std::to_string(threads);
+		report(name.c_str(), "ms_to_compile_all", seconds * 1e3, "ms");
+		report(name.c_str(), "speedup", in_place_seconds / seconds, "x");
+	}
+
+	// Object cache, empty and then filled by the previous run
+	llvm::SmallString<128> cache_dir;
+	if (llvm::sys::fs::createUniqueDirectory("kaleidoscope-bench-cache", cache_dir))
+		return;
+	llvm::orc::KaleidoscopeJITOptions cache_options;
+	cache_options.ObjectCacheDir = std::string(cache_dir);
+	for (const char *name : {"jit.cache_cold", "jit.cache_warm"}) {
+		bool cold = std::string_view(name) == "jit.cache_cold";
+		double seconds = best_seconds([&] {
+			if (cold) {
+				llvm::sys::fs::remove_directories(cache_dir);
+				llvm::sys::fs::create_directories(cache_dir);
+			}
+			jit = make_jit(cache_options);
+			module = build_module(jit, program);
+		}, [&] {
+			exit_on_err(jit->addModule(std::move(module)));
+			exit_on_err(jit->lookupAll(program.function_names).takeError());
+		});
+		report(name, "ms_to_compile_all", seconds * 1e3, "ms");
+	}
+	jit.reset();
+	llvm::sys::fs::remove_directories(cache_dir);
+}
+
+// Latency of a whole REPL round trip for a trivial top-level expression:
+// codegen, JIT, lookup, call and removal, as 'handle_top_level_expr()'.
+// With 'rebuild_pipeline', the context and pass pipeline are set up again
+// after every expression instead of being reused.
+static void bench_repl_latency(const char *name, const llvm::orc::KaleidoscopeJITOptions &jit_options, bool rebuild_pipeline) {
+	if (!selected(name))
+		return;
+
+	ParsedProgram program = parse_program(ProgramGenerator(7).trivial_expressions(scaled(10000)));
+	std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit = make_jit(jit_options);
+	std::unique_ptr<CodegenVisitor> visitor = make_visitor(jit);
+	uint64_t syscalls_before = jit->getStats().MemorySyscalls;
+
+	std::vector<double> latencies;
+	double checksum = 0;
+	for (std::unique_ptr<FunctionAST> &expr : program.exprs) {
+		clock_type::time_point start = clock_type::now();
+
+		if (!expr->codegen(*visitor))
+			exit(1);
+		llvm::orc::ResourceTrackerSP tracker = jit->getMainJITDylib().createResourceTracker();
+		exit_on_err(jit->addModule(visitor->take_module(), tracker));
+		double (*function)() = exit_on_err(jit->lookup("__anon_expr")).toPtr<double (*)()>();
+		checksum += function();
+		exit_on_err(tracker->remove());
+		visitor->defined_functions.erase("__anon_expr");
+		if (rebuild_pipeline)
+			visitor->initialize_module_and_managers();
+
+		latencies.push_back(std::chrono::duration<double>(clock_type::now() - start).count());
+	}
+	if (checksum == 0)
+		exit(1);
+
+	std::sort(latencies.begin(), latencies.end());
+	double total = 0;
+	for (double latency : latencies)
+		total += latency;
+	report(name, "mean_us", total / latencies.size() * 1e6, "us");
+	report(name, "p50_us", latencies[latencies.size() / 2] * 1e6, "us");
+	report(name, "p99_us", latencies[latencies.size() * 99 / 100] * 1e6, "us");
+	report(name, "memory_syscalls_per_expr", (double)(jit->getStats().MemorySyscalls - syscalls_before) / latencies.size(), "calls");
+}
+
+// Calls to small helpers compiled into earlier modules, one definition
+// per module as in the REPL, with and without copying the helpers into
+// the caller's module
+static void bench_cross_module_inlining() {
+	if (!selected("runtime.cross_module_calls"))
+		return;
+
+	const unsigned calls = scaled(1000000);
+	double separate_seconds = 0;
+	for (unsigned max_inline_size : {0u, 40u}) {
+		ParsedProgram program = parse_program(ProgramGenerator(9).helper_calls(16, 32));
+		std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit = make_jit();
+		std::unique_ptr<CodegenVisitor> visitor = make_visitor(jit, llvm::OptimizationLevel::O2);
+		FunctionLibrary library(max_inline_size);
+		visitor->library = &library;
+		for (std::unique_ptr<FunctionAST> &function : program.functions) {
+			if (!function->codegen(*visitor))
+				exit(1);
+			exit_on_err(jit->addModule(visitor->take_module()));
+			library.add(std::move(function));
+		}
+
+		auto caller = exit_on_err(jit->lookup("caller")).toPtr<double (*)(double)>();
+		volatile double sink = 0;
+		double seconds = best_seconds([&] {
+			double sum = 0;
+			for (unsigned i = 0; i < calls; ++i)
+				sum += caller(i * 1e-6);
+			sink = sum;
+		});
+		(void)sink;
+
+		const char *name = max_inline_size ? "runtime.cross_module_calls.library" : "runtime.cross_module_calls.separate";
+		report(name, "ns_per_call", seconds / calls * 1e9, "ns");
+		if (max_inline_size)
+			report(name, "speedup", separate_seconds / seconds, "x");
+		else
+			separate_seconds = seconds;
+	}
+}
+
+// Recursive functions against their tail-recursive forms, which become
+// loops once TailCallElimPass has run
+static void bench_control_flow() {
+	if (!selected("runtime.control_flow"))
+		return;
+
+	ParsedProgram program = parse_program(
+		"def sumrec(n) if n < 1 then 0 else n + sumrec(n - 1);\n"
+		"def sumtail(n acc) if n < 1 then acc else sumtail(n - 1, acc + n);\n"
+		"def fibrec(n) if n < 2 then n else fibrec(n - 1) + fibrec(n - 2);\n"
+		"def fibtail(n a b) if n < 1 then a else fibtail(n - 1, b, a + b);\n"
+	);
+	std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit = make_jit();
+	std::unique_ptr<CodegenVisitor> visitor = make_visitor(jit, llvm::OptimizationLevel::O2);
+	codegen_functions(*visitor, program);
+	exit_on_err(jit->addModule(visitor->take_module()));
+
+	auto sumrec = exit_on_err(jit->lookup("sumrec")).toPtr<double (*)(double)>();
+	auto sumtail = exit_on_err(jit->lookup("sumtail")).toPtr<double (*)(double, double)>();
+	auto fibrec = exit_on_err(jit->lookup("fibrec")).toPtr<double (*)(double)>();
+	auto fibtail = exit_on_err(jit->lookup("fibtail")).toPtr<double (*)(double, double, double)>();
+
+	// Sum of 1 to 1000, then the 25th Fibonacci number
+	const unsigned sum_calls = scaled(10000);
+	const unsigned fib_calls = scaled(20);
+	volatile double sink = 0;
+	double recursive_seconds = best_seconds([&] {
+		for (unsigned i = 0; i < sum_calls; ++i)
+			sink = sumrec(1000);
+	});
+	double tail_seconds = best_seconds([&] {
+		for (unsigned i = 0; i < sum_calls; ++i)
+			sink = sumtail(1000, 0);
+	});
+	report("runtime.control_flow.sum_recursive", "ns_per_call", recursive_seconds / sum_calls * 1e9, "ns");
+	report("runtime.control_flow.sum_tail", "ns_per_call", tail_seconds / sum_calls * 1e9, "ns");
+	report("runtime.control_flow.sum_tail", "speedup", recursive_seconds / tail_seconds, "x");
+
+	recursive_seconds = best_seconds([&] {
+		for (unsigned i = 0; i < fib_calls; ++i)
+			sink = fibrec(25);
+	});
+	tail_seconds = best_seconds([&] {
+		for (unsigned i = 0; i < fib_calls; ++i)
+			sink = fibtail(25, 0, 1);
+	});
+	report("runtime.control_flow.fib_recursive", "us_per_call", recursive_seconds / fib_calls * 1e6, "us");
+	report("runtime.control_flow.fib_tail", "us_per_call", tail_seconds / fib_calls * 1e6, "us");
+	report("runtime.control_flow.fib_tail", "speedup", recursive_seconds / tail_seconds, "x");
+	(void)sink;
+}
+
+// Scaling of a 'parsum' reduction with the number of workers, up to one
+// per hardware thread
+static void bench_parallel() {
+	if (!selected("runtime.parallel_sum"))
+		return;
+
+	// Leibniz series for pi, two terms per iteration
+	ParsedProgram program = parse_program("def leibniz(n) parsum k = 0, n in 4 / (4 * k + 1) - 4 / (4 * k + 3);\n");
+	std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit = make_jit();
+	std::unique_ptr<CodegenVisitor> visitor = make_visitor(jit, llvm::OptimizationLevel::O2);
+	codegen_functions(*visitor, program);
+	exit_on_err(jit->addModule(visitor->take_module()));
+	auto leibniz = exit_on_err(jit->lookup("leibniz")).toPtr<double (*)(double)>();
+
+	const unsigned terms = scaled(50000000);
+	unsigned max_workers = std::max(1u, std::thread::hardware_concurrency());
+	volatile double sink = 0;
+	double single_seconds = 0;
+	for (unsigned workers = 1; ; workers = std::min(workers * 2, max_workers)) {
+		WorkStealingPool::set_global_size(workers);
+		double seconds = best_seconds([&] {
+			sink = leibniz(terms);
+		});
+		if (workers == 1)
+			single_seconds = seconds;
+		std::string name = "runtime.parallel_sum.workers_" + std::to_string(workers);
+		report(name.c_str(), "ns_per_iteration", seconds / terms * 1e9, "ns");
+		report(name.c_str(), "speedup", single_seconds / seconds, "x");
+		if (workers == max_workers)
+			break;
+	}
+	WorkStealingPool::set_global_size(0);
+	(void)sink;
+}
+
+// Speed of the generated code, for the host CPU and the portable baseline
+static void bench_runtime() {
+	if (!selected("runtime"))
+		return;
+
+	ParsedProgram program = parse_program(ProgramGenerator(8).polynomial(16));
+	const unsigned calls = scaled(10000000);
+	const unsigned rows = scaled(1000000);
+	std::vector<double> input(rows), output(rows);
+	for (unsigned i = 0; i < rows; ++i)
+		input[i] = i * 1e-6;
+
+	for (bool portable : {false, true}) {
+		llvm::orc::KaleidoscopeJITOptions options;
+		options.Portable = portable;
+		std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit = make_jit(options);
+		std::unique_ptr<CodegenVisitor> visitor = make_visitor(jit, llvm::OptimizationLevel::O3);
+		codegen_functions(*visitor, program);
+		if (!visitor->emit_batch_wrapper("poly"))
+			exit(1);
+		exit_on_err(jit->addModule(visitor->take_module()));
+
+		auto poly = exit_on_err(jit->lookup("poly")).toPtr<double (*)(double)>();
+		auto poly_batch = exit_on_err(jit->lookup("poly_batch")).toPtr<void (*)(const double *, double *, size_t)>();
+
+		std::string target = portable ? ".portable" : ".host";
+		volatile double sink = 0;
+		double seconds = best_seconds([&] {
+			double sum = 0;
+			for (unsigned i = 0; i < calls; ++i)
+				sum += poly(i * 1e-7);
+			sink = sum;
+		});
+		report(("runtime.poly16_call" + target).c_str(), "ns_per_call", seconds / calls * 1e9, "ns");
+
+		seconds = best_seconds([&] { poly_batch(input.data(), output.data(), rows); });
+		report(("runtime.poly16_batch" + target).c_str(), "mrows_per_sec", rows / seconds / 1e6, "Mrows/s");
+		(void)sink;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope benchmarks\n");
+
+	llvm::InitializeNativeTarget();
+	llvm::InitializeNativeTargetAsmPrinter();
+	llvm::InitializeNativeTargetAsmParser();
+
+	bench_lexer();
+	bench_parser();
+	bench_codegen();
+	bench_jit();
+	llvm::orc::KaleidoscopeJITOptions unpooled;
+	unpooled.MemorySlabSize = 0;
+	bench_repl_latency("repl.trivial_expr", {}, false);
+	bench_repl_latency("repl.trivial_expr_rebuild", {}, true);
+	bench_repl_latency("repl.trivial_expr_unpooled", unpooled, false);
+	bench_runtime();
+	bench_cross_module_inlining();
+	bench_control_flow();
+	bench_parallel();
+
+	return 0;
+}
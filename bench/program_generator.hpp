@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Deterministic generator of synthetic Kaleidoscope programs. It uses its
+// own PRNG instead of <random>'s distributions, whose output differs
+// between standard libraries, so a given seed produces the same program
+// on every machine and results stay comparable across commits.
+class ProgramGenerator {
+    public:
+        explicit ProgramGenerator(uint64_t seed) : state(seed) {}
+
+        // 'count' independent functions 'name0(a b)' ... with bodies of
+        // 'terms' operations each
+        std::string many_small_functions(unsigned count, unsigned terms = 6, const std::string &name = "small") {
+            std::string source;
+            for (unsigned i = 0; i < count; ++i) {
+                source += "def " + name + std::to_string(i) + "(a b) ";
+                source += random_expression(terms, {"a", "b"});
+                source += ";\n";
+            }
+            return source;
+        }
+
+        // 'deep(x)' whose body is a balanced expression tree of the given
+        // depth, i.e. 2^depth leaves
+        std::string deep_expression(unsigned depth) {
+            return "def deep(x) " + balanced_tree(depth) + ";\n";
+        }
+
+        // 'count' functions, each calling up to 'fanout' random earlier
+        // ones. Compiles like a real program, but too expensive to run.
+        std::string wide_call_graph(unsigned count, unsigned fanout) {
+            std::string source;
+            for (unsigned i = 0; i < count; ++i) {
+                source += "def node" + std::to_string(i) + "(x) ";
+                source += random_expression(2, {"x"});
+                for (unsigned j = 0; j < fanout && i > 0; ++j)
+                    source += " + node" + std::to_string(next() % i) + "(x * " + random_constant() + ")";
+                source += ";\n";
+            }
+            return source;
+        }
+
+        // 'poly(x)', a polynomial of the given degree in Horner form
+        std::string polynomial(unsigned degree, const std::string &name = "poly") {
+            std::string body = random_constant();
+            for (unsigned i = 0; i < degree; ++i)
+                body = "(" + body + ") * x + " + random_constant();
+            return "def " + name + "(x) " + body + ";\n";
+        }
+
+        // 'count' one-line helpers 'helper0(x)' ..., then 'caller(x)',
+        // which makes 'calls' calls to them
+        std::string helper_calls(unsigned count, unsigned calls) {
+            std::string source;
+            for (unsigned i = 0; i < count; ++i)
+                source += "def helper" + std::to_string(i) + "(x) " + random_expression(2, {"x"}) + ";\n";
+            source += "def caller(x) 0";
+            for (unsigned i = 0; i < calls; ++i)
+                source += " + helper" + std::to_string(next() % count) + "(x * " + random_constant() + ")";
+            return source + ";\n";
+        }
+
+        // 'count' copies of a trivial top-level expression
+        std::string trivial_expressions(unsigned count) {
+            std::string source;
+            for (unsigned i = 0; i < count; ++i)
+                source += std::to_string(i % 97) + " + 2 * 3;\n";
+            return source;
+        }
+
+        // SplitMix64
+        uint64_t next() {
+            uint64_t z = (state += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            return z ^ (z >> 31);
+        }
+
+    private:
+        uint64_t state;
+
+        std::string random_constant() {
+            // Two decimal digits, printed exactly
+            uint64_t hundredths = 1 + next() % 999;
+            return std::to_string(hundredths / 100) + "." + std::to_string(hundredths / 10 % 10) + std::to_string(hundredths % 10);
+        }
+
+        std::string random_operand(const std::vector<std::string> &vars) {
+            if (next() % 3 == 0)
+                return random_constant();
+            return vars[next() % vars.size()];
+        }
+
+        std::string random_expression(unsigned ops, const std::vector<std::string> &vars) {
+            static const char operators[] = {'+', '-', '*', '+', '*'};
+            std::string expr = random_operand(vars);
+            for (unsigned i = 0; i < ops; ++i) {
+                expr += ' ';
+                expr += operators[next() % sizeof(operators)];
+                expr += ' ';
+                expr += random_operand(vars);
+            }
+            return expr;
+        }
+
+        std::string balanced_tree(unsigned depth) {
+            if (depth == 0)
+                return next() % 2 ? "x" : random_constant();
+            static const char operators[] = {'+', '-', '*'};
+            return "(" + balanced_tree(depth - 1) + " " + operators[next() % sizeof(operators)] + " " + balanced_tree(depth - 1) + ")";
+        }
+};
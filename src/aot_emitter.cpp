@@ -0,0 +1,160 @@
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cctype>
+#include <cstdio>
+
+#include "include/kaleidoscope/aot_emitter.hpp"
+
+AotEmitter::AotEmitter(llvm::orc::JITTargetMachineBuilder jtmb) {
+	// Position independent, so the objects can be linked into PIEs and
+	// shared libraries
+	jtmb.setRelocationModel(llvm::Reloc::PIC_);
+
+	llvm::Expected<std::unique_ptr<llvm::TargetMachine>> tm = jtmb.createTargetMachine();
+	if (!tm) {
+		fprintf(stderr, "Error: %s\n", llvm::toString(tm.takeError()).c_str());
+		return;
+	}
+	target_machine = std::move(*tm);
+}
+
+const char *AotEmitter::file_extension(EmitKind kind) {
+	switch (kind) {
+		case EmitKind::obj:
+			return ".o";
+		case EmitKind::asm_file:
+			return ".s";
+		case EmitKind::ll:
+			return ".ll";
+		case EmitKind::lib:
+			return ".a";
+		default:
+			return "";
+	}
+}
+
+bool AotEmitter::emit(llvm::Module &module, EmitKind kind, const std::string &output_path) {
+	if (!target_machine)
+		return false;
+
+	module.setTargetTriple(target_machine->getTargetTriple().str());
+	module.setDataLayout(target_machine->createDataLayout());
+
+	if (kind == EmitKind::ll) {
+		std::error_code ec;
+		llvm::raw_fd_ostream out(output_path, ec, llvm::sys::fs::OF_Text);
+		if (ec) {
+			fprintf(stderr, "Error: could not open '%s': %s\n", output_path.c_str(), ec.message().c_str());
+			return false;
+		}
+		module.print(out, nullptr);
+		return true;
+	}
+
+#if LLVM_VERSION_MAJOR >= 18
+	llvm::CodeGenFileType file_type = kind == EmitKind::asm_file 
+		? llvm::CodeGenFileType::AssemblyFile : llvm::CodeGenFileType::ObjectFile;
+#else
+	llvm::CodeGenFileType file_type = kind == EmitKind::asm_file 
+		? llvm::CGFT_AssemblyFile : llvm::CGFT_ObjectFile;
+#endif
+
+	llvm::SmallVector<char, 0> buffer;
+	llvm::raw_svector_ostream buffer_stream(buffer);
+	llvm::legacy::PassManager pass_manager;
+	if (target_machine->addPassesToEmitFile(pass_manager, buffer_stream, nullptr, file_type)) {
+		fprintf(stderr, "Error: the target can't emit a file of this type.\n");
+		return false;
+	}
+	pass_manager.run(module);
+
+	if (kind == EmitKind::lib) {
+		std::string member_name = llvm::sys::path::stem(output_path).str() + ".o";
+		llvm::NewArchiveMember member(llvm::MemoryBufferRef(llvm::StringRef(buffer.data(), buffer.size()), member_name));
+		llvm::object::Archive::Kind archive_kind = target_machine->getTargetTriple().isOSDarwin() 
+			? llvm::object::Archive::K_DARWIN : llvm::object::Archive::K_GNU;
+#if LLVM_VERSION_MAJOR >= 18
+		llvm::Error err = llvm::writeArchive(output_path, member, llvm::SymtabWritingMode::NormalSymtab, archive_kind, true, false);
+#else
+		llvm::Error err = llvm::writeArchive(output_path, member, true, archive_kind, true, false);
+#endif
+		if (err) {
+			fprintf(stderr, "Error: %s\n", llvm::toString(std::move(err)).c_str());
+			return false;
+		}
+		return true;
+	}
+
+	std::error_code ec;
+	llvm::raw_fd_ostream out(output_path, ec, llvm::sys::fs::OF_None);
+	if (ec) {
+		fprintf(stderr, "Error: could not open '%s': %s\n", output_path.c_str(), ec.message().c_str());
+		return false;
+	}
+	out << llvm::StringRef(buffer.data(), buffer.size());
+	return true;
+}
+
+bool AotEmitter::emit_header(llvm::Module &module, const std::string &header_path) {
+	std::error_code ec;
+	llvm::raw_fd_ostream out(header_path, ec, llvm::sys::fs::OF_Text);
+	if (ec) {
+		fprintf(stderr, "Error: could not open '%s': %s\n", header_path.c_str(), ec.message().c_str());
+		return false;
+	}
+
+	std::string guard = llvm::sys::path::filename(header_path).str();
+	for (char &c : guard)
+		c = isalnum(static_cast<unsigned char>(c)) ? toupper(static_cast<unsigned char>(c)) : '_';
+	
+	// Chunks of parallel loops are private to the object
+	auto exported = [](const llvm::Function &function) {
+		return !function.isDeclaration() && !function.hasLocalLinkage();
+	};
+	bool has_vectors = llvm::any_of(module, [&](const llvm::Function &function) {
+		return exported(function) && (function.getReturnType()->isVectorTy()
+			|| llvm::any_of(function.args(), [](const llvm::Argument &arg) { return arg.getType()->isVectorTy(); }));
+	});
+
+	out << "/* Generated by kaleidoscope, do not edit. */\n"
+		<< "#ifndef " << guard << "\n"
+		<< "#define " << guard << "\n\n"
+		<< "#ifdef __cplusplus\n"
+		<< "extern \"C\" {\n"
+		<< "#endif\n\n";
+	// Passed in a single register, like the vector types of LLVM the
+	// functions take, only when the caller is built with AVX too
+	if (has_vectors)
+		out << "#ifndef __AVX__\n"
+			<< "#error \"kaleidoscope_vec4 functions must be called from code built with AVX (e.g. -mavx)\"\n"
+			<< "#endif\n";
+	out << "typedef double kaleidoscope_vec4 __attribute__((vector_size(32)));\n\n";
+
+	auto c_type = [](llvm::Type *type) {
+		return type->isVectorTy() ? "kaleidoscope_vec4" : "double";
+	};
+	for (llvm::Function &function : module) {
+		if (!exported(function))
+			continue;
+
+		out << c_type(function.getReturnType()) << " " << function.getName() << "(";
+		if (function.arg_empty())
+			out << "void";
+		for (llvm::Argument &arg : function.args()) 
+			out << (arg.getArgNo() ? ", " : "") << c_type(arg.getType());
+		out << ");\n";
+	}
+
+	out << "\n#ifdef __cplusplus\n"
+		<< "}\n"
+		<< "#endif\n\n"
+		<< "#endif\n";
+	return true;
+}
@@ -0,0 +1,76 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "include/kaleidoscope/arena.hpp"
+
+Arena::Arena(Arena &&other) noexcept 
+			: slabs(std::move(other.slabs)), curr(other.curr), end(other.end), 
+			  next_slab_size(other.next_slab_size), first_slab_size(other.first_slab_size), 
+			  used(other.used) {
+	other.slabs.clear();
+	other.curr = other.end = nullptr;
+	other.next_slab_size = initial_slab_size;
+	other.used = 0;
+}
+
+Arena &Arena::operator=(Arena &&other) noexcept {
+	if (this != &other) {
+		slabs = std::move(other.slabs);
+		curr = other.curr;
+		end = other.end;
+		next_slab_size = other.next_slab_size;
+		first_slab_size = other.first_slab_size;
+		used = other.used;
+
+		other.slabs.clear();
+		other.curr = other.end = nullptr;
+		other.next_slab_size = initial_slab_size;
+		other.used = 0;
+	}
+	return *this;
+}
+
+void *Arena::allocate(size_t size, size_t align) {
+	uintptr_t aligned = (reinterpret_cast<uintptr_t>(curr) + align - 1) & ~(uintptr_t)(align - 1);
+	if (curr && aligned + size <= reinterpret_cast<uintptr_t>(end)) {
+		curr = reinterpret_cast<char *>(aligned + size);
+		used += size;
+		return reinterpret_cast<void *>(aligned);
+	}
+	return allocate_slow(size, align);
+}
+
+void *Arena::allocate_slow(size_t size, size_t align) {
+	// Slabs grow geometrically so that huge generated expressions
+	// only need a handful of mallocs
+	size_t slab_size = std::max(next_slab_size, size + align);
+	next_slab_size = std::min(next_slab_size * 2, max_slab_size);
+
+	slabs.push_back(std::make_unique_for_overwrite<char[]>(slab_size));
+	if (slabs.size() == 1)
+		first_slab_size = slab_size;
+	curr = slabs.back().get();
+	end = curr + slab_size;
+
+	return allocate(size, align);
+}
+
+std::string_view Arena::copy_string(std::string_view str) {
+	if (str.empty())
+		return {};
+	char *data = static_cast<char *>(allocate(str.size(), alignof(char)));
+	std::memcpy(data, str.data(), str.size());
+	return {data, str.size()};
+}
+
+void Arena::reset() {
+	if (slabs.empty())
+		return;
+
+	slabs.resize(1);
+	curr = slabs.front().get();
+	end = curr + first_slab_size;
+	next_slab_size = initial_slab_size * 2;
+	used = 0;
+}
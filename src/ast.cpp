@@ -1,52 +1,91 @@
+#include <algorithm>
+
 #include "include/kaleidoscope/ast.hpp"
 
 /*
-	NumberExprAST methods
+	ExprAST methods
 */
-NumberExprAST::NumberExprAST(double val) : val(val) {}
-
-llvm::Value *NumberExprAST::codegen(CodegenVisitor &visitor) {
-	return visitor.visit_number_expr(const_cast<NumberExprAST &>(*this));
+llvm::Value *ExprAST::codegen(CodegenVisitor &visitor) {
+	switch (kind) {
+		case ExprKind::number:
+			return visitor.visit_number_expr(static_cast<NumberExprAST &>(*this));
+		case ExprKind::variable:
+			return visitor.visit_variable_expr(static_cast<VariableExprAST &>(*this));
+		case ExprKind::binary:
+			return visitor.visit_binary_expr(static_cast<BinaryExprAST &>(*this));
+		case ExprKind::call:
+			return visitor.visit_call_expr(static_cast<CallExprAST &>(*this));
+		case ExprKind::if_expr:
+			return visitor.visit_if_expr(static_cast<IfExprAST &>(*this));
+		case ExprKind::for_expr:
+			return visitor.visit_for_expr(static_cast<ForExprAST &>(*this));
+		case ExprKind::parallel_for_expr:
+			return visitor.visit_parallel_for_expr(static_cast<ParallelForExprAST &>(*this));
+	}
+	return nullptr;
 }
 
 
 /*
-	VariableExprAST methods
+	NumberExprAST methods
 */
-VariableExprAST::VariableExprAST(std::string &name) : name(name) {}
+NumberExprAST::NumberExprAST(double val) : ExprAST(ExprKind::number), val(val) {}
 
-llvm::Value *VariableExprAST::codegen(CodegenVisitor &visitor) {
-	return visitor.visit_variable_expr(const_cast<VariableExprAST &>(*this));
-}
+
+/*
+	VariableExprAST methods
+*/
+VariableExprAST::VariableExprAST(std::string_view name) : ExprAST(ExprKind::variable), name(name) {}
 
 
 /*
 	BinaryExprAST methods
 */
-BinaryExprAST::BinaryExprAST(char op, std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs) 
-			: op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
-
-llvm::Value *BinaryExprAST::codegen(CodegenVisitor &visitor) {
-	return visitor.visit_binary_expr(const_cast<BinaryExprAST &>(*this));
-}
+BinaryExprAST::BinaryExprAST(char op, ExprAST *lhs, ExprAST *rhs) 
+			: ExprAST(ExprKind::binary), op(op), lhs(lhs), rhs(rhs) {}
 
 
 /*
 	CallExprAST methods
 */
-CallExprAST::CallExprAST(const std::string &callee, std::vector<std::unique_ptr<ExprAST>> args) 
-			: callee(callee), args(std::move(args)) {}
+CallExprAST::CallExprAST(std::string_view callee, std::span<ExprAST *> args) 
+			: ExprAST(ExprKind::call), callee(callee), args(args) {}
+
+
+/*
+	IfExprAST methods
+*/
+IfExprAST::IfExprAST(ExprAST *cond, ExprAST *then_expr, ExprAST *else_expr) 
+			: ExprAST(ExprKind::if_expr), cond(cond), then_expr(then_expr), else_expr(else_expr) {}
+
+
+/*
+	ForExprAST methods
+*/
+ForExprAST::ForExprAST(std::string_view var_name, ExprAST *start, ExprAST *end, ExprAST *step, ExprAST *body) 
+			: ExprAST(ExprKind::for_expr), var_name(var_name), start(start), end(end), step(step), body(body) {}
 
-llvm::Value *CallExprAST::codegen(CodegenVisitor &visitor) {
-	return visitor.visit_call_expr(const_cast<CallExprAST &>(*this));
-}
+
+/*
+	ParallelForExprAST methods
+*/
+ParallelForExprAST::ParallelForExprAST(std::string_view var_name, ExprAST *start, ExprAST *end, ExprAST *body, bool reduce) 
+			: ExprAST(ExprKind::parallel_for_expr), var_name(var_name), start(start), end(end), body(body), reduce(reduce) {}
 
 
 /*
 	PrototypeAST methods
 */
 PrototypeAST::PrototypeAST(const std::string &name, std::vector<std::string> args) 
-			: name(name), args(std::move(args)) {}
+			: name(name), args(std::move(args)), arg_types(this->args.size(), ValueType::number) {}
+
+bool PrototypeAST::has_vectors() const {
+	return return_type == ValueType::vec4 || std::find(arg_types.begin(), arg_types.end(), ValueType::vec4) != arg_types.end();
+}
+
+bool PrototypeAST::same_signature(const PrototypeAST &other) const {
+	return arg_types == other.arg_types && return_type == other.return_type;
+}
 
 llvm::Function *PrototypeAST::codegen(CodegenVisitor &visitor) {
 	return visitor.visit_prototype(const_cast<PrototypeAST &>(*this));
@@ -56,8 +95,8 @@ llvm::Function *PrototypeAST::codegen(CodegenVisitor &visitor) {
 /*
 	FunctionAST methods
 */
-FunctionAST::FunctionAST(std::unique_ptr<PrototypeAST> proto, std::unique_ptr<ExprAST> body)
-			: proto(std::move(proto)), body(std::move(body)) {}
+FunctionAST::FunctionAST(std::unique_ptr<PrototypeAST> proto, ExprAST *body, Arena arena)
+			: proto(std::move(proto)), body(body), arena(std::move(arena)) {}
 
 llvm::Function *FunctionAST::codegen(CodegenVisitor &visitor) {
 	return visitor.visit_function(const_cast<FunctionAST &>(*this));
@@ -1,16 +1,29 @@
 #include "include/kaleidoscope/codegen_visitor.hpp"
 #include "include/kaleidoscope/error.hpp"
+#include "include/kaleidoscope/function_library.hpp"
+#include "include/kaleidoscope/parallel_runtime.hpp"
 
 CodegenVisitor::CodegenVisitor(std::shared_ptr<llvm::orc::KaleidoscopeJIT> og_jit_ptr) {
-	context = std::make_unique<llvm::LLVMContext>();
-	builder = std::make_unique<llvm::IRBuilder<>>(*context);
-	module = std::make_unique<llvm::Module>("KaleidoscopeJIT", *context);
-
 	jit = og_jit_ptr;
+	create_target_machine(jit->getTargetMachineBuilder());
+
+	this->initialize_module_and_managers();
+}
+
+CodegenVisitor::CodegenVisitor(const llvm::orc::JITTargetMachineBuilder &target) {
+	create_target_machine(target);
 
 	this->initialize_module_and_managers();
 }
 
+void CodegenVisitor::create_target_machine(llvm::orc::JITTargetMachineBuilder jtmb) {
+	llvm::Expected<std::unique_ptr<llvm::TargetMachine>> tm = jtmb.createTargetMachine();
+	if (tm)
+		target_machine = std::move(*tm);
+	else
+		llvm::consumeError(tm.takeError()); // Passes fall back to generic cost models
+}
+
 void CodegenVisitor::initialize_module_and_managers() {
 	// std::make_unique<>() calls the destructor of the previous
 	// object, but both "module" and "builder" hold references to 
@@ -19,20 +32,32 @@ void CodegenVisitor::initialize_module_and_managers() {
 	// This undefined behavior goes on and it's only manifested
 	// when accessing the object later on, making the bug REALLY
 	// hard to catch...
-	builder.reset();
-	module.reset();
-	context.reset();
+	// The same goes for the analysis managers: the module one holds a
+	// proxy that clears the function one when destroyed, and both cache
+	// results pointing into the module. They go first, outermost first.
+	if (context) {
+		auto lock = thread_safe_context.getLock();
+		module_analysis_manager.reset();
+		control_graph_analysis_manager.reset();
+		function_analysis_manager.reset();
+		loop_analysis_manager.reset();
+		standard_instrumentations.reset();
+		builder.reset();
+		module.reset();
+	}
 
-	// Create new context and module
-	context = std::make_unique<llvm::LLVMContext>();
-	module = std::make_unique<llvm::Module>("KaleidoscopeJIT", *context);
-	module->setDataLayout(jit->getDataLayout());
+	// Create new context, shared with the modules still held by the JIT
+	thread_safe_context = llvm::orc::ThreadSafeContext(std::make_unique<llvm::LLVMContext>());
+	context = thread_safe_context.getContext();
+	modules_in_context = 0;
+	auto lock = thread_safe_context.getLock();
 
-	// Create new builder for the module
+	// Create new builder for the context
 	builder = std::make_unique<llvm::IRBuilder<>>(*context);
 
 	// Pass and analysis managers
-	function_pass_manager = std::make_unique<llvm::FunctionPassManager>();
+	function_pass_manager.reset();
+	module_pass_manager.reset();
 	loop_analysis_manager = std::make_unique<llvm::LoopAnalysisManager>();
 	function_analysis_manager = std::make_unique<llvm::FunctionAnalysisManager>();
 	control_graph_analysis_manager = std::make_unique<llvm::CGSCCAnalysisManager>();
@@ -42,22 +67,365 @@ void CodegenVisitor::initialize_module_and_managers() {
 
 	standard_instrumentations->registerCallbacks(*pass_instrumentation_callbacks, module_analysis_manager.get());
 
-	// Add transform passes
-	function_pass_manager->addPass(llvm::InstCombinePass()); // Canonical form pass
-	function_pass_manager->addPass(llvm::ReassociatePass()); // Expression reassociation
-	function_pass_manager->addPass(llvm::GVNPass()); // GVN algorithm for CSE
-	function_pass_manager->addPass(llvm::SimplifyCFGPass()); // Simplify CFG
+	// Timers are reset every time they are printed, i.e. per module
+	time_passes_handler.reset();
+	if (time_passes) {
+		time_passes_handler = std::make_unique<llvm::TimePassesHandler>(true);
+		time_passes_handler->registerCallbacks(*pass_instrumentation_callbacks);
+	}
+	if (stats && stats->per_pass)
+		stats->register_pass_callbacks(*pass_instrumentation_callbacks);
+
+	llvm::PipelineTuningOptions tuning_options;
+	if (opt_level) {
+		tuning_options.LoopVectorization = opt_level->getSpeedupLevel() >= 2;
+		tuning_options.SLPVectorization = opt_level->getSpeedupLevel() >= 2;
+	}
+	llvm::PassBuilder pass_builder(target_machine.get(), tuning_options, std::nullopt, pass_instrumentation_callbacks.get());
+
+	if (opt_level) {
+		// Whole-module pipeline, run by 'optimize_module()' once every
+		// function of the module has been emitted
+		module_pass_manager = std::make_unique<llvm::ModulePassManager>(
+			*opt_level == llvm::OptimizationLevel::O0 
+				? pass_builder.buildO0DefaultPipeline(*opt_level) 
+				: pass_builder.buildPerModuleDefaultPipeline(*opt_level)
+		);
+	} else {
+		// Add transform passes
+		function_pass_manager = std::make_unique<llvm::FunctionPassManager>();
+		function_pass_manager->addPass(llvm::InstCombinePass()); // Canonical form pass
+		function_pass_manager->addPass(llvm::ReassociatePass()); // Expression reassociation
+		function_pass_manager->addPass(llvm::GVNPass()); // GVN algorithm for CSE
+		function_pass_manager->addPass(llvm::SimplifyCFGPass()); // Simplify CFG
+		function_pass_manager->addPass(llvm::TailCallElimPass()); // Self tail calls to loops
+
+		llvm::LoopPassManager loop_pass_manager;
+		loop_pass_manager.addPass(llvm::LoopRotatePass()); // Condition at the end of loops
+		loop_pass_manager.addPass(llvm::LICMPass()); // Hoist invariant code
+		loop_pass_manager.addPass(llvm::IndVarSimplifyPass()); // Canonical induction variables
+		function_pass_manager->addPass(llvm::createFunctionToLoopPassAdaptor(std::move(loop_pass_manager), /*UseMemorySSA=*/true));
+		function_pass_manager->addPass(llvm::InstCombinePass()); // Clean up after the loop passes
+	}
 
 	// Register analysis passes used in the transform passes
-	llvm::PassBuilder pass_builder;
 	pass_builder.registerModuleAnalyses(*module_analysis_manager);
+	pass_builder.registerCGSCCAnalyses(*control_graph_analysis_manager);
 	pass_builder.registerFunctionAnalyses(*function_analysis_manager);
+	pass_builder.registerLoopAnalyses(*loop_analysis_manager);
 	pass_builder.crossRegisterProxies(
 		*loop_analysis_manager, 
 		*function_analysis_manager, 
 		*control_graph_analysis_manager, 
 		*module_analysis_manager
 	);
+
+	start_module();
+}
+
+void CodegenVisitor::reset_module() {
+	if (modules_in_context >= max_modules_per_context) {
+		initialize_module_and_managers();
+		return;
+	}
+
+	auto lock = thread_safe_context.getLock();
+	// Cached results point into the module being dropped or handed over.
+	// Clearing the module manager also clears the inner ones through its
+	// proxies, but not the results of the per-function passes.
+	module_analysis_manager->clear();
+	control_graph_analysis_manager->clear();
+	function_analysis_manager->clear();
+	loop_analysis_manager->clear();
+	module.reset();
+	start_module();
+}
+
+void CodegenVisitor::start_module() {
+	module = std::make_unique<llvm::Module>("KaleidoscopeJIT", *context);
+	if (jit)
+		module->setDataLayout(jit->getDataLayout());
+	else if (target_machine)
+		module->setDataLayout(target_machine->createDataLayout());
+	if (target_machine)
+		module->setTargetTriple(target_machine->getTargetTriple().str());
+	builder->ClearInsertionPoint();
+}
+
+void CodegenVisitor::optimize_module() {
+	if (!module_pass_manager)
+		return;
+
+	auto lock = thread_safe_context.getLock();
+	ScopedPhase phase(stats, Phase::optimize);
+	if (stats)
+		stats->add(Counter::ir_instructions_before_opt, module->getInstructionCount());
+	module_pass_manager->run(*module, *module_analysis_manager);
+	if (stats)
+		stats->add(Counter::ir_instructions_after_opt, module->getInstructionCount());
+	if (time_passes_handler)
+		time_passes_handler->print();
+}
+
+llvm::orc::ThreadSafeModule CodegenVisitor::take_module(bool redefinable) {
+	if (redefinable) {
+		auto lock = thread_safe_context.getLock();
+		jit->renameForRedefinition(*module);
+	}
+	optimize_module();
+
+	// Held until the analyses cached for the module are cleared, as the
+	// JIT may compile and free it on another thread once it's unlocked
+	auto lock = thread_safe_context.getLock();
+	llvm::orc::ThreadSafeModule thread_safe_module(std::move(module), thread_safe_context);
+	++modules_in_context;
+	reset_module();
+	return thread_safe_module;
+}
+
+llvm::Function *CodegenVisitor::get_function(std::string_view name) {
+	if (llvm::Function *function = module->getFunction(name))
+		return function;
+
+	llvm::Function *function = declare_function(name);
+	// Only the module pipelines above -O0 have an inliner. Copies of
+	// memoized functions would compute their results again.
+	if (function && library && opt_level && *opt_level != llvm::OptimizationLevel::O0
+			&& !(memo_tables && memo_tables->requested(name))) {
+		if (std::shared_ptr<const FunctionAST> function_node = library->find(name))
+			emit_library_copy(*function, *function_node);
+	}
+	return function;
+}
+
+llvm::Function *CodegenVisitor::declare_function(std::string_view name) {
+	if (llvm::Function *function = module->getFunction(name))
+		return function;
+
+	auto proto_it = function_protos.find(name);
+	if (proto_it != function_protos.end())
+		return proto_it->second->codegen(*this);
+
+	if (find_external_proto) {
+		if (std::unique_ptr<PrototypeAST> proto = find_external_proto(name)) {
+			llvm::Function *function = proto->codegen(*this);
+			function_protos.emplace(name, std::move(proto));
+			return function;
+		}
+	}
+
+	return nullptr;
+}
+
+void CodegenVisitor::emit_library_copy(llvm::Function &function, const FunctionAST &function_node) {
+	// Called while emitting the body of a caller
+	llvm::IRBuilderBase::InsertPoint caller_insert_point = builder->saveIP();
+	std::map<std::string, llvm::Value *, std::less<>> caller_values = std::move(named_values);
+	llvm::IRBuilderBase::FastMathFlagGuard caller_fast_math(*builder);
+	bool caller_is_pure = body_is_pure;
+	bool caller_always_returns = body_always_returns;
+	unsigned caller_next_branch = next_branch;
+	next_branch = 0;
+
+	named_values.clear();
+	unsigned i = 0;
+	for (llvm::Argument &arg : function.args()) {
+		arg.setName(function_node.proto->args[i++]);
+		named_values[std::string(arg.getName())] = &arg;
+	}
+	builder->SetInsertPoint(llvm::BasicBlock::Create(*context, "entry", &function));
+	set_fast_math(function, *function_node.proto);
+
+	if (llvm::Value *ret_val = function_node.body->codegen(*this)) {
+		builder->CreateRet(ret_val);
+		// Never emitted: calls left after inlining go to the compiled function
+		function.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+		if (profile)
+			profile->apply(function, function_node.proto->name);
+	} else {
+		function.deleteBody();
+	}
+
+	builder->restoreIP(caller_insert_point);
+	named_values = std::move(caller_values);
+	body_is_pure = caller_is_pure;
+	body_always_returns = caller_always_returns;
+	next_branch = caller_next_branch;
+}
+
+llvm::FastMathFlags CodegenVisitor::fast_math_for(const PrototypeAST &prototype_node) const {
+	llvm::FastMathFlags flags;
+	switch (prototype_node.float_mode) {
+		case FloatMode::session:
+			return fast_math;
+		case FloatMode::strict:
+			return flags;
+		case FloatMode::fast:
+			flags.setFast();
+			return flags;
+	}
+	return flags;
+}
+
+void CodegenVisitor::set_fast_math(llvm::Function &function, const PrototypeAST &prototype_node) {
+	llvm::FastMathFlags flags = fast_math_for(prototype_node);
+	builder->setFastMathFlags(flags);
+	add_fast_math_attributes(function, flags);
+}
+
+void CodegenVisitor::add_fast_math_attributes(llvm::Function &function, llvm::FastMathFlags flags) {
+	// Some backend combines only look at the function attributes
+	if (flags.noNaNs())
+		function.addFnAttr("no-nans-fp-math", "true");
+	if (flags.noInfs())
+		function.addFnAttr("no-infs-fp-math", "true");
+	if (flags.noSignedZeros())
+		function.addFnAttr("no-signed-zeros-fp-math", "true");
+	if (flags.approxFunc())
+		function.addFnAttr("approx-func-fp-math", "true");
+	if (flags.isFast())
+		function.addFnAttr("unsafe-fp-math", "true");
+}
+
+bool CodegenVisitor::is_pure_library_function(std::string_view name) {
+	static const std::set<std::string_view> pure_functions = {
+		"sin", "cos", "tan", "asin", "acos", "atan", "atan2", "sinh", "cosh", "tanh",
+		"exp", "exp2", "expm1", "log", "log2", "log10", "log1p", "sqrt", "cbrt", "pow", "hypot",
+		"fabs", "floor", "ceil", "round", "trunc", "fmod", "fmin", "fmax", "copysign",
+	};
+	return pure_functions.contains(name);
+}
+
+llvm::Type *CodegenVisitor::llvm_type(ValueType type) const {
+	llvm::Type *double_type = llvm::Type::getDoubleTy(*context);
+	if (type == ValueType::vec4)
+		return llvm::FixedVectorType::get(double_type, vec4_lanes);
+	return double_type;
+}
+
+bool CodegenVisitor::is_vector_builtin(std::string_view name) {
+	return name == "vec4" || name == "lane" || name == "hsum" || name == "hmin" || name == "hmax";
+}
+
+// For error messages
+static const char *type_name(llvm::Type *type) {
+	return type->isVectorTy() ? "vec4" : "number";
+}
+
+void CodegenVisitor::add_purity_attributes(llvm::Function &function, bool always_returns) {
+	function.setDoesNotAccessMemory();
+	function.setDoesNotThrow();
+	if (always_returns)
+		function.setWillReturn();
+}
+
+void CodegenVisitor::emit_counter_increment(uint64_t *counter, llvm::Value *increment) {
+	if (!increment)
+		increment = builder->getInt64(1);
+	llvm::Value *counter_ptr = builder->CreateIntToPtr(builder->getInt64((uintptr_t)counter), builder->getPtrTy(), "counter");
+	builder->CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter_ptr, increment, llvm::MaybeAlign(8), llvm::AtomicOrdering::Monotonic);
+}
+
+void CodegenVisitor::emit_cond_branch(llvm::Value *value, llvm::BasicBlock *if_true, llvm::BasicBlock *if_false) {
+	llvm::Value *condition = builder->CreateFCmpONE(value, llvm::ConstantFP::get(*context, llvm::APFloat(0.0)), "cond");
+	llvm::StringRef function_name = builder->GetInsertBlock()->getParent()->getName();
+	unsigned index = next_branch++;
+
+	if (instrumentation && function_name != "__anon_expr") {
+		// Counted before branching, without adding blocks on the edges
+		uint64_t *counters = instrumentation->branch_counters(function_name, index);
+		llvm::Value *taken = builder->CreateZExt(condition, builder->getInt64Ty(), "taken");
+		emit_counter_increment(&counters[0], taken);
+		emit_counter_increment(&counters[1], builder->CreateSub(builder->getInt64(1), taken, "nottaken"));
+	}
+
+	llvm::BranchInst *branch = builder->CreateCondBr(condition, if_true, if_false);
+	if (profile) {
+		if (llvm::MDNode *weights = profile->branch_weights(*context, function_name, index))
+			branch->setMetadata(llvm::LLVMContext::MD_prof, weights);
+	}
+}
+
+llvm::Value *CodegenVisitor::emit_memo_entry(llvm::Function &function, MemoTable &table) {
+	// Fibonacci hashing of the argument bits
+	const uint64_t multiplier = 0x9e3779b97f4a7c15;
+	llvm::Value *hash = builder->getInt64(multiplier);
+	for (llvm::Argument &arg : function.args()) {
+		llvm::Value *bits = builder->CreateBitCast(&arg, builder->getInt64Ty(), "bits");
+		hash = builder->CreateMul(builder->CreateXor(hash, bits), builder->getInt64(multiplier), "hash");
+	}
+	llvm::Value *index = builder->CreateLShr(hash, 64 - MemoTable::log2_entries, "index");
+	llvm::Value *entries = builder->CreateIntToPtr(builder->getInt64((uintptr_t)table.entries.data()), builder->getPtrTy(), "entries");
+	llvm::Value *offset = builder->CreateMul(index, builder->getInt64(table.entry_words), "offset");
+	return builder->CreateInBoundsGEP(builder->getInt64Ty(), entries, offset, "entry");
+}
+
+void CodegenVisitor::emit_memo_store(llvm::Function &function, MemoTable &table, llvm::Value *result) {
+	// The version goes odd while the entry is written, then to the next
+	// even value. A writer finding it odd, or losing the race to make it
+	// odd, leaves the entry to the other one.
+	llvm::Type *word_type = builder->getInt64Ty();
+	llvm::BasicBlock *write_bb = llvm::BasicBlock::Create(*context, "memo.write", &function);
+	llvm::BasicBlock *done_bb = llvm::BasicBlock::Create(*context, "memo.done", &function);
+	llvm::Value *entry = emit_memo_entry(function, table);
+	llvm::LoadInst *version = builder->CreateAlignedLoad(word_type, entry, llvm::Align(8), "version");
+	version->setAtomic(llvm::AtomicOrdering::Monotonic);
+	llvm::Value *stable = builder->CreateAnd(version, builder->getInt64(~(uint64_t)1), "stable");
+	llvm::Value *exchange = builder->CreateAtomicCmpXchg(entry, stable, builder->CreateAdd(stable, builder->getInt64(1)),
+		llvm::MaybeAlign(8), llvm::AtomicOrdering::Acquire, llvm::AtomicOrdering::Monotonic);
+	builder->CreateCondBr(builder->CreateExtractValue(exchange, 1, "claimed"), write_bb, done_bb);
+
+	builder->SetInsertPoint(write_bb);
+	auto store_word = [&](llvm::Value *value, unsigned word) {
+		llvm::Value *word_ptr = builder->CreateConstInBoundsGEP1_64(word_type, entry, word);
+		builder->CreateAlignedStore(builder->CreateBitCast(value, word_type), word_ptr, llvm::Align(8))
+			->setAtomic(llvm::AtomicOrdering::Monotonic);
+	};
+	unsigned word = 1;
+	for (llvm::Argument &arg : function.args())
+		store_word(&arg, word++);
+	store_word(result, word);
+	builder->CreateAlignedStore(builder->CreateAdd(stable, builder->getInt64(2), "filled"), entry, llvm::Align(8))
+		->setAtomic(llvm::AtomicOrdering::Release);
+	builder->CreateBr(done_bb);
+
+	builder->SetInsertPoint(done_bb);
+	emit_counter_increment(&table.misses);
+}
+
+void CodegenVisitor::emit_memo_lookup(llvm::Function &function, MemoTable &table) {
+	llvm::Type *word_type = builder->getInt64Ty();
+	llvm::BasicBlock *body_bb = &function.getEntryBlock();
+	llvm::BasicBlock *lookup_bb = llvm::BasicBlock::Create(*context, "memo.lookup", &function, body_bb);
+	llvm::BasicBlock *hit_bb = llvm::BasicBlock::Create(*context, "memo.hit", &function, body_bb);
+
+	// Only a hit if the version was even (and not 0, never filled) and
+	// didn't change while the words were read
+	builder->SetInsertPoint(lookup_bb);
+	llvm::Value *entry = emit_memo_entry(function, table);
+	auto load_word = [&](unsigned word, llvm::AtomicOrdering ordering, const char *name) {
+		llvm::Value *word_ptr = builder->CreateConstInBoundsGEP1_64(word_type, entry, word);
+		llvm::LoadInst *load = builder->CreateAlignedLoad(word_type, word_ptr, llvm::Align(8), name);
+		load->setAtomic(ordering);
+		return load;
+	};
+	llvm::Value *version = load_word(0, llvm::AtomicOrdering::Acquire, "version");
+	llvm::Value *found = builder->CreateAnd(
+		builder->CreateICmpNE(version, builder->getInt64(0)),
+		builder->CreateICmpEQ(builder->CreateAnd(version, builder->getInt64(1)), builder->getInt64(0)), "found");
+	unsigned word = 1;
+	for (llvm::Argument &arg : function.args()) {
+		llvm::Value *key = load_word(word++, llvm::AtomicOrdering::Monotonic, "key");
+		found = builder->CreateAnd(found, builder->CreateICmpEQ(key, builder->CreateBitCast(&arg, word_type)), "found");
+	}
+	llvm::Value *result = load_word(word, llvm::AtomicOrdering::Monotonic, "cached");
+	builder->CreateFence(llvm::AtomicOrdering::Acquire);
+	llvm::Value *unchanged = builder->CreateICmpEQ(load_word(0, llvm::AtomicOrdering::Monotonic, "recheck"), version);
+	builder->CreateCondBr(builder->CreateAnd(found, unchanged, "found"), hit_bb, body_bb);
+
+	builder->SetInsertPoint(hit_bb);
+	emit_counter_increment(&table.hits);
+	builder->CreateRet(builder->CreateBitCast(result, builder->getDoubleTy()));
 }
 
 llvm::Value *CodegenVisitor::visit_number_expr(NumberExprAST &number_expr) {
@@ -67,9 +435,9 @@ llvm::Value *CodegenVisitor::visit_number_expr(NumberExprAST &number_expr) {
 }
 
 llvm::Value *CodegenVisitor::visit_variable_expr(VariableExprAST &variable_expr) {
-    std::map<std::string, llvm::Value *>::iterator v_it = named_values.find(variable_expr.name);
+    auto v_it = named_values.find(variable_expr.name);
 	if (v_it == named_values.end()) 
-		log_error_value("Unkown variable name.");
+		return log_error_value("Unkown variable name.");
 	return v_it->second;
 }
 
@@ -79,6 +447,13 @@ llvm::Value *CodegenVisitor::visit_binary_expr(BinaryExprAST &binary_expr) {
 	if (!lhs_value || !rhs_value)
 		return nullptr;
 
+	// A number with a vec4 goes to every lane
+	if (lhs_value->getType()->isVectorTy() && !rhs_value->getType()->isVectorTy())
+		rhs_value = builder->CreateVectorSplat(vec4_lanes, rhs_value, "splat");
+	else if (rhs_value->getType()->isVectorTy() && !lhs_value->getType()->isVectorTy())
+		lhs_value = builder->CreateVectorSplat(vec4_lanes, lhs_value, "splat");
+	llvm::Type *value_type = lhs_value->getType();
+
 	switch (binary_expr.op) {
 		case '+':
 			return builder->CreateFAdd(lhs_value, rhs_value, "addtmp");
@@ -90,72 +465,453 @@ llvm::Value *CodegenVisitor::visit_binary_expr(BinaryExprAST &binary_expr) {
 			return builder->CreateFDiv(lhs_value, rhs_value, "divtmp");
 		case '<':
 			lhs_value = builder->CreateFCmpULT(lhs_value, rhs_value, "lcmptmp");
-			return builder->CreateUIToFP(lhs_value, llvm::Type::getDoubleTy(*context), "booltmp");
+			return builder->CreateUIToFP(lhs_value, value_type, "booltmp");
 		case '>':
 			lhs_value = builder->CreateFCmpUGT(lhs_value, rhs_value, "gcmptmp");
-			return builder->CreateUIToFP(lhs_value, llvm::Type::getDoubleTy(*context), "booltmp");
+			return builder->CreateUIToFP(lhs_value, value_type, "booltmp");
 		default:
 			return log_error_value("Invalid binary operator.");
 	}
 }
 
 llvm::Value *CodegenVisitor::visit_call_expr(CallExprAST &call_expr) {
-    llvm::Function *callee_function = module->getFunction(call_expr.callee);
+	if (is_vector_builtin(call_expr.callee))
+		return emit_vector_builtin(call_expr);
+
+    llvm::Function *callee_function = get_function(call_expr.callee);
 	if (!callee_function)
 		return log_error_value("Unkown function referenced.");
 
 	if (callee_function->arg_size() != call_expr.args.size()) 
 		return log_error_value("Incorrect number of arguments passed to function.");
 
+	// Recursion is fine for purity, but nothing proves it ends
+	if (callee_function == builder->GetInsertBlock()->getParent()) {
+		body_always_returns = false;
+	} else {
+		auto proto_it = function_protos.find(call_expr.callee);
+		if (proto_it == function_protos.end() || !proto_it->second->pure)
+			body_is_pure = false;
+		if (proto_it == function_protos.end() || !proto_it->second->always_returns)
+			body_always_returns = false;
+	}
+
 	std::vector<llvm::Value *> args_values;
 	for (unsigned i = 0, e = call_expr.args.size(); i != e; ++i) {
 		args_values.push_back(call_expr.args[i]->codegen(*this));
 		if (!args_values.back())
 			return nullptr;
+		llvm::Type *param_type = callee_function->getArg(i)->getType();
+		if (args_values.back()->getType() != param_type) {
+			std::string message = "Argument " + std::to_string(i + 1) + " of '" + std::string(call_expr.callee)
+				+ "' must be a " + type_name(param_type) + ".";
+			return log_error_value(message.c_str());
+		}
 	}
 
 	return builder->CreateCall(callee_function, args_values, "calltmp");
 }
 
+llvm::Value *CodegenVisitor::emit_vector_builtin(CallExprAST &call_expr) {
+	std::vector<llvm::Value *> args_values;
+	for (ExprAST *arg : call_expr.args) {
+		args_values.push_back(arg->codegen(*this));
+		if (!args_values.back())
+			return nullptr;
+	}
+	auto is_vector = [&](unsigned i) {
+		return args_values[i]->getType()->isVectorTy();
+	};
+
+	if (call_expr.callee == "vec4") {
+		if (args_values.size() == 1 && !is_vector(0))
+			return builder->CreateVectorSplat(vec4_lanes, args_values[0], "broadcast");
+		if (args_values.size() != vec4_lanes || is_vector(0) || is_vector(1) || is_vector(2) || is_vector(3))
+			return log_error_value("vec4() takes 1 or 4 numbers.");
+		llvm::Value *vector = llvm::PoisonValue::get(llvm_type(ValueType::vec4));
+		for (unsigned i = 0; i < vec4_lanes; ++i)
+			vector = builder->CreateInsertElement(vector, args_values[i], builder->getInt32(i), "vec");
+		return vector;
+	}
+
+	if (call_expr.callee == "lane") {
+		// The lane is known when compiling, so it never goes through memory
+		auto *index = args_values.size() == 2 ? llvm::dyn_cast<llvm::ConstantFP>(args_values[1]) : nullptr;
+		double lane = index ? index->getValueAPF().convertToDouble() : -1.0;
+		if (!is_vector(0) || !(lane == 0.0 || lane == 1.0 || lane == 2.0 || lane == 3.0))
+			return log_error_value("lane() takes a vec4 and a lane number from 0 to 3.");
+		return builder->CreateExtractElement(args_values[0], builder->getInt32((unsigned)lane), "lane");
+	}
+
+	if (args_values.size() != 1 || !is_vector(0)) {
+		std::string message = std::string(call_expr.callee) + "() takes a vec4.";
+		return log_error_value(message.c_str());
+	}
+	if (call_expr.callee == "hsum") {
+		// Added pairwise rather than lane after lane, as with 'parsum'
+		llvm::Value *sum = builder->CreateFAddReduce(llvm::ConstantFP::getNegativeZero(builder->getDoubleTy()), args_values[0]);
+		llvm::cast<llvm::Instruction>(sum)->setHasAllowReassoc(true);
+		return sum;
+	}
+	// NaN lanes are ignored, as by the C library's fmin() and fmax()
+	if (call_expr.callee == "hmin")
+		return builder->CreateFPMinReduce(args_values[0]);
+	return builder->CreateFPMaxReduce(args_values[0]);
+}
+
+
+llvm::Value *CodegenVisitor::visit_if_expr(IfExprAST &if_expr) {
+	llvm::Value *cond_value = if_expr.cond->codegen(*this);
+	if (!cond_value)
+		return nullptr;
+	if (cond_value->getType()->isVectorTy())
+		return log_error_value("Condition of 'if' must be a number.");
+
+	// Blocks are moved after the code of the previous branch once it is
+	// emitted, so that they come in source order
+	llvm::Function *function = builder->GetInsertBlock()->getParent();
+	llvm::BasicBlock *then_bb = llvm::BasicBlock::Create(*context, "then", function);
+	llvm::BasicBlock *else_bb = llvm::BasicBlock::Create(*context, "else", function);
+	llvm::BasicBlock *merge_bb = llvm::BasicBlock::Create(*context, "ifcont", function);
+	emit_cond_branch(cond_value, then_bb, else_bb);
+
+	builder->SetInsertPoint(then_bb);
+	llvm::Value *then_value = if_expr.then_expr->codegen(*this);
+	if (!then_value)
+		return nullptr;
+	builder->CreateBr(merge_bb);
+	// Nested control flow moves the end of the branch to another block
+	then_bb = builder->GetInsertBlock();
+
+	else_bb->moveAfter(then_bb);
+	builder->SetInsertPoint(else_bb);
+	llvm::Value *else_value = if_expr.else_expr->codegen(*this);
+	if (!else_value)
+		return nullptr;
+	if (else_value->getType() != then_value->getType())
+		return log_error_value("Both branches of 'if' must be numbers, or both vec4s.");
+	builder->CreateBr(merge_bb);
+	else_bb = builder->GetInsertBlock();
+
+	merge_bb->moveAfter(else_bb);
+	builder->SetInsertPoint(merge_bb);
+	llvm::PHINode *phi = builder->CreatePHI(then_value->getType(), 2, "iftmp");
+	phi->addIncoming(then_value, then_bb);
+	phi->addIncoming(else_value, else_bb);
+	return phi;
+}
+
+llvm::Value *CodegenVisitor::visit_for_expr(ForExprAST &for_expr) {
+	llvm::Value *start_value = for_expr.start->codegen(*this);
+	if (!start_value)
+		return nullptr;
+	if (start_value->getType()->isVectorTy())
+		return log_error_value("Start of 'for' must be a number.");
+
+	// The variable shadows any parameter of the same name
+	std::string var_name(for_expr.var_name);
+	auto old_it = named_values.find(var_name);
+	llvm::Value *old_value = old_it == named_values.end() ? nullptr : old_it->second;
+	auto restore = [&] {
+		if (old_value)
+			named_values[var_name] = old_value;
+		else
+			named_values.erase(var_name);
+	};
+
+	// Rotated loop: the condition is checked once before entering it,
+	// then at the end of each iteration
+	named_values[var_name] = start_value;
+	llvm::Value *first_end_value = for_expr.end->codegen(*this);
+	if (!first_end_value) {
+		restore();
+		return nullptr;
+	}
+	if (first_end_value->getType()->isVectorTy()) {
+		restore();
+		return log_error_value("End condition of 'for' must be a number.");
+	}
+	llvm::Function *function = builder->GetInsertBlock()->getParent();
+	llvm::BasicBlock *preheader_bb = builder->GetInsertBlock();
+	llvm::BasicBlock *loop_bb = llvm::BasicBlock::Create(*context, "loop", function);
+	llvm::BasicBlock *after_bb = llvm::BasicBlock::Create(*context, "afterloop", function);
+	emit_cond_branch(first_end_value, loop_bb, after_bb);
+
+	builder->SetInsertPoint(loop_bb);
+	llvm::PHINode *variable = builder->CreatePHI(llvm::Type::getDoubleTy(*context), 2, var_name);
+	variable->addIncoming(start_value, preheader_bb);
+	named_values[var_name] = variable;
+
+	// The value of the body is ignored, but its errors aren't
+	if (!for_expr.body->codegen(*this)) {
+		restore();
+		return nullptr;
+	}
+
+	llvm::Value *step_value = for_expr.step 
+		? for_expr.step->codegen(*this) 
+		: llvm::ConstantFP::get(*context, llvm::APFloat(1.0));
+	if (!step_value) {
+		restore();
+		return nullptr;
+	}
+	if (step_value->getType()->isVectorTy()) {
+		restore();
+		return log_error_value("Step of 'for' must be a number.");
+	}
+	llvm::Value *next_value = builder->CreateFAdd(variable, step_value, "nextvar");
+
+	named_values[var_name] = next_value;
+	llvm::Value *end_value = for_expr.end->codegen(*this);
+	restore();
+	if (!end_value)
+		return nullptr;
+	llvm::BasicBlock *loop_end_bb = builder->GetInsertBlock();
+	emit_cond_branch(end_value, loop_bb, after_bb);
+	variable->addIncoming(next_value, loop_end_bb);
+
+	after_bb->moveAfter(loop_end_bb);
+	builder->SetInsertPoint(after_bb);
+	// Loops may never end, nothing proves they do
+	body_always_returns = false;
+	return llvm::ConstantFP::get(*context, llvm::APFloat(0.0));
+}
+
+llvm::Value *CodegenVisitor::visit_parallel_for_expr(ParallelForExprAST &parallel_expr) {
+	llvm::Value *start_value = parallel_expr.start->codegen(*this);
+	if (!start_value)
+		return nullptr;
+	llvm::Value *end_value = parallel_expr.end->codegen(*this);
+	if (!end_value)
+		return nullptr;
+	if (start_value->getType()->isVectorTy() || end_value->getType()->isVectorTy())
+		return log_error_value("Bounds of a parallel loop must be numbers.");
+
+	// Every variable in scope is handed to the chunk, which only loads
+	// the ones its body reads
+	std::vector<std::pair<std::string, llvm::Type *>> captured;
+	for (const auto &[name, value] : named_values)
+		captured.emplace_back(name, value->getType());
+	llvm::Function *chunk = emit_parallel_chunk(parallel_expr, captured);
+	if (!chunk)
+		return nullptr;
+
+	llvm::Type *double_type = llvm::Type::getDoubleTy(*context);
+	llvm::Type *ptr_type = llvm::PointerType::get(*context, 0);
+	llvm::Type *index_type = llvm::Type::getInt64Ty(*context);
+	// vec4 captures take 4 doubles
+	unsigned num_slots = 1;
+	for (const auto &[name, type] : captured)
+		num_slots += type->isVectorTy() ? vec4_lanes : 1;
+	llvm::Function *function = builder->GetInsertBlock()->getParent();
+	llvm::IRBuilder<> entry_builder(&function->getEntryBlock(), function->getEntryBlock().begin());
+	llvm::Value *captures = entry_builder.CreateAlloca(double_type, builder->getInt32(num_slots), "captures");
+	builder->CreateStore(start_value, captures);
+	unsigned slot = 1;
+	for (const auto &[name, type] : captured) {
+		llvm::Value *capture_ptr = builder->CreateConstInBoundsGEP1_32(double_type, captures, slot, "captureptr");
+		builder->CreateAlignedStore(named_values[name], capture_ptr, llvm::Align(8));
+		slot += type->isVectorTy() ? vec4_lanes : 1;
+	}
+
+	// As many iterations as integers in [0, end - start), counted like
+	// 'parallel_trip_count()': none for a NaN span, and few enough for
+	// the conversion to be defined
+	llvm::Value *zero = llvm::ConstantFP::get(*context, llvm::APFloat(0.0));
+	llvm::Value *span = builder->CreateFSub(end_value, start_value, "span");
+	llvm::Value *ceiled = builder->CreateUnaryIntrinsic(llvm::Intrinsic::ceil, span);
+	llvm::Value *capped = builder->CreateMinNum(ceiled, llvm::ConstantFP::get(*context, llvm::APFloat(max_parallel_trips)));
+	llvm::Value *trips = builder->CreateSelect(builder->CreateFCmpOGT(ceiled, zero), capped, zero, "trips");
+	llvm::Value *count = builder->CreateFPToSI(trips, index_type, "count");
+
+	llvm::FunctionCallee runtime = module->getOrInsertFunction("kaleidoscope_parallel_reduce",
+		llvm::FunctionType::get(double_type, {ptr_type, ptr_type, index_type, index_type}, false));
+	llvm::Value *sum = builder->CreateCall(runtime, {chunk, captures, llvm::ConstantInt::get(index_type, 0), count}, "parsum");
+
+	// The runtime reads 'captures', and the body may run forever
+	body_is_pure = false;
+	body_always_returns = false;
+	return parallel_expr.reduce ? sum : zero;
+}
+
+llvm::Function *CodegenVisitor::emit_parallel_chunk(ParallelForExprAST &parallel_expr,
+		const std::vector<std::pair<std::string, llvm::Type *>> &captured) {
+	llvm::Type *double_type = llvm::Type::getDoubleTy(*context);
+	llvm::Type *index_type = llvm::Type::getInt64Ty(*context);
+	llvm::FunctionType *chunk_type = llvm::FunctionType::get(
+		double_type, {llvm::PointerType::get(*context, 0), index_type, index_type}, false
+	);
+	llvm::Function *function = builder->GetInsertBlock()->getParent();
+	llvm::Function *chunk = llvm::Function::Create(
+		chunk_type, llvm::Function::InternalLinkage, function->getName() + ".par", module.get()
+	);
+	add_fast_math_attributes(*chunk, builder->getFastMathFlags());
+	llvm::Argument *captures = chunk->getArg(0);
+	captures->setName("captures");
+	captures->addAttr(llvm::Attribute::NoAlias);
+	captures->addAttr(llvm::Attribute::NoCapture);
+	captures->addAttr(llvm::Attribute::ReadOnly);
+	llvm::Argument *begin = chunk->getArg(1);
+	begin->setName("begin");
+	llvm::Argument *end = chunk->getArg(2);
+	end->setName("end");
+	outlined_functions.push_back(chunk);
+
+	// Called while emitting the body of the loop's function
+	llvm::IRBuilderBase::InsertPoint outer_insert_point = builder->saveIP();
+	std::map<std::string, llvm::Value *, std::less<>> outer_values = std::move(named_values);
+	unsigned outer_next_branch = next_branch;
+	next_branch = 0;
+
+	llvm::BasicBlock *entry_bb = llvm::BasicBlock::Create(*context, "entry", chunk);
+	llvm::BasicBlock *loop_bb = llvm::BasicBlock::Create(*context, "loop", chunk);
+	llvm::BasicBlock *exit_bb = llvm::BasicBlock::Create(*context, "exit", chunk);
+
+	builder->SetInsertPoint(entry_bb);
+	llvm::Value *start_value = builder->CreateLoad(double_type, captures, "start");
+	named_values.clear();
+	unsigned slot = 1;
+	for (const auto &[name, type] : captured) {
+		llvm::Value *capture_ptr = builder->CreateConstInBoundsGEP1_32(double_type, captures, slot, "captureptr");
+		named_values[name] = builder->CreateAlignedLoad(type, capture_ptr, llvm::Align(8), name);
+		slot += type->isVectorTy() ? vec4_lanes : 1;
+	}
+	llvm::Value *is_empty = builder->CreateICmpSGE(begin, end, "isempty");
+	builder->CreateCondBr(is_empty, exit_bb, loop_bb);
+
+	builder->SetInsertPoint(loop_bb);
+	llvm::Value *zero = llvm::ConstantFP::get(*context, llvm::APFloat(0.0));
+	llvm::PHINode *index = builder->CreatePHI(index_type, 2, "index");
+	index->addIncoming(begin, entry_bb);
+	llvm::PHINode *sum = nullptr;
+	if (parallel_expr.reduce) {
+		sum = builder->CreatePHI(double_type, 2, "sum");
+		sum->addIncoming(zero, entry_bb);
+	}
+	std::string var_name(parallel_expr.var_name);
+	llvm::Value *offset = builder->CreateSIToFP(index, double_type, "offset");
+	named_values[var_name] = builder->CreateFAdd(start_value, offset, var_name);
+
+	llvm::Value *value = parallel_expr.body->codegen(*this);
+	if (value && sum && value->getType()->isVectorTy())
+		value = log_error_value("Body of 'parsum' must be a number.");
+	if (value) {
+		llvm::BasicBlock *loop_end_bb = builder->GetInsertBlock();
+		llvm::Value *next_sum = nullptr;
+		if (sum) {
+			// Sums are in no particular order anyway, which lets the
+			// loop be vectorized
+			next_sum = builder->CreateFAdd(sum, value, "nextsum");
+			if (auto *add = llvm::dyn_cast<llvm::Instruction>(next_sum))
+				add->setHasAllowReassoc(true);
+			sum->addIncoming(next_sum, loop_end_bb);
+		}
+		llvm::Value *next_index = builder->CreateNSWAdd(index, llvm::ConstantInt::get(index_type, 1), "nextindex");
+		index->addIncoming(next_index, loop_end_bb);
+		llvm::Value *is_done = builder->CreateICmpEQ(next_index, end, "isdone");
+		builder->CreateCondBr(is_done, exit_bb, loop_bb);
+
+		exit_bb->moveAfter(loop_end_bb);
+		builder->SetInsertPoint(exit_bb);
+		llvm::Value *result = zero;
+		if (sum) {
+			llvm::PHINode *result_phi = builder->CreatePHI(double_type, 2, "result");
+			result_phi->addIncoming(zero, entry_bb);
+			result_phi->addIncoming(next_sum, loop_end_bb);
+			result = result_phi;
+		}
+		builder->CreateRet(result);
+	}
+
+	builder->restoreIP(outer_insert_point);
+	named_values = std::move(outer_values);
+	next_branch = outer_next_branch;
+	if (value)
+		return chunk;
+
+	std::erase(outlined_functions, chunk);
+	function_analysis_manager->clear(*chunk, chunk->getName());
+	chunk->eraseFromParent();
+	return nullptr;
+}
 
 llvm::Function *CodegenVisitor::visit_prototype(PrototypeAST &prototype_node) {
-	std::vector<llvm::Type *> doubles_args(prototype_node.args.size(), llvm::Type::getDoubleTy(*context));
+	auto lock = thread_safe_context.getLock();
+	// Objects compiled ahead of time are called from C and C++, which pass
+	// vec4 values differently without AVX (the Engine checks its own)
+	if (!jit && prototype_node.has_vectors()
+			&& !(target_machine && llvm::orc::KaleidoscopeJIT::supportsVec4(*target_machine)))
+		return (llvm::Function *)log_error_value("vec4 values need a target with AVX (see --mcpu and --mattr).");
+	std::vector<llvm::Type *> args_types;
+	for (ValueType arg_type : prototype_node.arg_types)
+		args_types.push_back(llvm_type(arg_type));
 	llvm::FunctionType *function_type = 
-		llvm::FunctionType::get(llvm::Type::getDoubleTy(*context), doubles_args, false);
+		llvm::FunctionType::get(llvm_type(prototype_node.return_type), args_types, false);
 	llvm::Function *function = 
 		llvm::Function::Create(function_type, llvm::Function::ExternalLinkage, prototype_node.name, module.get());
 
 	unsigned i = 0;
 	for (llvm::Argument &arg : function->args())
 		arg.setName(prototype_node.args[i++]);
+
+	if (prototype_node.pure)
+		add_purity_attributes(*function, prototype_node.always_returns);
+
+	// Hot or cold, as seen by the calls to it
+	if (profile)
+		profile->apply(*function, prototype_node.name);
 	
 	return function;
 }
 
 llvm::Function *CodegenVisitor::visit_function(FunctionAST &function_node) {
-	llvm::Function *function = module->getFunction(function_node.proto->name);
-
-	if (!function)
-		function = function_node.proto->codegen(*this);
-	else {
-		// making sure that the current function signature
-		// is the one being considered (bug from section 3.4)
-		if (function->arg_size() != function_node.proto->args.size()) {
-			// Parameter overloading function with the same name
-			// TODO: allow overloading based on prototype's parameter list;
-			return (llvm::Function *)log_error_value("Cannot redefine function with different parameter list.");
-		}
-		unsigned i = 0;
-		for (llvm::Argument &arg : function->args()) 
-			arg.setName(function_node.proto->args[i++]);
+	auto lock = thread_safe_context.getLock();
+	const std::string &name = function_node.proto->name;
+	auto proto_it = function_protos.find(name);
+	if (proto_it != function_protos.end() && !proto_it->second->same_signature(*function_node.proto)) {
+		// Parameter overloading function with the same name
+		// TODO: allow overloading based on prototype's parameter list;
+		return (llvm::Function *)log_error_value("Cannot redefine function with different parameter list.");
 	}
-	if (!function)
+	if (defined_functions.contains(name) && !allow_redefinition)
+		return (llvm::Function *)log_error_value("Function cannot be redefined.");
+	// Registered before the body so that recursive calls find it, and
+	// put back as it was if the definition fails
+	std::unique_ptr<PrototypeAST> previous_proto;
+	if (proto_it != function_protos.end())
+		previous_proto = std::move(proto_it->second);
+	function_protos[name] = std::make_unique<PrototypeAST>(*function_node.proto);
+	auto restore_proto = [&] {
+		if (previous_proto)
+			function_protos[name] = std::move(previous_proto);
+		else
+			function_protos.erase(name);
+	};
+
+	llvm::Function *function = declare_function(name);
+	if (!function) {
+		restore_proto();
 		return nullptr;
-	if (!function->empty())	
+	}
+	if (!function->empty()) {
+		restore_proto();
 		return (llvm::Function *)log_error_value("Function cannot be redefined.");
+	}
+
+	// making sure that the current function signature
+	// is the one being considered (bug from section 3.4)
+	unsigned i = 0;
+	for (llvm::Argument &arg : function->args()) 
+		arg.setName(function_node.proto->args[i++]);
 
 	llvm::BasicBlock *bb = llvm::BasicBlock::Create(*context, "entry", function);
 	builder->SetInsertPoint(bb);
+	set_fast_math(*function, *function_node.proto);
+
+	Profile *entry_counts = instrumentation ? instrumentation : call_counts;
+	bool counts_calls = entry_counts && name != "__anon_expr";
+	if (counts_calls)
+		emit_counter_increment(entry_counts->counter(name));
 
 	// Currently, there's no variable declaration. So we can 
 	// safely clear the variable's symbol table (named_values)
@@ -164,18 +920,173 @@ llvm::Function *CodegenVisitor::visit_function(FunctionAST &function_node) {
 	for (llvm::Argument &arg : function->args()) 
 		named_values[std::string(arg.getName())] = &arg;
 
+	body_is_pure = true;
+	body_always_returns = true;
+	next_branch = 0;
+	outlined_functions.clear();
 	llvm::Value *ret_val = function_node.body->codegen(*this);
+	if (ret_val && ret_val->getType() != function->getReturnType()) {
+		if (name == "__anon_expr")
+			log_error_value("Top-level expressions must be numbers, use lane() or hsum() on vec4 values.");
+		else if (ret_val->getType()->isVectorTy())
+			log_error_value("Function body is a vec4, but the function returns a number.");
+		else
+			log_error_value("Function body is a number, but the function returns a vec4.");
+		ret_val = nullptr;
+	}
 	if (ret_val) {
+		MemoTable *memo_table = nullptr;
+		if (memo_tables && memo_tables->requested(name)) {
+			if (function_node.proto->has_vectors())
+				fprintf(stderr, "Warning: '%s' takes or returns vec4 values, it is not memoized.\n", name.c_str());
+			else if (body_is_pure)
+				memo_table = memo_tables->table_for(name, function->arg_size());
+			else
+				fprintf(stderr, "Warning: '%s' calls functions not known to be pure, it is not memoized.\n", name.c_str());
+		}
+		if (memo_table)
+			emit_memo_store(*function, *memo_table, ret_val);
 		builder->CreateRet(ret_val);
+		if (memo_table)
+			emit_memo_lookup(*function, *memo_table);
+
+		if (body_is_pure) {
+			// Filling the memo table or counting the call still writes
+			// memory, which neither the body nor its callers may drop
+			bool writes_memory = memo_table || counts_calls;
+			if (writes_memory) {
+				function->setDoesNotThrow();
+				if (body_always_returns)
+					function->setWillReturn();
+			} else {
+				add_purity_attributes(*function, body_always_returns);
+			}
+			// Callers compiled later rely on it, which a redefinition
+			// with side effects would break
+			if (!allow_redefinition && !writes_memory) {
+				function_node.proto->pure = function_protos[name]->pure = true;
+				function_node.proto->always_returns = function_protos[name]->always_returns = body_always_returns;
+			}
+		}
 
 		llvm::verifyFunction(*function);
+		for (llvm::Function *chunk : outlined_functions)
+			llvm::verifyFunction(*chunk);
+
+		if (profile)
+			profile->apply(*function, name);
 		
-		// Run optimizations
-		function_pass_manager->run(*function, *function_analysis_manager);
+		// Run optimizations, unless they're left to the module pipeline
+		if (function_pass_manager) {
+			ScopedPhase phase(stats, Phase::optimize);
+			// Along with the chunks of its parallel loops
+			std::vector<llvm::Function *> optimized_functions = outlined_functions;
+			optimized_functions.push_back(function);
+			for (llvm::Function *optimized : optimized_functions) {
+				if (stats)
+					stats->add(Counter::ir_instructions_before_opt, optimized->getInstructionCount());
+				function_pass_manager->run(*optimized, *function_analysis_manager);
+				if (stats)
+					stats->add(Counter::ir_instructions_after_opt, optimized->getInstructionCount());
+			}
+		}
+		outlined_functions.clear();
 
+		defined_functions.insert(name);
 		return function;
 	}
 
+	restore_proto();
+	// The function manager outlives the module, its address may be reused
+	function_analysis_manager->clear(*function, function->getName());
 	function->eraseFromParent();
+	// Chunks of library copies stay, the copies call them
+	for (llvm::Function *chunk : outlined_functions) {
+		if (chunk->use_empty()) {
+			function_analysis_manager->clear(*chunk, chunk->getName());
+			chunk->eraseFromParent();
+		}
+	}
+	outlined_functions.clear();
 	return nullptr;
 }
+
+llvm::Function *CodegenVisitor::emit_batch_wrapper(std::string_view name) {
+	auto lock = thread_safe_context.getLock();
+	llvm::Function *function = get_function(name);
+	if (!function)
+		return (llvm::Function *)log_error_value("Unkown function referenced.");
+
+	llvm::Type *double_type = llvm::Type::getDoubleTy(*context);
+	llvm::Type *ptr_type = llvm::PointerType::get(*context, 0);
+	// 'size_t', as wide as a pointer
+	llvm::Type *index_type = module->getDataLayout().getIntPtrType(*context);
+
+	// vec4 columns hold 4 doubles per row, lane after lane
+	auto element_ptr = [&](llvm::Value *column, llvm::Type *element_type, llvm::Value *row) {
+		if (element_type->isVectorTy())
+			row = builder->CreateNUWMul(row, llvm::ConstantInt::get(index_type, vec4_lanes), "lanes");
+		return builder->CreateInBoundsGEP(double_type, column, row, "elementptr");
+	};
+
+	unsigned arity = function->arg_size();
+	std::vector<llvm::Type *> params(arity + 1, ptr_type);
+	params.push_back(index_type);
+	llvm::FunctionType *batch_type = llvm::FunctionType::get(llvm::Type::getVoidTy(*context), params, false);
+	llvm::Function *batch = llvm::Function::Create(
+		batch_type, llvm::Function::ExternalLinkage, std::string(name) + "_batch", module.get()
+	);
+
+	for (unsigned i = 0; i <= arity; ++i) {
+		llvm::Argument *column = batch->getArg(i);
+		column->addAttr(llvm::Attribute::NoAlias);
+		column->addAttr(llvm::Attribute::NoCapture);
+		if (i < arity) {
+			column->addAttr(llvm::Attribute::ReadOnly);
+			column->setName(function->getArg(i)->getName());
+		} else {
+			column->addAttr(llvm::Attribute::WriteOnly);
+			column->setName("out");
+		}
+	}
+	llvm::Argument *num_rows = batch->getArg(arity + 1);
+	num_rows->setName("n");
+
+	llvm::BasicBlock *entry_bb = llvm::BasicBlock::Create(*context, "entry", batch);
+	llvm::BasicBlock *loop_bb = llvm::BasicBlock::Create(*context, "loop", batch);
+	llvm::BasicBlock *exit_bb = llvm::BasicBlock::Create(*context, "exit", batch);
+
+	builder->SetInsertPoint(entry_bb);
+	builder->clearFastMathFlags();
+	llvm::Value *is_empty = builder->CreateICmpEQ(num_rows, llvm::ConstantInt::get(index_type, 0), "isempty");
+	builder->CreateCondBr(is_empty, exit_bb, loop_bb);
+
+	builder->SetInsertPoint(loop_bb);
+	llvm::PHINode *row = builder->CreatePHI(index_type, 2, "row");
+	row->addIncoming(llvm::ConstantInt::get(index_type, 0), entry_bb);
+
+	std::vector<llvm::Value *> args_values;
+	for (unsigned i = 0; i < arity; ++i) {
+		llvm::Type *arg_type = function->getArg(i)->getType();
+		llvm::Value *arg_ptr = element_ptr(batch->getArg(i), arg_type, row);
+		args_values.push_back(builder->CreateAlignedLoad(arg_type, arg_ptr, llvm::Align(8), "arg"));
+	}
+	llvm::Value *result = builder->CreateCall(function, args_values, "calltmp");
+	llvm::Value *out_ptr = element_ptr(batch->getArg(arity), function->getReturnType(), row);
+	builder->CreateAlignedStore(result, out_ptr, llvm::Align(8));
+
+	llvm::Value *next_row = builder->CreateNUWAdd(row, llvm::ConstantInt::get(index_type, 1), "nextrow");
+	row->addIncoming(next_row, loop_bb);
+	llvm::Value *is_done = builder->CreateICmpEQ(next_row, num_rows, "isdone");
+	builder->CreateCondBr(is_done, exit_bb, loop_bb);
+
+	builder->SetInsertPoint(exit_bb);
+	builder->CreateRetVoid();
+
+	llvm::verifyFunction(*batch);
+
+	if (function_pass_manager)
+		function_pass_manager->run(*batch, *function_analysis_manager);
+
+	return batch;
+}
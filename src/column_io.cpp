@@ -0,0 +1,171 @@
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+
+#include <sys/types.h>
+
+#include "llvm/ADT/StringRef.h"
+
+#include "include/kaleidoscope/column_io.hpp"
+
+namespace {
+
+class CsvColumnSource : public ColumnSource {
+	public:
+		CsvColumnSource(FILE *file, unsigned num_columns) : file(file), num_columns(num_columns) {}
+
+		~CsvColumnSource() override {
+			free(line);
+			fclose(file);
+		}
+
+		size_t read(std::vector<std::vector<double>> &columns, size_t max_rows) override {
+			size_t rows = 0;
+			ssize_t length;
+			while (rows < max_rows && (length = getline(&line, &line_capacity, file)) >= 0) {
+				++line_number;
+				std::string_view rest(line, length);
+				while (!rest.empty() && (rest.back() == '\n' || rest.back() == '\r'))
+					rest.remove_suffix(1);
+				if (rest.empty())
+					continue;
+
+				// Every field is parsed, so that extra ones are caught too
+				unsigned fields = 0;
+				bool numeric = true;
+				while (num_columns > 0) {
+					size_t comma = rest.find(',');
+					std::string_view field = rest.substr(0, comma);
+					while (!field.empty() && field.front() == ' ')
+						field.remove_prefix(1);
+					while (!field.empty() && field.back() == ' ')
+						field.remove_suffix(1);
+
+					double value;
+					std::from_chars_result parsed = std::from_chars(field.data(), field.data() + field.size(), value);
+					if (parsed.ec != std::errc() || parsed.ptr != field.data() + field.size()) {
+						numeric = false;
+						break;
+					}
+					if (fields < num_columns)
+						columns[fields][rows] = value;
+					++fields;
+
+					if (comma == std::string_view::npos)
+						break;
+					rest.remove_prefix(comma + 1);
+				}
+
+				// A non-numeric first line is a header
+				if (!numeric && line_number == 1)
+					continue;
+				if (!numeric || fields != num_columns) {
+					fprintf(stderr, "Error: line %zu of the CSV input doesn't have exactly %u numeric fields.\n", line_number, num_columns);
+					failed = true;
+					return 0;
+				}
+				++rows;
+			}
+			return rows;
+		}
+
+	private:
+		FILE *file;
+		unsigned num_columns;
+		size_t line_number = 0;
+		// Grown by getline() to the longest line read so far
+		char *line = nullptr;
+		size_t line_capacity = 0;
+};
+
+class BinaryColumnSource : public ColumnSource {
+	public:
+		BinaryColumnSource(std::vector<FILE *> files) : files(std::move(files)) {}
+
+		~BinaryColumnSource() override {
+			for (FILE *file : files)
+				fclose(file);
+		}
+
+		size_t read(std::vector<std::vector<double>> &columns, size_t max_rows) override {
+			size_t rows = max_rows;
+			for (size_t i = 0; i < files.size(); ++i) 
+				rows = std::min(rows, fread(columns[i].data(), sizeof(double), max_rows, files[i]));
+			
+			// Columns of different lengths end at the shortest one
+			return rows;
+		}
+
+	private:
+		std::vector<FILE *> files;
+};
+
+} // namespace
+
+std::unique_ptr<ColumnSource> ColumnSource::open(const std::vector<std::string> &paths, unsigned num_columns) {
+	if (paths.size() == 1 && llvm::StringRef(paths[0]).ends_with_insensitive(".csv")) {
+		FILE *file = fopen(paths[0].c_str(), "r");
+		if (!file) {
+			fprintf(stderr, "Error: could not open '%s'.\n", paths[0].c_str());
+			return nullptr;
+		}
+		return std::make_unique<CsvColumnSource>(file, num_columns);
+	}
+
+	if (paths.size() != num_columns) {
+		fprintf(stderr, "Error: expected one CSV file or %u binary column files.\n", num_columns);
+		return nullptr;
+	}
+
+	std::vector<FILE *> files;
+	for (const std::string &path : paths) {
+		FILE *file = fopen(path.c_str(), "rb");
+		if (!file) {
+			fprintf(stderr, "Error: could not open '%s'.\n", path.c_str());
+			for (FILE *opened : files)
+				fclose(opened);
+			return nullptr;
+		}
+		files.push_back(file);
+	}
+	return std::make_unique<BinaryColumnSource>(std::move(files));
+}
+
+ColumnSink::~ColumnSink() {
+	if (owns_file)
+		fclose(file);
+	else
+		fflush(file);
+}
+
+std::unique_ptr<ColumnSink> ColumnSink::open(const std::string &path) {
+	std::unique_ptr<ColumnSink> sink(new ColumnSink());
+	if (path.empty()) {
+		sink->file = stdout;
+		return sink;
+	}
+
+	sink->text = llvm::StringRef(path).ends_with_insensitive(".csv");
+	sink->file = fopen(path.c_str(), sink->text ? "w" : "wb");
+	if (!sink->file) {
+		fprintf(stderr, "Error: could not open '%s'.\n", path.c_str());
+		return nullptr;
+	}
+	sink->owns_file = true;
+	return sink;
+}
+
+bool ColumnSink::write(const double *values, size_t count) {
+	if (!text)
+		return fwrite(values, sizeof(double), count, file) == count;
+
+	char buffer[32];
+	for (size_t i = 0; i < count; ++i) {
+		std::to_chars_result printed = std::to_chars(buffer, buffer + sizeof(buffer) - 1, values[i]);
+		*printed.ptr++ = '\n';
+		if (fwrite(buffer, 1, printed.ptr - buffer, file) != (size_t)(printed.ptr - buffer))
+			return false;
+	}
+	return true;
+}
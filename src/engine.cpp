@@ -0,0 +1,328 @@
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/Error.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "parser.cpp"
+#include "include/kaleidoscope/codegen_visitor.hpp"
+#include "include/kaleidoscope/engine.hpp"
+#include "include/kaleidoscope/function_library.hpp"
+
+llvm::Expected<std::unique_ptr<Engine>> Engine::create(const EngineOptions &options) {
+	llvm::Expected<std::unique_ptr<llvm::orc::KaleidoscopeJIT>> jit = llvm::orc::KaleidoscopeJIT::Create(options.jit);
+	if (!jit)
+		return jit.takeError();
+	llvm::Expected<std::unique_ptr<llvm::TargetMachine>> target_machine = (*jit)->getTargetMachineBuilder().createTargetMachine();
+	if (!target_machine)
+		return target_machine.takeError();
+
+	std::unique_ptr<Engine> engine(new Engine(options, std::move(*jit)));
+	engine->supports_vec4 = llvm::orc::KaleidoscopeJIT::supportsVec4(**target_machine);
+	return std::move(engine);
+}
+
+Engine::Engine(const EngineOptions &options, std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit)
+			: options(options), jit(std::move(jit)) {
+	if (options.max_inline_size > 0 && !options.hot_swap)
+		library = std::make_unique<FunctionLibrary>(options.max_inline_size);
+}
+
+// Out of line, where CodegenVisitor is complete
+Engine::~Engine() = default;
+
+llvm::Expected<Engine::ModuleHandle> Engine::compile(std::string_view source) {
+	Parser parser;
+	parser.lexer.set_input(std::make_unique<StringSourceInput>(source));
+
+	std::vector<std::unique_ptr<FunctionAST>> definitions;
+	std::vector<std::unique_ptr<PrototypeAST>> externs;
+	for (parser.get_next_token(); parser.curr_tok != tok_eof; ) {
+		switch (parser.curr_tok) {
+			case tok_def:
+				definitions.push_back(parser.parse_definition());
+				if (!definitions.back())
+					return llvm::createStringError(llvm::inconvertibleErrorCode(), "invalid definition");
+				break;
+			case tok_extern:
+				externs.push_back(parser.parse_extern());
+				if (!externs.back())
+					return llvm::createStringError(llvm::inconvertibleErrorCode(), "invalid extern");
+				break;
+			case ';':
+				parser.get_next_token();
+				break;
+			default:
+				return llvm::createStringError(llvm::inconvertibleErrorCode(), "top-level expressions can't be compiled");
+		}
+	}
+
+	// Claim the names up front, so that two threads can't define the same
+	// function at once. They are only registered once the module is in
+	// the JIT, until then other modules can't call them.
+	ModuleHandle handle;
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		auto check = [&](const PrototypeAST &proto, bool defining) -> llvm::Error {
+			if (!supports_vec4 && proto.has_vectors())
+				return llvm::createStringError(llvm::inconvertibleErrorCode(),
+					"function '%s' takes or returns vec4 values, which need a target with AVX", proto.name.c_str());
+			if (defining && pending_definitions.contains(proto.name))
+				return llvm::createStringError(llvm::inconvertibleErrorCode(),
+					"function '%s' is being compiled by another thread", proto.name.c_str());
+			auto function_it = functions.find(proto.name);
+			if (function_it == functions.end())
+				return llvm::Error::success();
+			if (!function_it->second.proto.same_signature(proto))
+				return llvm::createStringError(llvm::inconvertibleErrorCode(),
+					"cannot redefine function '%s' with different parameter list", proto.name.c_str());
+			if (defining && function_it->second.owner != 0 && !options.hot_swap)
+				return llvm::createStringError(llvm::inconvertibleErrorCode(),
+					"function '%s' cannot be redefined", proto.name.c_str());
+			return llvm::Error::success();
+		};
+		for (const std::unique_ptr<PrototypeAST> &proto : externs)
+			if (llvm::Error err = check(*proto, false))
+				return std::move(err);
+		for (const std::unique_ptr<FunctionAST> &definition : definitions)
+			if (llvm::Error err = check(*definition->proto, true))
+				return std::move(err);
+
+		handle = next_handle++;
+		LoadedModule &loaded_module = modules[handle];
+		for (const std::unique_ptr<PrototypeAST> &proto : externs)
+			functions.try_emplace(proto->name, RegisteredFunction{*proto, 0});
+		for (const std::unique_ptr<FunctionAST> &definition : definitions) {
+			// Otherwise defined twice in this source, rejected by the visitor below
+			if (pending_definitions.try_emplace(definition->proto->name, handle).second)
+				loaded_module.defined_functions.push_back(definition->proto->name);
+		}
+	}
+
+	std::unique_ptr<CodegenVisitor> visitor = acquire_visitor();
+	for (std::unique_ptr<PrototypeAST> &proto : externs)
+		visitor->function_protos[proto->name] = std::move(proto);
+
+	bool failed = false;
+	for (std::unique_ptr<FunctionAST> &definition : definitions) {
+		if (!definition->codegen(*visitor)) {
+			failed = true;
+			break;
+		}
+	}
+
+	llvm::orc::ResourceTrackerSP tracker;
+	llvm::orc::RedefinedBodies bodies;
+	llvm::Error err = llvm::Error::success();
+	if (failed) {
+		// Drop whatever was emitted before the error
+		visitor->reset_module();
+		err = llvm::createStringError(llvm::inconvertibleErrorCode(), "code generation failed");
+	} else if (options.hot_swap) {
+		tracker = jit->getMainJITDylib().createResourceTracker();
+		llvm::Expected<llvm::orc::RedefinedBodies> compiled = jit->addRedefinableModule(visitor->take_module(true), tracker);
+		if (compiled)
+			bodies = std::move(*compiled);
+		else
+			err = compiled.takeError();
+	} else {
+		tracker = jit->getMainJITDylib().createResourceTracker();
+		err = jit->addModule(visitor->take_module(), tracker);
+	}
+	release_visitor(std::move(visitor));
+
+	if (!err && options.hot_swap)
+		err = publish(handle, bodies, definitions);
+	if (err) {
+		{
+			std::lock_guard<std::mutex> lock(registry_mutex);
+			std::erase_if(pending_definitions, [&](const auto &pending) {
+				return pending.second == handle;
+			});
+			modules[handle].tracker = std::move(tracker);
+		}
+		consumeError(unload(handle));
+		return std::move(err);
+	}
+
+	if (options.hot_swap) {
+		free_retired_modules();
+		return handle;
+	}
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		modules[handle].tracker = std::move(tracker);
+		// Along with what the visitor found about them (e.g. purity), for
+		// the modules compiled next
+		for (const std::unique_ptr<FunctionAST> &definition : definitions) {
+			functions.insert_or_assign(definition->proto->name, RegisteredFunction{*definition->proto, handle});
+			pending_definitions.erase(definition->proto->name);
+		}
+	}
+	if (library) {
+		for (std::unique_ptr<FunctionAST> &definition : definitions)
+			library->add(std::move(definition));
+	}
+	return handle;
+}
+
+llvm::Error Engine::publish(ModuleHandle handle, const llvm::orc::RedefinedBodies &bodies,
+		const std::vector<std::unique_ptr<FunctionAST>> &definitions) {
+	std::vector<llvm::orc::ResourceTrackerSP> retired;
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		modules[handle].tracker = bodies.RT;
+		if (llvm::Error err = jit->publishRedefinitions(bodies, retired))
+			return err;
+		// The previous owner may have been unloaded in the meantime
+		for (const std::unique_ptr<FunctionAST> &definition : definitions) {
+			functions.insert_or_assign(definition->proto->name, RegisteredFunction{*definition->proto, handle});
+			pending_definitions.erase(definition->proto->name);
+		}
+
+		// Modules left without functions stay registered until unloaded,
+		// but their code is freed once no call can still be running it
+		for (auto &[other_handle, loaded_module] : modules)
+			for (const llvm::orc::ResourceTrackerSP &retired_tracker : retired)
+				if (loaded_module.tracker == retired_tracker)
+					loaded_module.tracker = nullptr;
+	}
+	if (retired.empty())
+		return llvm::Error::success();
+
+	// Calls that could still enter the old bodies were counted in the
+	// current epoch or the one before
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	std::lock_guard<std::mutex> lock(retired_mutex);
+	for (llvm::orc::ResourceTrackerSP &retired_tracker : retired)
+		retired_modules.push_back(RetiredModule{std::move(retired_tracker), call_epochs.current()});
+	return llvm::Error::success();
+}
+
+void Engine::free_retired_modules() {
+	std::vector<llvm::orc::ResourceTrackerSP> freed;
+	{
+		std::lock_guard<std::mutex> lock(retired_mutex);
+		if (retired_modules.empty())
+			return;
+		uint64_t last_epoch = retired_modules.back().epoch;
+		while (call_epochs.current() < last_epoch + 2 && call_epochs.try_advance())
+			;
+		auto still_used = std::partition(retired_modules.begin(), retired_modules.end(), [&](const RetiredModule &retired_module) {
+			return call_epochs.current() < retired_module.epoch + 2;
+		});
+		for (auto retired_it = still_used; retired_it != retired_modules.end(); ++retired_it)
+			freed.push_back(std::move(retired_it->tracker));
+		retired_modules.erase(still_used, retired_modules.end());
+	}
+
+	// Nothing to report to, the code is unreachable either way
+	for (llvm::orc::ResourceTrackerSP &tracker : freed)
+		consumeError(tracker->remove());
+}
+
+llvm::Error Engine::unload(ModuleHandle handle) {
+	LoadedModule loaded_module;
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		auto module_it = modules.find(handle);
+		if (module_it == modules.end())
+			return llvm::createStringError(llvm::inconvertibleErrorCode(), "unknown module handle");
+		loaded_module = std::move(module_it->second);
+		modules.erase(module_it);
+		for (const std::string &name : loaded_module.defined_functions) {
+			// In hot-swap mode, the function may have been redefined since
+			auto function_it = functions.find(name);
+			if (function_it != functions.end() && function_it->second.owner == handle)
+				functions.erase(function_it);
+			if (library)
+				library->remove(name);
+		}
+	}
+
+	if (options.hot_swap)
+		free_retired_modules();
+	if (!loaded_module.tracker)
+		return llvm::Error::success();
+	return loaded_module.tracker->remove();
+}
+
+std::unique_ptr<CodegenVisitor> Engine::acquire_visitor() {
+	std::unique_ptr<CodegenVisitor> visitor;
+	{
+		std::lock_guard<std::mutex> lock(visitors_mutex);
+		if (!idle_visitors.empty()) {
+			visitor = std::move(idle_visitors.back());
+			idle_visitors.pop_back();
+		}
+	}
+
+	if (!visitor) {
+		visitor = std::make_unique<CodegenVisitor>(jit);
+		visitor->opt_level = options.opt_level;
+		visitor->fast_math = options.fast_math;
+		visitor->library = library.get();
+		visitor->initialize_module_and_managers();
+		visitor->find_external_proto = [this](std::string_view name) {
+			return find_proto(name);
+		};
+	}
+	return visitor;
+}
+
+void Engine::release_visitor(std::unique_ptr<CodegenVisitor> visitor) {
+	// Everything else the visitor knows may be unloaded by other threads
+	// before it is used again
+	visitor->function_protos.clear();
+	visitor->defined_functions.clear();
+
+	std::lock_guard<std::mutex> lock(visitors_mutex);
+	idle_visitors.push_back(std::move(visitor));
+}
+
+std::unique_ptr<PrototypeAST> Engine::find_proto(std::string_view name) {
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	auto function_it = functions.find(name);
+	if (function_it == functions.end())
+		return nullptr;
+	return std::make_unique<PrototypeAST>(function_it->second.proto);
+}
+
+// As in 'vec4(number vec4)'
+static std::string describe_signature(const std::vector<ValueType> &signature) {
+	auto type_name = [](ValueType type) {
+		return type == ValueType::vec4 ? "vec4" : "number";
+	};
+	std::string description = std::string(type_name(signature[0])) + "(";
+	for (size_t i = 1; i < signature.size(); ++i)
+		description += std::string(i > 1 ? " " : "") + type_name(signature[i]);
+	return description + ")";
+}
+
+llvm::Expected<void *> Engine::lookup_address(std::string_view name, const std::vector<ValueType> &signature, ModuleHandle *owner) {
+	if (!supports_vec4 && llvm::is_contained(signature, ValueType::vec4))
+		return llvm::createStringError(llvm::inconvertibleErrorCode(),
+			"function '%.*s' can't be called with vec4 values, the JIT's target has no AVX", (int)name.size(), name.data());
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		auto function_it = functions.find(name);
+		if (function_it == functions.end() || function_it->second.owner == 0)
+			return llvm::createStringError(llvm::inconvertibleErrorCode(),
+				"unknown function '%.*s'", (int)name.size(), name.data());
+		const PrototypeAST &proto = function_it->second.proto;
+		std::vector<ValueType> proto_signature{proto.return_type};
+		proto_signature.insert(proto_signature.end(), proto.arg_types.begin(), proto.arg_types.end());
+		if (proto_signature != signature)
+			return llvm::createStringError(llvm::inconvertibleErrorCode(),
+				"function '%.*s' is %s, not %s", (int)name.size(), name.data(),
+				describe_signature(proto_signature).c_str(), describe_signature(signature).c_str());
+		if (owner)
+			*owner = function_it->second.owner;
+	}
+
+	llvm::Expected<llvm::orc::ExecutorSymbolDef> symbol = jit->lookup(llvm::StringRef(name.data(), name.size()));
+	if (!symbol)
+		return symbol.takeError();
+	return symbol->toPtr<void *>();
+}
@@ -3,7 +3,7 @@
 #include "include/kaleidoscope/error.hpp"
 #include "include/kaleidoscope/ast.hpp"
 
-std::unique_ptr<ExprAST> log_error(const char *str) {
+ExprAST *log_error(const char *str) {
     fprintf(stderr, "Error: %s\n", str);
     return nullptr;
 }
@@ -0,0 +1,67 @@
+#include "include/kaleidoscope/function_library.hpp"
+
+void FunctionLibrary::add(std::unique_ptr<FunctionAST> function_node) {
+	std::string name = function_node->proto->name;
+	unsigned nodes = 0;
+	count_nodes(function_node->body, nodes, max_inline_size);
+	bool inlinable = nodes <= max_inline_size;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (inlinable)
+		bodies[name] = std::move(function_node);
+	else
+		bodies.erase(name);
+}
+
+void FunctionLibrary::remove(std::string_view name) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto body_it = bodies.find(name);
+	if (body_it != bodies.end())
+		bodies.erase(body_it);
+}
+
+std::shared_ptr<const FunctionAST> FunctionLibrary::find(std::string_view name) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto body_it = bodies.find(name);
+	return body_it == bodies.end() ? nullptr : body_it->second;
+}
+
+void FunctionLibrary::count_nodes(const ExprAST *expr, unsigned &count, unsigned limit) {
+	if (++count > limit)
+		return;
+	switch (expr->kind) {
+		case ExprKind::binary:
+			count_nodes(static_cast<const BinaryExprAST *>(expr)->lhs, count, limit);
+			count_nodes(static_cast<const BinaryExprAST *>(expr)->rhs, count, limit);
+			break;
+		case ExprKind::call:
+			for (const ExprAST *arg : static_cast<const CallExprAST *>(expr)->args)
+				count_nodes(arg, count, limit);
+			break;
+		case ExprKind::if_expr: {
+			const IfExprAST *if_expr = static_cast<const IfExprAST *>(expr);
+			count_nodes(if_expr->cond, count, limit);
+			count_nodes(if_expr->then_expr, count, limit);
+			count_nodes(if_expr->else_expr, count, limit);
+			break;
+		}
+		case ExprKind::for_expr: {
+			const ForExprAST *for_expr = static_cast<const ForExprAST *>(expr);
+			count_nodes(for_expr->start, count, limit);
+			count_nodes(for_expr->end, count, limit);
+			if (for_expr->step)
+				count_nodes(for_expr->step, count, limit);
+			count_nodes(for_expr->body, count, limit);
+			break;
+		}
+		case ExprKind::parallel_for_expr: {
+			const ParallelForExprAST *parallel_expr = static_cast<const ParallelForExprAST *>(expr);
+			count_nodes(parallel_expr->start, count, limit);
+			count_nodes(parallel_expr->end, count, limit);
+			count_nodes(parallel_expr->body, count, limit);
+			break;
+		}
+		default:
+			break;
+	}
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <memory>
+#include <string>
+
+enum class EmitKind {
+    none,
+    obj,
+    asm_file,
+    ll,
+    lib,
+};
+
+// Ahead-of-time backend: writes the functions codegen'd by a
+// CodegenVisitor to disk instead of handing them to the JIT.
+class AotEmitter {
+    public:
+        std::unique_ptr<llvm::TargetMachine> target_machine;
+
+        // Emits code for the same target as 'jtmb' (usually the JIT's)
+        AotEmitter(llvm::orc::JITTargetMachineBuilder jtmb);
+
+        // Retargets 'module' to the host machine and writes it as 'kind'
+        // to 'output_path'. Returns false (after logging) on failure.
+        bool emit(llvm::Module &module, EmitKind kind, const std::string &output_path);
+
+        // C header with a 'double f(double, ...)' prototype for every
+        // function defined in 'module'
+        bool emit_header(llvm::Module &module, const std::string &header_path);
+
+        // Default extension of the files produced for 'kind'
+        static const char *file_extension(EmitKind kind);
+};
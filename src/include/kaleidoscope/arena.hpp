@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump-pointer allocator backing the AST of a single top-level item.
+// Objects are never destroyed individually: the slabs are released all
+// at once when the arena is reset or goes out of scope, so only
+// trivially destructible types may live in it.
+class Arena {
+    public:
+        static constexpr size_t initial_slab_size = 4 * 1024;
+        static constexpr size_t max_slab_size = 1024 * 1024;
+
+        Arena() = default;
+        Arena(Arena &&other) noexcept;
+        Arena &operator=(Arena &&other) noexcept;
+
+        void *allocate(size_t size, size_t align);
+
+        template <typename T, typename... Args>
+        T *create(Args &&...args) {
+            static_assert(std::is_trivially_destructible_v<T>, "Arena objects are never destroyed.");
+            return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        }
+
+        template <typename T>
+        std::span<T> copy_array(std::span<const T> values) {
+            static_assert(std::is_trivially_copyable_v<T>, "Arena arrays are copied bytewise.");
+            if (values.empty())
+                return {};
+            T *data = static_cast<T *>(allocate(values.size_bytes(), alignof(T)));
+            std::uninitialized_copy(values.begin(), values.end(), data);
+            return {data, values.size()};
+        }
+
+        std::string_view copy_string(std::string_view str);
+
+        // Releases every object at once, keeping the first slab around
+        // for reuse by the next top-level item
+        void reset();
+
+        size_t bytes_used() const { return used; }
+
+    private:
+        std::vector<std::unique_ptr<char[]>> slabs;
+        char *curr = nullptr;
+        char *end = nullptr;
+        size_t next_slab_size = initial_slab_size;
+        size_t first_slab_size = 0;
+        size_t used = 0;
+
+        void *allocate_slow(size_t size, size_t align);
+};
@@ -1,11 +1,35 @@
 #pragma once
 
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+#include "arena.hpp"
 #include "codegen_visitor.hpp"
 
+struct InterpretedFunction;
+
+// Expression nodes are allocated contiguously in the Arena of their
+// top-level item and dispatched on 'kind' instead of through a vtable,
+// so they must stay trivially destructible.
+enum class ExprKind : uint8_t {
+    number,
+    variable,
+    binary,
+    call,
+    if_expr,
+    for_expr,
+    parallel_for_expr,
+};
+
 class ExprAST {
     public:
-        virtual ~ExprAST() = default;
-        virtual llvm::Value *codegen(CodegenVisitor &) { };
+        const ExprKind kind;
+
+        llvm::Value *codegen(CodegenVisitor &);
+
+    protected:
+        ExprAST(ExprKind kind) : kind(kind) {}
 };
 
 class NumberExprAST : public ExprAST {
@@ -13,48 +37,113 @@ class NumberExprAST : public ExprAST {
         double val;
 
         NumberExprAST(double val);
-
-        llvm::Value *codegen(CodegenVisitor &) override;
 };
 
 
 class VariableExprAST : public ExprAST {    
     public:
-        std::string name;
+        std::string_view name;
+        // Slot of 'name' in the Interpreter's frame (parameters, then loop
+        // variables)
+        unsigned slot = 0;
 
-        VariableExprAST(std::string &name);
-
-        llvm::Value *codegen(CodegenVisitor &) override;
+        VariableExprAST(std::string_view name);
 };
 
 
 class BinaryExprAST : public ExprAST {
     public:
         char op;
-        std::unique_ptr<ExprAST> lhs, rhs;
-
-        BinaryExprAST(char op, std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs);
+        ExprAST *lhs, *rhs;
 
-        llvm::Value* codegen(CodegenVisitor &) override;
+        BinaryExprAST(char op, ExprAST *lhs, ExprAST *rhs);
 };
 
 class CallExprAST : public ExprAST {
     public:
-        std::string callee;
-        std::vector<std::unique_ptr<ExprAST>> args;
+        std::string_view callee;
+        std::span<ExprAST *> args;
+        // Callee resolved by the Interpreter
+        InterpretedFunction *target = nullptr;
+
+        CallExprAST(std::string_view callee, std::span<ExprAST *> args);
+};
+
+// 'if cond then then_expr else else_expr', where 'cond' is true unless
+// it is 0.0 or NaN
+class IfExprAST : public ExprAST {
+    public:
+        ExprAST *cond, *then_expr, *else_expr;
 
-        CallExprAST(const std::string &callee, std::vector<std::unique_ptr<ExprAST>> args);
+        IfExprAST(ExprAST *cond, ExprAST *then_expr, ExprAST *else_expr);
+};
+
+// 'for var = start, end, step in body': runs 'body' as long as 'end' is
+// true (checked before each iteration), adding 'step' (1.0 if omitted) to
+// 'var' after each one. Evaluates to 0.0.
+class ForExprAST : public ExprAST {
+    public:
+        std::string_view var_name;
+        ExprAST *start, *end, *step, *body;
+        // Index of 'var_name' in the Interpreter's frame
+        unsigned slot = 0;
+
+        ForExprAST(std::string_view var_name, ExprAST *start, ExprAST *end, ExprAST *step, ExprAST *body);
+};
+
+// 'parfor var = start, end in body' and 'parsum var = start, end in body':
+// run 'body' for 'var' = start, start + 1, ... below 'end', in parallel and
+// in no particular order. 'parsum' evaluates to the sum of the values of
+// 'body', 'parfor' to 0.0.
+class ParallelForExprAST : public ExprAST {
+    public:
+        std::string_view var_name;
+        ExprAST *start, *end, *body;
+        bool reduce;
+        // Index of 'var_name' in the Interpreter's frame
+        unsigned slot = 0;
 
-        llvm::Value *codegen(CodegenVisitor &) override;
+        ParallelForExprAST(std::string_view var_name, ExprAST *start, ExprAST *end, ExprAST *body, bool reduce);
+};
+
+// Floating-point semantics of a definition: 'def strict f(x)' keeps IEEE
+// semantics and 'def fast f(x)' allows every fast-math transformation,
+// whatever the session's '--fast-math-flags'
+enum class FloatMode : uint8_t {
+    session,
+    strict,
+    fast,
+};
+
+// Every value is a number (a double), unless typed 'vec4': four doubles,
+// operated on lane by lane
+enum class ValueType : uint8_t {
+    number,
+    vec4,
 };
 
 class PrototypeAST {
     public:
         std::string name;
         std::vector<std::string> args;
+        // One per argument, as in 'def f(v:vec4 x):vec4', numbers unless
+        // annotated
+        std::vector<ValueType> arg_types;
+        ValueType return_type = ValueType::number;
+        FloatMode float_mode = FloatMode::session;
+        // No side effects (nor memory accesses) at all, so that calls can
+        // be merged or hoisted: known math externs, and definitions found
+        // to only call pure functions by 'CodegenVisitor::visit_function'
+        bool pure = false;
+        // Pure, and the calls always return (no recursion)
+        bool always_returns = false;
     
         PrototypeAST(const std::string &name, std::vector<std::string> args);
 
+        bool has_vectors() const;
+        // Same argument and return types (names aside)
+        bool same_signature(const PrototypeAST &other) const;
+
         llvm::Function *codegen(CodegenVisitor &);
 };
 
@@ -62,9 +151,11 @@ class FunctionAST {
     
     public:
         std::unique_ptr<PrototypeAST> proto;
-        std::unique_ptr<ExprAST> body;
+        ExprAST *body;
+        // Owns every node reachable from 'body'
+        Arena arena;
 
-        FunctionAST(std::unique_ptr<PrototypeAST> proto, std::unique_ptr<ExprAST> body);
+        FunctionAST(std::unique_ptr<PrototypeAST> proto, ExprAST *body, Arena arena);
 
         llvm::Function *codegen(CodegenVisitor &);
-};
\ No newline at end of file
+};
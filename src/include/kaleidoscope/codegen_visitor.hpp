@@ -9,20 +9,34 @@
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
 
 // Optimization imports
 #include "llvm/IR/PassManager.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Passes/OptimizationLevel.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/StandardInstrumentations.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/IndVarSimplify.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopRotation.h"
 #include "llvm/Transforms/Scalar/Reassociate.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
 
 #include "kaleidoscope_jit.hpp"
+#include "memo_table.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
 
+#include <functional>
 #include <map>
+#include <optional>
+#include <set>
 #include <string>
 #include <iostream>
 
@@ -32,36 +46,197 @@ class NumberExprAST;
 class VariableExprAST;
 class BinaryExprAST;
 class CallExprAST;
+class IfExprAST;
+class ForExprAST;
+class ParallelForExprAST;
 class FunctionAST;
 class PrototypeAST;
+class FunctionLibrary;
+enum class ValueType : uint8_t;
 
 class CodegenVisitor {
     public:
-        std::unique_ptr<llvm::LLVMContext> context;
+        // Context shared by every module this visitor emits, until
+        // 'max_modules_per_context' of them have been handed over. The
+        // modules handed to the JIT keep it alive and are compiled under
+        // its lock, so emitting IR into it takes the lock as well.
+        llvm::orc::ThreadSafeContext thread_safe_context;
+        llvm::LLVMContext *context = nullptr;
+        unsigned modules_in_context = 0;
+        // Types and constants are never freed from a context, so a
+        // long-running session moves to a fresh one now and then
+        static constexpr unsigned max_modules_per_context = 1000;
+
         std::unique_ptr<llvm::IRBuilder<>> builder;
         std::unique_ptr<llvm::Module> module;
-        std::map<std::string, llvm::Value *> named_values;
+        std::map<std::string, llvm::Value *, std::less<>> named_values;
+
+        // Every prototype seen so far (definitions and externs), used to
+        // re-declare functions living in modules already handed to the JIT
+        std::map<std::string, std::unique_ptr<PrototypeAST>, std::less<>> function_protos;
+        // Names with a body already emitted, to reject redefinitions
+        std::set<std::string, std::less<>> defined_functions;
+        // Hot-swap mode: functions of previous modules can be defined
+        // again, with the same parameter list
+        bool allow_redefinition = false;
+        // Consulted by 'get_function' for names missing from
+        // 'function_protos', e.g. functions compiled by other visitors
+        // sharing the same JIT
+        std::function<std::unique_ptr<PrototypeAST>(std::string_view)> find_external_proto;
+        // Bodies of small functions from previous modules, copied into
+        // the modules calling them so that -O1 to -O3 can inline them
+        FunctionLibrary *library = nullptr;
+        // Transformations allowed on floating-point operations, unless a
+        // definition asks for strict or fast semantics (see 'FloatMode')
+        llvm::FastMathFlags fast_math;
+        // Pure functions named in it look their results up in its tables
+        // before running their body
+        MemoTables *memo_tables = nullptr;
+
+        // Optimization pipeline. Without an explicit level, each function
+        // goes through a few passes as soon as it is emitted; with one, the
+        // PassBuilder default pipeline for that level runs on whole modules.
+        std::optional<llvm::OptimizationLevel> opt_level;
+        // Profile-guided mode: every function emitted (top-level
+        // expressions aside) counts its calls in this profile
+        Profile *instrumentation = nullptr;
+        // Counts only the calls (no branches) of the functions emitted,
+        // for re-optimized code to keep adding to 'instrumentation'
+        Profile *call_counts = nullptr;
+        // Call counts attached to the functions emitted, for the passes
+        const Profile *profile = nullptr;
+        // Print the time spent in each pass after every module pipeline run
+        bool time_passes = false;
+        // Optimization time and instruction counts, per pass times too if
+        // 'stats->per_pass' is set
+        Stats *stats = nullptr;
 
-        // Pass and analysis managers
+        // Pass and analysis managers. They outlive the module: the
+        // analysis managers are only cleared between modules, everything
+        // is rebuilt when the configuration or the context changes.
         std::unique_ptr<llvm::FunctionPassManager> function_pass_manager;
+        std::unique_ptr<llvm::ModulePassManager> module_pass_manager;
         std::unique_ptr<llvm::LoopAnalysisManager> loop_analysis_manager;
         std::unique_ptr<llvm::FunctionAnalysisManager> function_analysis_manager;
         std::unique_ptr<llvm::CGSCCAnalysisManager> control_graph_analysis_manager;
         std::unique_ptr<llvm::ModuleAnalysisManager> module_analysis_manager;
         std::unique_ptr<llvm::PassInstrumentationCallbacks> pass_instrumentation_callbacks;
         std::unique_ptr<llvm::StandardInstrumentations> standard_instrumentations;
+        std::unique_ptr<llvm::TimePassesHandler> time_passes_handler;
 
-        // jit compiler
+        // jit compiler, null when compiling ahead of time
         std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit;
+        // Same target as the JIT, gives the passes CPU-specific cost models
+        std::unique_ptr<llvm::TargetMachine> target_machine;
 
         CodegenVisitor(std::shared_ptr<llvm::orc::KaleidoscopeJIT> og_jit_ptr);
+        // Without a JIT, for modules compiled ahead of time for 'target'.
+        // Their functions can't be taken as redefinable.
+        CodegenVisitor(const llvm::orc::JITTargetMachineBuilder &target);
 
+        // Starts over in a new context, with a new pipeline built from
+        // 'opt_level', 'time_passes' and 'stats'. Call it after changing
+        // any of them.
         void initialize_module_and_managers();
 
+        // Drops the current module (e.g. after an error) and starts a new
+        // one, keeping the context and pipeline
+        void reset_module();
+
+        // Runs the module pipeline (if any) over the current module
+        void optimize_module();
+
+        // Optimizes the current module and hands it over (e.g. to the
+        // JIT), starting a new one. With 'redefinable', its functions are
+        // first renamed for 'KaleidoscopeJIT::addRedefinableModule()'.
+        llvm::orc::ThreadSafeModule take_module(bool redefinable = false);
+
+        // Function 'name' in the current module, declaring it from
+        // 'function_protos' if it was emitted into a previous module
+        // (along with a copy of its body, if it is in 'library')
+        llvm::Function *get_function(std::string_view name);
+
+        // Emits '<name>_batch(const double *arg0, ..., double *out, size_t n)',
+        // which calls 'name' on each row of the argument columns, writing
+        // the results to 'out'. Columns must not overlap 'out', so the
+        // loop (and 'name', once inlined) can be vectorized. Columns of
+        // vec4 values hold 4 doubles per row.
+        llvm::Function *emit_batch_wrapper(std::string_view name);
+
+        // Math functions of the C library without side effects, ignoring
+        // 'errno' (as with -fno-math-errno)
+        static bool is_pure_library_function(std::string_view name);
+
+        // Lanes of a 'vec4', an LLVM '<4 x double>'
+        static constexpr unsigned vec4_lanes = 4;
+        llvm::Type *llvm_type(ValueType type) const;
+        // 'vec4(x)' (x in every lane), 'vec4(a, b, c, d)', 'lane(v, i)' (i
+        // a number literal from 0 to 3), and the horizontal reductions
+        // 'hsum(v)', 'hmin(v)' and 'hmax(v)'
+        static bool is_vector_builtin(std::string_view name);
+
         llvm::Value *visit_number_expr(NumberExprAST &);
         llvm::Value *visit_variable_expr(VariableExprAST &);
         llvm::Value *visit_binary_expr(BinaryExprAST &);
         llvm::Value *visit_call_expr(CallExprAST &);
+        llvm::Value *visit_if_expr(IfExprAST &);
+        llvm::Value *visit_for_expr(ForExprAST &);
+        llvm::Value *visit_parallel_for_expr(ParallelForExprAST &);
         llvm::Function *visit_function(FunctionAST &);
         llvm::Function *visit_prototype(PrototypeAST &);
+
+    private:
+        void create_target_machine(llvm::orc::JITTargetMachineBuilder jtmb);
+
+        // New empty module in the current context
+        void start_module();
+
+        // 'get_function()' without the library copy, for definitions
+        llvm::Function *declare_function(std::string_view name);
+        // Emits the body of 'function_node' into 'function', a declaration,
+        // as an 'available_externally' definition
+        void emit_library_copy(llvm::Function &function, const FunctionAST &function_node);
+
+        // Flags of the operations in a definition, also set as function
+        // attributes for the backend
+        llvm::FastMathFlags fast_math_for(const PrototypeAST &prototype_node) const;
+        void set_fast_math(llvm::Function &function, const PrototypeAST &prototype_node);
+        static void add_fast_math_attributes(llvm::Function &function, llvm::FastMathFlags flags);
+
+        llvm::Value *emit_vector_builtin(CallExprAST &call_expr);
+
+        // Chunks outlined from the parallel loops of the definition being
+        // emitted, in order, optimized along with it
+        std::vector<llvm::Function *> outlined_functions;
+        // Emits 'double <function>.par(const double *captures, int64_t begin,
+        // int64_t end)' (see 'ParallelChunk'), running iterations [begin,
+        // end) of 'parallel_expr'. 'captures' holds its start value, then
+        // the values of the variables in 'captured' (four doubles for a
+        // vec4).
+        llvm::Function *emit_parallel_chunk(ParallelForExprAST &parallel_expr, const std::vector<std::pair<std::string, llvm::Type *>> &captured);
+
+        // What the body being emitted calls so far: only pure functions,
+        // and only ones that always return (not itself)
+        bool body_is_pure = true;
+        bool body_always_returns = true;
+        static void add_purity_attributes(llvm::Function &function, bool always_returns);
+
+        // Index of the next conditional branch of the function being
+        // emitted, naming its counters in the profile
+        unsigned next_branch = 0;
+        // Branches on 'value' being true (not 0.0 nor NaN), counting the
+        // directions taken in profile-guided mode, or weighted by 'profile'
+        void emit_cond_branch(llvm::Value *value, llvm::BasicBlock *if_true, llvm::BasicBlock *if_false);
+
+        // Atomic but unordered, as parallel loops run the code on every
+        // worker at once
+        void emit_counter_increment(uint64_t *counter, llvm::Value *increment = nullptr);
+        // Entry of 'table' for the arguments of 'function'
+        llvm::Value *emit_memo_entry(llvm::Function &function, MemoTable &table);
+        // Fills the entry before the body returns 'result'. Entries are
+        // seqlocks, so parallel loop bodies can share the table.
+        void emit_memo_store(llvm::Function &function, MemoTable &table, llvm::Value *result);
+        // New entry block, returning the cached result on a hit and
+        // falling through to the body otherwise
+        void emit_memo_lookup(llvm::Function &function, MemoTable &table);
 };
\ No newline at end of file
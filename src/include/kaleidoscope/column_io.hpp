@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Streaming input of the --map mode: yields rows of 'num_columns'
+// doubles, one buffer per column, a chunk at a time.
+class ColumnSource {
+    public:
+        virtual ~ColumnSource() = default;
+
+        // Fills up to 'max_rows' rows of every buffer in 'columns' and
+        // returns how many were read, 0 at the end of the input.
+        // Sets 'failed' (after logging) on malformed input.
+        virtual size_t read(std::vector<std::vector<double>> &columns, size_t max_rows) = 0;
+
+        bool failed = false;
+
+        // A single '.csv' file holding one column per parameter, or one
+        // file of raw native-endian doubles per parameter. Returns nullptr
+        // (after logging) if the files can't be opened.
+        static std::unique_ptr<ColumnSource> open(const std::vector<std::string> &paths, unsigned num_columns);
+};
+
+// Streaming output of the --map mode: text (one value per line) when
+// 'path' ends in '.csv' or is empty (stdout), raw doubles otherwise.
+class ColumnSink {
+    public:
+        ~ColumnSink();
+
+        static std::unique_ptr<ColumnSink> open(const std::string &path);
+
+        bool write(const double *values, size_t count);
+
+    private:
+        FILE *file = nullptr;
+        bool text = true;
+        bool owns_file = false;
+};
@@ -0,0 +1,277 @@
+#pragma once
+
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Support/Error.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "ast.hpp"
+#include "kaleidoscope_jit.hpp"
+
+class CodegenVisitor;
+class FunctionLibrary;
+
+// Kaleidoscope's 'vec4', as the native vector type of GCC and Clang. The
+// JIT only compiles vec4 functions for x86 CPUs with AVX, which pass it
+// in a single register: code calling them must be built with AVX enabled
+// too (e.g. '-mavx'), or it passes it in memory instead. 'lookup()' and
+// 'function()' don't compile for 'Vec4' signatures otherwise.
+typedef double Vec4 __attribute__((vector_size(32)));
+
+#ifdef __AVX__
+inline constexpr bool vec4_calls_supported = true;
+#else
+inline constexpr bool vec4_calls_supported = false;
+#endif
+
+struct EngineOptions {
+    llvm::orc::KaleidoscopeJITOptions jit;
+    // Whole-module pipeline level, per-function passes if unset
+    std::optional<llvm::OptimizationLevel> opt_level;
+    // Functions can be compiled again, with the same parameter list, while
+    // other threads are calling them (see 'Engine::compile()')
+    bool hot_swap = false;
+    // Functions of at most this many AST nodes are copied into the modules
+    // compiled later, to be inlined when 'opt_level' is above O0. 0, or
+    // hot-swap mode, disables it.
+    unsigned max_inline_size = 40;
+    // Floating-point transformations allowed in definitions without a
+    // 'strict' or 'fast' mode
+    llvm::FastMathFlags fast_math;
+};
+
+// Calls in flight through 'Engine::Function' handles, counted per epoch
+// parity. Code replaced by a redefinition during epoch E is no longer
+// reachable once the epoch reaches E + 2, since each step waits for the
+// calls entered two epochs before to return.
+class CallEpochs {
+    public:
+        unsigned enter() {
+            unsigned slot = epoch.load() & 1;
+            active[slot].fetch_add(1);
+            // The counter must be visible before the call reads any stub
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return slot;
+        }
+
+        void leave(unsigned slot) {
+            active[slot].fetch_sub(1);
+        }
+
+        uint64_t current() const {
+            return epoch.load();
+        }
+
+        // Moves to the next epoch unless calls entered two epochs ago are
+        // still running. Called by one thread at a time.
+        bool try_advance() {
+            uint64_t current_epoch = epoch.load();
+            if (active[(current_epoch + 1) & 1].load() != 0)
+                return false;
+            epoch.store(current_epoch + 1);
+            return true;
+        }
+
+    private:
+        std::atomic<uint64_t> epoch{0};
+        std::atomic<uint64_t> active[2]{};
+};
+
+// Embedding API. Any number of threads can compile, look up, call and
+// unload Kaleidoscope code concurrently: they share a single JIT, but
+// each compilation gets a CodegenVisitor (and LLVMContext) of its own
+// from a pool, so IR emission and optimization run in parallel too.
+//
+//     auto engine = exit_on_err(Engine::create());
+//     Engine::ModuleHandle handle = exit_on_err(engine->compile("def f(a b) a*b+1;"));
+//     auto f = exit_on_err(engine->function<double(double, double)>("f"));
+//     f(2, 3);
+//     exit_on_err(engine->unload(handle));
+//
+// Functions taking or returning vec4 values are called with 'Vec4'
+// arguments, e.g. 'engine->function<double(Vec4)>("g")', on x86 with AVX
+// only (see 'Vec4').
+//
+// With 'EngineOptions::hot_swap', every function is called through an
+// indirection stub, and compiling a new definition of it switches the stub
+// over without stopping the threads calling it. The code replaced is freed
+// once no call made through a 'Function' handle can still be running it.
+class Engine {
+    public:
+        using ModuleHandle = uint64_t;
+
+        // Typed handle to a compiled function, resolved once: calling it
+        // is a plain indirect call, with no lookup or locking. Valid until
+        // 'module()' is unloaded, or for as long as the function is
+        // defined in hot-swap mode, where calls are also counted so that
+        // replaced code is only freed once they have returned.
+        template <typename Signature>
+        class Function;
+
+        template <typename Result, typename... Args>
+        class Function<Result(Args...)> {
+            public:
+                Function() = default;
+
+                Result operator()(Args... args) const {
+                    if (!epochs)
+                        return address(args...);
+                    unsigned slot = epochs->enter();
+                    Result result = address(args...);
+                    epochs->leave(slot);
+                    return result;
+                }
+
+                Result (*get() const)(Args...) {
+                    return address;
+                }
+
+                ModuleHandle module() const {
+                    return owner;
+                }
+
+                explicit operator bool() const {
+                    return address != nullptr;
+                }
+
+            private:
+                friend class Engine;
+
+                Result (*address)(Args...) = nullptr;
+                ModuleHandle owner = 0;
+                CallEpochs *epochs = nullptr;
+
+                Function(Result (*address)(Args...), ModuleHandle owner, CallEpochs *epochs)
+                        : address(address), owner(owner), epochs(epochs) {}
+        };
+
+        static llvm::Expected<std::unique_ptr<Engine>> create(const EngineOptions &options = {});
+
+        ~Engine();
+
+        // Compiles the definitions and externs in 'source' into a new
+        // module. Functions may call anything compiled before, in any
+        // module. Top-level expressions are rejected, as there is
+        // nothing to run them. In hot-swap mode, functions defined before
+        // are replaced once the whole module is compiled, and now belong
+        // to the new module.
+        llvm::Expected<ModuleHandle> compile(std::string_view source);
+
+        // Address of function 'name', checked against the parameter and
+        // return types of 'Signature' (e.g. 'double(double, Vec4)'). Stays valid until
+        // the module defining it, stored in 'owner' if given, is unloaded.
+        // Repeated lookups of a name are served from the JIT's cache. In
+        // hot-swap mode, calls through the address always reach the latest
+        // definition, but aren't counted: it must not be called while the
+        // function is being redefined.
+        template <typename Signature>
+        llvm::Expected<Signature *> lookup(std::string_view name, ModuleHandle *owner = nullptr) {
+            static_assert(std::is_function_v<Signature>, "Signature must be a function type, e.g. double(double)");
+            llvm::Expected<void *> address = lookup_address(name, signature_types(static_cast<Signature *>(nullptr)), owner);
+            if (!address)
+                return address.takeError();
+            return reinterpret_cast<Signature *>(*address);
+        }
+
+        // Handle to function 'name', checked like 'lookup()'
+        template <typename Signature>
+        llvm::Expected<Function<Signature>> function(std::string_view name) {
+            ModuleHandle owner = 0;
+            llvm::Expected<Signature *> address = lookup<Signature>(name, &owner);
+            if (!address)
+                return address.takeError();
+            return Function<Signature>(*address, owner, options.hot_swap ? &call_epochs : nullptr);
+        }
+
+        // Frees the code of a module, and makes its function names free
+        // to be defined again. Calls into it must have returned.
+        llvm::Error unload(ModuleHandle handle);
+
+        llvm::orc::KaleidoscopeJIT &get_jit() {
+            return *jit;
+        }
+
+    private:
+        struct RegisteredFunction {
+            PrototypeAST proto;
+            // Module defining the function, 0 while only declared extern
+            ModuleHandle owner;
+        };
+
+        struct LoadedModule {
+            // Null once every function of the module has been redefined
+            llvm::orc::ResourceTrackerSP tracker;
+            std::vector<std::string> defined_functions;
+        };
+
+        // Module whose code was replaced during epoch 'epoch'
+        struct RetiredModule {
+            llvm::orc::ResourceTrackerSP tracker;
+            uint64_t epoch;
+        };
+
+        EngineOptions options;
+        std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit;
+        // The JIT's target passes vec4 values like 'Vec4' (see
+        // 'KaleidoscopeJIT::supportsVec4()'), set by 'create()'
+        bool supports_vec4 = false;
+
+        // Functions and modules known to every thread
+        std::mutex registry_mutex;
+        std::map<std::string, RegisteredFunction, std::less<>> functions;
+        // Names claimed by a compilation in progress, and not in 'functions'
+        // (or still with their previous owner) until its module is in the JIT
+        std::map<std::string, ModuleHandle, std::less<>> pending_definitions;
+        std::map<ModuleHandle, LoadedModule> modules;
+        ModuleHandle next_handle = 1;
+
+        // Hot-swap mode: replaced code waiting for the calls that may be
+        // running it to return
+        CallEpochs call_epochs;
+        std::mutex retired_mutex;
+        std::vector<RetiredModule> retired_modules;
+
+        // Small definitions, for inlining across modules
+        std::unique_ptr<FunctionLibrary> library;
+
+        // Visitors not in use by any compilation
+        std::mutex visitors_mutex;
+        std::vector<std::unique_ptr<CodegenVisitor>> idle_visitors;
+
+        Engine(const EngineOptions &options, std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit);
+
+        std::unique_ptr<CodegenVisitor> acquire_visitor();
+        void release_visitor(std::unique_ptr<CodegenVisitor> visitor);
+
+        std::unique_ptr<PrototypeAST> find_proto(std::string_view name);
+
+        // Makes the functions of module 'handle' the ones called, and hands the
+        // modules left unused over to 'free_retired_modules()'
+        llvm::Error publish(ModuleHandle handle, const llvm::orc::RedefinedBodies &bodies,
+                const std::vector<std::unique_ptr<FunctionAST>> &definitions);
+        void free_retired_modules();
+        // 'signature' holds the return type, then the parameter types
+        llvm::Expected<void *> lookup_address(std::string_view name, const std::vector<ValueType> &signature, ModuleHandle *owner);
+
+        template <typename T>
+        static constexpr ValueType value_type() {
+            static_assert(std::is_same_v<T, double> || std::is_same_v<T, Vec4>, "Kaleidoscope functions only take and return doubles and Vec4s");
+            static_assert(!std::is_same_v<T, Vec4> || vec4_calls_supported, "Calls with Vec4 values must be built with AVX enabled (e.g. -mavx)");
+            return std::is_same_v<T, Vec4> ? ValueType::vec4 : ValueType::number;
+        }
+
+        template <typename Result, typename... Args>
+        static std::vector<ValueType> signature_types(Result (*)(Args...)) {
+            return {value_type<Result>(), value_type<Args>()...};
+        }
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "ast.hpp"
+
+// Definitions small enough to be inlined across modules, kept once their
+// module has been handed to the JIT. 'CodegenVisitor::get_function' emits
+// their body again into the modules calling them, as 'available_externally'
+// copies: the module pipeline's inliner can inline them, and calls it
+// leaves alone still go to the function compiled before. Thread-safe, so
+// that visitors sharing a JIT can share a library too.
+class FunctionLibrary {
+    public:
+        // Largest body kept, in AST nodes
+        const unsigned max_inline_size;
+
+        explicit FunctionLibrary(unsigned max_inline_size) : max_inline_size(max_inline_size) {}
+
+        // Keeps 'function_node' if it is small enough, replacing any
+        // previous body of the same name
+        void add(std::unique_ptr<FunctionAST> function_node);
+        // Forgets function 'name', e.g. once its code is unloaded
+        void remove(std::string_view name);
+        // Stays valid after 'remove()', while in use
+        std::shared_ptr<const FunctionAST> find(std::string_view name) const;
+
+    private:
+        mutable std::mutex mutex;
+        std::map<std::string, std::shared_ptr<const FunctionAST>, std::less<>> bodies;
+
+        // Adds the nodes of 'expr' to 'count', stopping once past 'limit'
+        static void count_nodes(const ExprAST *expr, unsigned &count, unsigned limit);
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "ast.hpp"
+#include "codegen_visitor.hpp"
+
+// Entry of the Interpreter's function table. Externs have no AST and
+// are always called natively.
+struct InterpretedFunction {
+    std::string name;
+    unsigned arity;
+    std::unique_ptr<FunctionAST> ast;
+    // Slots of a call: the arguments, then the loop variables
+    unsigned frame_size = 0;
+
+    // Entry point once compiled by the JIT (or resolved, for externs),
+    // only for functions of at most 'Interpreter::max_native_arity'
+    // parameters
+    void *native = nullptr;
+    // In the JIT, for compiled callers to link against, even when too
+    // wide to be called natively from the interpreter
+    bool compiled = false;
+    // Cleared when the function can't be compiled or called natively
+    bool promotable = true;
+
+    uint64_t interpreted_calls = 0;
+    uint64_t compiled_calls = 0;
+};
+
+// Tree-walking tier in front of the JIT. Top-level expressions and cold
+// functions are evaluated straight from the AST, and a function is only
+// handed to the CodegenVisitor/JIT once it has been called
+// 'hotness_threshold' times.
+class Interpreter {
+    public:
+        // Functions with more parameters can't be called natively from
+        // the interpreter: they are never promoted, and stay interpreted
+        // once compiled along with a hot caller
+        static constexpr unsigned max_native_arity = 6;
+
+        uint64_t hotness_threshold;
+
+        Interpreter(CodegenVisitor &visitor, uint64_t hotness_threshold);
+
+        bool add_function(std::unique_ptr<FunctionAST> function_node);
+        bool add_extern(const PrototypeAST &prototype_node);
+
+        // Returns false if the expression references unknown names
+        bool run_top_level_expr(FunctionAST &function_node, double &result);
+
+        // Interpreted vs. compiled calls of every function defined so far
+        void print_report();
+
+    private:
+        CodegenVisitor &visitor;
+        // Node-based, so CallExprAST::target stays valid
+        std::map<std::string, InterpretedFunction, std::less<>> functions;
+
+        // Names visible while resolving a body: the parameters, then the
+        // enclosing loop variables, each at its slot in the frame
+        struct Scope {
+            std::vector<std::string_view> names;
+            unsigned frame_size = 0;
+        };
+
+        // Returns the size of the frame needed to evaluate 'body'
+        std::optional<unsigned> resolve_body(ExprAST *body, const PrototypeAST &proto);
+        bool resolve(ExprAST *expr, Scope &scope);
+        bool resolve_native(InterpretedFunction &function);
+        double eval(ExprAST *expr, double *frame);
+        // 'frame' holds the arguments and has room for 'frame_size' slots
+        double call(InterpretedFunction &function, double *frame);
+        bool promote(InterpretedFunction &function);
+        void collect_uncompiled(InterpretedFunction &function, std::vector<InterpretedFunction *> &pending, std::set<InterpretedFunction *> &seen);
+        void collect_uncompiled(ExprAST *expr, std::vector<InterpretedFunction *> &pending, std::set<InterpretedFunction *> &seen);
+        static double call_native(void *native, unsigned arity, const double *args);
+};
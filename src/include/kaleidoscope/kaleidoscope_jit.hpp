@@ -13,51 +13,384 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/SelfExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/TargetParser/Host.h"
+#include "kaleidoscope_memory_pool.hpp"
+#include "kaleidoscope_object_cache.hpp"
+#include "kaleidoscope_stub_table.hpp"
+#include "parallel_runtime.hpp"
+#include <atomic>
+#include <chrono>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <vector>
 
 namespace llvm {
 namespace orc {
 
+struct KaleidoscopeJITOptions {
+  /// Compile each function on its first call instead of when its module
+  /// is added. Functions are emitted behind lazy re-exports and stubs.
+  bool Lazy = false;
+
+  /// Number of threads compiling in the background. With 0, everything
+  /// is compiled on the thread performing the lookup.
+  unsigned CompileThreads = 0;
+
+  /// Directory of the persistent object cache. Empty disables caching.
+  std::string ObjectCacheDir;
+
+  /// Target the baseline CPU of the triple instead of the host's, so the
+  /// generated code (and cached objects) run on any machine of that arch.
+  bool Portable = false;
+
+  /// Overrides of the CPU name and features (e.g. "+avx2,-fma"). A CPU
+  /// name replaces the host or portable defaults with that CPU's own
+  /// features, the features are applied on top of them.
+  std::string CPU;
+  std::string Features;
+
+  /// Size of the slabs JIT'd code and data are allocated from, recycled
+  /// as modules are removed. 0 maps memory for every object separately.
+  size_t MemorySlabSize = 1 << 20;
+};
+
+/// Runs ORC tasks (materialization, linking continuations) on a fixed
+/// size thread pool.
+class ThreadPoolTaskDispatcher : public TaskDispatcher {
+public:
+  ThreadPoolTaskDispatcher(unsigned NumThreads)
+      : Pool(hardware_concurrency(NumThreads)) {}
+
+  void dispatch(std::unique_ptr<Task> T) override {
+    // ThreadPool only takes copyable callables
+    Pool.async([UnownedT = T.release()]() {
+      std::unique_ptr<Task> T(UnownedT);
+      T->run();
+    });
+  }
+
+  void shutdown() override { Pool.wait(); }
+
+private:
+  ThreadPool Pool;
+};
+
+/// Work done by the JIT so far. MemoryInUse drops as modules are removed.
+struct KaleidoscopeJITStats {
+  uint64_t ModulesCompiled = 0;
+  uint64_t CompileNanos = 0;
+  uint64_t ObjectBytes = 0;
+  uint64_t MemoryInUse = 0;
+  uint64_t PeakMemoryInUse = 0;
+  /// Pages mapped for code and data, and mmap/mprotect/munmap calls
+  /// made to manage them
+  uint64_t MemoryReserved = 0;
+  uint64_t MemorySyscalls = 0;
+  /// Lookups answered by the symbol address cache, and those that went
+  /// through the ExecutionSession
+  uint64_t SymbolCacheHits = 0;
+  uint64_t SymbolCacheMisses = 0;
+};
+
+/// Counters behind KaleidoscopeJITStats, updated from any compile thread
+struct KaleidoscopeJITCounters {
+  std::atomic<uint64_t> ModulesCompiled{0};
+  std::atomic<uint64_t> CompileNanos{0};
+  std::atomic<uint64_t> ObjectBytes{0};
+  std::atomic<uint64_t> MemoryInUse{0};
+  std::atomic<uint64_t> PeakMemoryInUse{0};
+
+  void addMemory(uint64_t Size) {
+    uint64_t InUse = MemoryInUse += Size;
+    uint64_t Peak = PeakMemoryInUse;
+    while (InUse > Peak && !PeakMemoryInUse.compare_exchange_weak(Peak, InUse))
+      ;
+  }
+};
+
+/// Like ConcurrentIRCompiler, but keeps the TargetMachines it creates for
+/// later compiles instead of building one per module. Setting one up costs
+/// far more than compiling a small module, e.g. a top-level expression.
+class PooledIRCompiler : public IRCompileLayer::IRCompiler {
+public:
+  PooledIRCompiler(JITTargetMachineBuilder JTMB,
+                   KaleidoscopeObjectCache *ObjCache = nullptr)
+      : IRCompiler(irManglingOptionsFromTargetOptions(JTMB.getOptions())),
+        JTMB(std::move(JTMB)), ObjCache(ObjCache) {}
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    std::unique_ptr<TargetMachine> TM;
+    {
+      std::lock_guard<std::mutex> Lock(IdleMutex);
+      if (!Idle.empty()) {
+        TM = std::move(Idle.back());
+        Idle.pop_back();
+      }
+    }
+    if (!TM) {
+      auto NewTM = JTMB.createTargetMachine();
+      if (!NewTM)
+        return NewTM.takeError();
+      TM = std::move(*NewTM);
+    }
+
+    auto Obj = SimpleCompiler(*TM, ObjCache)(M);
+    if (!Obj && ObjCache)
+      ObjCache->notifyCompileFailed(&M);
+
+    std::lock_guard<std::mutex> Lock(IdleMutex);
+    Idle.push_back(std::move(TM));
+    return Obj;
+  }
+
+private:
+  JITTargetMachineBuilder JTMB;
+  KaleidoscopeObjectCache *ObjCache;
+  // One per thread that has compiled concurrently at some point
+  std::mutex IdleMutex;
+  std::vector<std::unique_ptr<TargetMachine>> Idle;
+};
+
+/// Times the wrapped compiler and measures the objects it produces
+class CountingIRCompiler : public IRCompileLayer::IRCompiler {
+public:
+  CountingIRCompiler(std::unique_ptr<IRCompiler> Compiler,
+                     KaleidoscopeJITCounters &Counters)
+      : IRCompiler(Compiler->getManglingOptions()),
+        Compiler(std::move(Compiler)), Counters(Counters) {}
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    auto Start = std::chrono::steady_clock::now();
+    auto Obj = (*Compiler)(M);
+    Counters.CompileNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 std::chrono::steady_clock::now() - Start)
+                                 .count();
+    if (Obj) {
+      ++Counters.ModulesCompiled;
+      Counters.ObjectBytes += (*Obj)->getBufferSize();
+    }
+    return Obj;
+  }
+
+private:
+  std::unique_ptr<IRCompiler> Compiler;
+  KaleidoscopeJITCounters &Counters;
+};
+
+/// SectionMemoryManager accounting for the sections it allocates
+class CountingMemoryManager : public SectionMemoryManager {
+public:
+  CountingMemoryManager(KaleidoscopeJITCounters &Counters,
+                        MemoryMapper *Mapper = nullptr)
+      : SectionMemoryManager(Mapper), Counters(Counters) {}
+
+  ~CountingMemoryManager() override { Counters.MemoryInUse -= Allocated; }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    track(Size);
+    return SectionMemoryManager::allocateCodeSection(Size, Alignment,
+                                                     SectionID, SectionName);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    track(Size);
+    return SectionMemoryManager::allocateDataSection(
+        Size, Alignment, SectionID, SectionName, IsReadOnly);
+  }
+
+private:
+  KaleidoscopeJITCounters &Counters;
+  uint64_t Allocated = 0;
+
+  void track(uintptr_t Size) {
+    Allocated += Size;
+    Counters.addMemory(Size);
+  }
+};
+
+/// Addresses found by KaleidoscopeJIT::lookup(), by unmangled name. A
+/// name is dropped as soon as the resource tracker of the module defining
+/// it is removed.
+class KaleidoscopeSymbolCache : public ResourceManager {
+public:
+  /// Changes with every removal. Lookups started before one may have
+  /// found a symbol that is gone by the time they would cache it.
+  uint64_t getEpoch() {
+    std::lock_guard<std::mutex> Lock(CacheMutex);
+    return Epoch;
+  }
+
+  std::optional<ExecutorSymbolDef> find(StringRef Name) {
+    std::lock_guard<std::mutex> Lock(CacheMutex);
+    auto It = Addresses.find(Name);
+    if (It == Addresses.end()) {
+      ++Misses;
+      return std::nullopt;
+    }
+    ++Hits;
+    return It->second;
+  }
+
+  void insert(StringRef Name, ExecutorSymbolDef Sym, uint64_t LookupEpoch) {
+    std::lock_guard<std::mutex> Lock(CacheMutex);
+    if (LookupEpoch == Epoch)
+      Addresses[Name] = Sym;
+  }
+
+  /// Records the names defined by the modules added under K
+  void addDefinitions(ResourceKey K, std::vector<std::string> Names) {
+    std::lock_guard<std::mutex> Lock(CacheMutex);
+    std::vector<std::string> &KeyNames = NamesByKey[K];
+    KeyNames.insert(KeyNames.end(), std::make_move_iterator(Names.begin()),
+                    std::make_move_iterator(Names.end()));
+  }
+
+  uint64_t getHits() const { return Hits; }
+  uint64_t getMisses() const { return Misses; }
+
+  Error handleRemoveResources(JITDylib &JD, ResourceKey K) override {
+    std::lock_guard<std::mutex> Lock(CacheMutex);
+    ++Epoch;
+    auto It = NamesByKey.find(K);
+    if (It == NamesByKey.end())
+      return Error::success();
+    for (const std::string &Name : It->second)
+      Addresses.erase(Name);
+    NamesByKey.erase(It);
+    return Error::success();
+  }
+
+  void handleTransferResources(JITDylib &JD, ResourceKey DstK,
+                               ResourceKey SrcK) override {
+    std::lock_guard<std::mutex> Lock(CacheMutex);
+    auto It = NamesByKey.find(SrcK);
+    if (It == NamesByKey.end())
+      return;
+    std::vector<std::string> Names = std::move(It->second);
+    NamesByKey.erase(It);
+    std::vector<std::string> &DstNames = NamesByKey[DstK];
+    DstNames.insert(DstNames.end(), std::make_move_iterator(Names.begin()),
+                    std::make_move_iterator(Names.end()));
+  }
+
+private:
+  std::mutex CacheMutex;
+  StringMap<ExecutorSymbolDef> Addresses;
+  DenseMap<ResourceKey, std::vector<std::string>> NamesByKey;
+  uint64_t Epoch = 0;
+  std::atomic<uint64_t> Hits{0};
+  std::atomic<uint64_t> Misses{0};
+};
+
 class KaleidoscopeJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
+  KaleidoscopeJITOptions Opts;
+  JITTargetMachineBuilder TMBuilder;
 
   DataLayout DL;
   MangleAndInterner Mangle;
 
+  std::unique_ptr<KaleidoscopeObjectCache> ObjCache;
+  // Before the layers, which update them until they are destroyed
+  std::unique_ptr<KaleidoscopeJITCounters> Counters =
+      std::make_unique<KaleidoscopeJITCounters>();
+  std::unique_ptr<KaleidoscopeMemoryPool> MemoryPool;
+  std::unique_ptr<KaleidoscopeSymbolCache> SymbolCache =
+      std::make_unique<KaleidoscopeSymbolCache>();
+  std::unique_ptr<KaleidoscopeStubTable> StubTable;
+
   RTDyldObjectLinkingLayer ObjectLayer;
   IRCompileLayer CompileLayer;
 
+  // Only set up in lazy mode
+  std::unique_ptr<LazyCallThroughManager> LCTMgr;
+  std::unique_ptr<CompileOnDemandLayer> CODLayer;
+
   JITDylib &MainJD;
 
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
-      : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  const KaleidoscopeJITOptions &Opts = KaleidoscopeJITOptions(),
+                  std::unique_ptr<LazyCallThroughManager> LCTMgr = nullptr)
+      : ES(std::move(ES)), Opts(Opts), TMBuilder(JTMB), DL(std::move(DL)),
+        Mangle(*this->ES, this->DL),
+        // JITTargetMachineBuilder codegens at CodeGenOpt::Default (-O2)
+        ObjCache(Opts.ObjectCacheDir.empty()
+                     ? nullptr
+                     : std::make_unique<KaleidoscopeObjectCache>(
+                           Opts.ObjectCacheDir, JTMB, "O2")),
+        MemoryPool(
+            std::make_unique<KaleidoscopeMemoryPool>(Opts.MemorySlabSize)),
         ObjectLayer(*this->ES,
-                    [](const MemoryBuffer &) {
-                      return std::make_unique<SectionMemoryManager>();
+                    [this](const MemoryBuffer &) {
+                      return std::make_unique<CountingMemoryManager>(
+                          *Counters, MemoryPool.get());
                     }),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+                     std::make_unique<CountingIRCompiler>(
+                         std::make_unique<PooledIRCompiler>(
+                             JTMB, ObjCache.get()),
+                         *Counters)),
+        LCTMgr(std::move(LCTMgr)),
         MainJD(this->ES->createBareJITDylib("<main>")) {
+    if (this->LCTMgr) {
+      CODLayer = std::make_unique<CompileOnDemandLayer>(
+          *this->ES, CompileLayer, *this->LCTMgr,
+          createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple()));
+      // Split modules per function so that only called functions are
+      // ever compiled
+      CODLayer->setPartitionFunction(CompileOnDemandLayer::compileRequested);
+    }
+    StubTable = std::make_unique<KaleidoscopeStubTable>(
+        MainJD, Mangle,
+        createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple())());
+    this->ES->registerResourceManager(*SymbolCache);
+    this->ES->registerResourceManager(*StubTable);
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
+    // The runtime of parallel loops, linked into this process but not
+    // necessarily exported by it
+    cantFail(MainJD.define(absoluteSymbols(
+        {{Mangle("kaleidoscope_parallel_reduce"),
+          {ExecutorAddr::fromPtr(&kaleidoscope_parallel_reduce),
+           JITSymbolFlags::Exported | JITSymbolFlags::Callable}}})));
     if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
@@ -67,38 +400,302 @@ public:
   ~KaleidoscopeJIT() {
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
+    ES->deregisterResourceManager(*StubTable);
+    ES->deregisterResourceManager(*SymbolCache);
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-    auto EPC = SelfExecutorProcessControl::Create();
+  /// Target (triple, CPU, features) a JIT created with Opts generates
+  /// code for, without creating one (e.g. to compile ahead of time)
+  static Expected<JITTargetMachineBuilder>
+  detectTarget(const KaleidoscopeJITOptions &Opts = KaleidoscopeJITOptions()) {
+    JITTargetMachineBuilder JTMB((Triple(sys::getProcessTriple())));
+    if (!Opts.CPU.empty()) {
+      // Only the features of that CPU: the host's may include some it
+      // doesn't have (e.g. AVX-512 on a machine newer than it)
+      JTMB.setCPU(Opts.CPU);
+    } else if (!Opts.Portable) {
+      // Host CPU name and features, so the backend can use e.g. AVX/FMA
+      auto HostJTMB = JITTargetMachineBuilder::detectHost();
+      if (!HostJTMB)
+        return HostJTMB.takeError();
+      JTMB = std::move(*HostJTMB);
+    }
+    if (!Opts.Features.empty())
+      JTMB.addFeatures(SubtargetFeatures(Opts.Features).getFeatures());
+    return JTMB;
+  }
+
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(const KaleidoscopeJITOptions &Opts = KaleidoscopeJITOptions()) {
+    std::unique_ptr<TaskDispatcher> Dispatcher;
+    if (Opts.CompileThreads > 0)
+      Dispatcher = std::make_unique<ThreadPoolTaskDispatcher>(Opts.CompileThreads);
+    else
+      Dispatcher = std::make_unique<InPlaceTaskDispatcher>();
+
+    auto EPC = SelfExecutorProcessControl::Create(nullptr, std::move(Dispatcher));
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
+    auto JTMBOrErr = detectTarget(Opts);
+    if (!JTMBOrErr)
+      return JTMBOrErr.takeError();
+    JITTargetMachineBuilder JTMB = std::move(*JTMBOrErr);
 
     auto DL = JTMB.getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
+    std::unique_ptr<LazyCallThroughManager> LCTMgr;
+    if (Opts.Lazy) {
+      auto LCTMgrOrErr = createLocalLazyCallThroughManager(
+          JTMB.getTargetTriple(), *ES, ExecutorAddr());
+      if (!LCTMgrOrErr)
+        return LCTMgrOrErr.takeError();
+      LCTMgr = std::move(*LCTMgrOrErr);
+    }
+
     return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+                                             std::move(*DL), Opts,
+                                             std::move(LCTMgr));
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
+  /// Target (triple, CPU, features) the JIT generates code for
+  const JITTargetMachineBuilder &getTargetMachineBuilder() const {
+    return TMBuilder;
+  }
+
+  /// Whether code for TM passes vec4 values (<4 x double>) the way C and
+  /// C++ code built with AVX passes a 32-byte vector: in one ymm register.
+  /// Anywhere else the two disagree, so vec4 signatures are rejected.
+  static bool supportsVec4(const TargetMachine &TM) {
+    return TM.getTargetTriple().isX86() &&
+           TM.getMCSubtargetInfo()->checkFeatures("+avx");
+  }
+
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  /// Null unless an object cache directory was configured
+  const KaleidoscopeObjectCache *getObjectCache() const {
+    return ObjCache.get();
+  }
+
+  /// Modules added with their own tracker are assumed to be transient
+  /// (e.g. top-level expressions run once and removed) and are always
+  /// compiled eagerly, as code behind lazy re-exports can't be removed.
+  /// So are modules defining functions that take or return vectors: the
+  /// lazy reentry trampoline only preserves the low 128 bits of vector
+  /// registers, which would cut AVX arguments in half.
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
-    if (!RT)
+    bool Transient = RT != nullptr;
+    if (!Transient)
       RT = MainJD.getDefaultResourceTracker();
+    std::vector<std::string> Names;
+    bool HasVectorSignatures = false;
+    TSM.withModuleDo([&](Module &M) {
+      for (Function &F : M) {
+        if (F.isDeclaration())
+          continue;
+        Names.push_back(F.getName().str());
+        FunctionType *FT = F.getFunctionType();
+        HasVectorSignatures |= FT->getReturnType()->isVectorTy() ||
+                               any_of(FT->params(), [](Type *T) {
+                                 return T->isVectorTy();
+                               });
+      }
+    });
+    SymbolCache->addDefinitions(RT->getKeyUnsafe(), std::move(Names));
+
+    if (!Transient && CODLayer && !HasVectorSignatures)
+      return CODLayer->add(RT, std::move(TSM));
+    if (Opts.CompileThreads > 1)
+      return addPartitioned(std::move(TSM), std::move(RT));
     return CompileLayer.add(RT, std::move(TSM));
   }
 
+  /// Prepares M for addRedefinableModule(): its functions are renamed and
+  /// only called through stubs. Must come before optimizing M.
+  void renameForRedefinition(Module &M) {
+    StubTable->renameForRedefinition(M);
+  }
+
+  /// Compiles the functions of TSM, prepared by renameForRedefinition(),
+  /// without calling them yet: existing callers keep running the bodies
+  /// their stubs point to until publishRedefinitions().
+  Expected<RedefinedBodies> addRedefinableModule(ThreadSafeModule TSM,
+                                                 ResourceTrackerSP RT) {
+    std::vector<std::pair<std::string, std::string>> Renamed;
+    TSM.withModuleDo([&](Module &M) {
+      Renamed = KaleidoscopeStubTable::getRenamedBodies(M);
+    });
+    std::vector<std::string> Names, BodyNames;
+    for (const auto &[BodyName, Name] : Renamed) {
+      BodyNames.push_back(BodyName);
+      Names.push_back(Name);
+    }
+    // The module may call the functions it defines through their stubs
+    if (auto Err = StubTable->reserveStubs(Names))
+      return std::move(Err);
+    if (auto Err = addModule(std::move(TSM), RT))
+      return std::move(Err);
+
+    auto Symbols = lookupAll(BodyNames);
+    if (!Symbols)
+      return Symbols.takeError();
+
+    RedefinedBodies Redefined;
+    Redefined.RT = std::move(RT);
+    for (const auto &[BodyName, Name] : Renamed)
+      Redefined.Bodies.emplace_back(Name,
+                                    (*Symbols)[Mangle(BodyName)].getAddress());
+    return Redefined;
+  }
+
+  /// Switches the stubs to the bodies compiled by addRedefinableModule().
+  /// Modules whose bodies are no longer used by any stub are appended to
+  /// Retired, to be removed once no thread may still be running them.
+  Error publishRedefinitions(const RedefinedBodies &Redefined,
+                             std::vector<ResourceTrackerSP> &Retired) {
+    return StubTable->publish(Redefined, Retired);
+  }
+
+  KaleidoscopeJITStats getStats() const {
+    KaleidoscopeJITStats Stats;
+    Stats.ModulesCompiled = Counters->ModulesCompiled;
+    Stats.CompileNanos = Counters->CompileNanos;
+    Stats.ObjectBytes = Counters->ObjectBytes;
+    Stats.MemoryInUse = Counters->MemoryInUse;
+    Stats.PeakMemoryInUse = Counters->PeakMemoryInUse;
+    KaleidoscopeMemoryPoolStats PoolStats = MemoryPool->getStats();
+    Stats.MemoryReserved = PoolStats.ReservedBytes;
+    Stats.MemorySyscalls =
+        PoolStats.MapCalls + PoolStats.ProtectCalls + PoolStats.UnmapCalls;
+    Stats.SymbolCacheHits = SymbolCache->getHits();
+    Stats.SymbolCacheMisses = SymbolCache->getMisses();
+    return Stats;
+  }
+
+  /// Answered from the symbol address cache when Name was looked up
+  /// before and the module defining it is still there.
   Expected<ExecutorSymbolDef> lookup(StringRef Name) {
-    return ES->lookup({&MainJD}, Mangle(Name.str()));
+    if (std::optional<ExecutorSymbolDef> Sym = SymbolCache->find(Name))
+      return *Sym;
+    uint64_t Epoch = SymbolCache->getEpoch();
+    auto Sym = ES->lookup({&MainJD}, Mangle(Name.str()));
+    if (Sym)
+      SymbolCache->insert(Name, *Sym, Epoch);
+    return Sym;
+  }
+
+  /// Looks up all of Names at once, so that the modules defining them
+  /// are materialized concurrently when there are compile threads.
+  Expected<SymbolMap> lookupAll(ArrayRef<std::string> Names) {
+    SymbolLookupSet Symbols;
+    for (const std::string &Name : Names)
+      Symbols.add(Mangle(Name));
+    return ES->lookup(makeJITDylibSearchOrder(&MainJD), std::move(Symbols));
+  }
+
+private:
+  /// Spreads the function definitions of TSM round-robin over a few
+  /// modules, each cloned into its own context, with the global
+  /// variables and aliases in the first one, and local functions with
+  /// their callers (merging the partitions of callers that share one).
+  /// Every partition is a separate materialization unit, so independent
+  /// functions compile in parallel on the dispatcher's threads and a
+  /// lookup only waits for the partitions holding the symbols it needs.
+  Error addPartitioned(ThreadSafeModule TSM, ResourceTrackerSP RT) {
+    unsigned MaxPartitions = Opts.CompileThreads * 4;
+    unsigned NumDefinitions = 0;
+    DenseMap<const GlobalValue *, unsigned> PartitionOf;
+    // Partitions merged into another one, by index
+    SmallVector<unsigned, 16> MergedInto(MaxPartitions);
+    std::iota(MergedInto.begin(), MergedInto.end(), 0u);
+    auto Leader = [&](unsigned P) {
+      while (MergedInto[P] != P)
+        P = MergedInto[P] = MergedInto[MergedInto[P]];
+      return P;
+    };
+    bool HasLocalData = false;
+    TSM.withModuleDo([&](Module &M) {
+      // Data goes in the first partition, the others link to it. Local
+      // data (or a local function used outside of code) can't be linked
+      // to, so it keeps the module whole.
+      for (GlobalVariable &GV : M.globals()) {
+        HasLocalData |= GV.hasLocalLinkage();
+        if (!GV.isDeclaration())
+          PartitionOf[&GV] = 0;
+      }
+      for (GlobalAlias &GA : M.aliases()) {
+        HasLocalData |= GA.hasLocalLinkage();
+        PartitionOf[&GA] = 0;
+      }
+      for (Function &F : M)
+        if (!F.isDeclaration() && !F.hasLocalLinkage())
+          PartitionOf[&F] = NumDefinitions++ % MaxPartitions;
+      // Local functions (the chunks of parallel loops) can't be linked
+      // to from other partitions: they go with the function calling them
+      for (bool Changed = true; Changed;) {
+        Changed = false;
+        for (Function &F : M) {
+          if (F.isDeclaration() || !F.hasLocalLinkage() || PartitionOf.count(&F))
+            continue;
+          for (User *U : F.users()) {
+            auto *I = dyn_cast<Instruction>(U);
+            auto It = I ? PartitionOf.find(I->getFunction()) : PartitionOf.end();
+            if (It != PartitionOf.end()) {
+              PartitionOf[&F] = It->second;
+              Changed = true;
+              break;
+            }
+          }
+        }
+      }
+      for (Function &F : M)
+        if (!F.isDeclaration() && !PartitionOf.count(&F))
+          PartitionOf[&F] = 0;
+      // Once inlined (the module pipeline runs first), a chunk may have
+      // callers in several partitions, which then have to be one
+      for (Function &F : M) {
+        if (F.isDeclaration() || !F.hasLocalLinkage())
+          continue;
+        for (User *U : F.users()) {
+          auto *I = dyn_cast<Instruction>(U);
+          if (!I) {
+            HasLocalData = true;
+            continue;
+          }
+          unsigned From = Leader(PartitionOf[I->getFunction()]);
+          unsigned To = Leader(PartitionOf[&F]);
+          MergedInto[std::max(From, To)] = std::min(From, To);
+        }
+      }
+      for (auto &Entry : PartitionOf)
+        Entry.second = Leader(Entry.second);
+    });
+    unsigned NumPartitions = std::min(NumDefinitions, MaxPartitions);
+    unsigned NumLeaders = 0;
+    for (unsigned P = 0; P != NumPartitions; ++P)
+      NumLeaders += Leader(P) == P;
+
+    if (NumLeaders <= 1 || HasLocalData)
+      return CompileLayer.add(RT, std::move(TSM));
+
+    for (unsigned P = 0; P != NumPartitions; ++P) {
+      if (Leader(P) != P)
+        continue;
+      auto Partition = cloneToNewContext(TSM, [&](const GlobalValue &GV) {
+        auto It = PartitionOf.find(&GV);
+        return It != PartitionOf.end() && It->second == P;
+      });
+      if (auto Err = CompileLayer.add(RT, std::move(Partition)))
+        return Err;
+    }
+    return Error::success();
   }
 };
 
@@ -0,0 +1,265 @@
+//===- KaleidoscopeMemoryPool.h - Slab allocator for JIT'd code -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Memory mapper for the JIT's SectionMemoryManagers. Instead of mapping and
+// unmapping pages for every object, blocks are carved out of large slabs
+// and recycled once the object owning them is removed, e.g. after running
+// a top-level expression.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEMEMORYPOOL_H
+#define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEMEMORYPOOL_H
+
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Support/Alignment.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <mutex>
+
+namespace llvm {
+namespace orc {
+
+/// Memory held by the pool and system calls made so far
+struct KaleidoscopeMemoryPoolStats {
+  uint64_t Slabs = 0;
+  uint64_t ReservedBytes = 0;
+  uint64_t UsedBytes = 0;
+  uint64_t MapCalls = 0;
+  uint64_t ProtectCalls = 0;
+  uint64_t UnmapCalls = 0;
+};
+
+class KaleidoscopeMemoryPool : public SectionMemoryManager::MemoryMapper {
+private:
+  struct Slab {
+    size_t Size;
+    size_t Used;
+  };
+
+  struct Range {
+    size_t Size;
+    // Some page may have been protected as something else than
+    // read-write, which it has to be again before being handed out
+    bool Dirty;
+  };
+
+  struct UsedRange : Range {
+    // Pages last protected, as sections sharing a page (e.g. constants
+    // and unwind info) are protected one by one
+    char *ProtectedBegin = nullptr;
+    char *ProtectedEnd = nullptr;
+    unsigned ProtectedFlags = 0;
+  };
+
+  // 0 maps every block separately, i.e. no pooling
+  size_t SlabSize;
+  size_t PageSize;
+
+  std::mutex PoolMutex;
+  std::map<char *, Slab> Slabs;
+  std::map<char *, Range> FreeRanges;
+  std::map<char *, UsedRange> UsedRanges;
+  KaleidoscopeMemoryPoolStats Stats;
+
+public:
+  /// SlabSize is rounded up to whole pages. Blocks larger than a slab
+  /// get a slab of their own.
+  KaleidoscopeMemoryPool(size_t SlabSize)
+      : PageSize(sys::Process::getPageSizeEstimate()) {
+    this->SlabSize = SlabSize ? alignTo(SlabSize, PageSize) : 0;
+  }
+
+  ~KaleidoscopeMemoryPool() override {
+    for (auto &[Base, S] : Slabs) {
+      sys::MemoryBlock Block(Base, S.Size);
+      sys::Memory::releaseMappedMemory(Block);
+    }
+  }
+
+  KaleidoscopeMemoryPoolStats getStats() {
+    std::lock_guard<std::mutex> Lock(PoolMutex);
+    return Stats;
+  }
+
+  sys::MemoryBlock allocateMappedMemory(SectionMemoryManager::AllocationPurpose,
+                                        size_t NumBytes,
+                                        const sys::MemoryBlock *const NearBlock,
+                                        unsigned Flags,
+                                        std::error_code &EC) override {
+    std::lock_guard<std::mutex> Lock(PoolMutex);
+    if (!SlabSize) {
+      ++Stats.MapCalls;
+      sys::MemoryBlock Block =
+          sys::Memory::allocateMappedMemory(NumBytes, NearBlock, Flags, EC);
+      Stats.ReservedBytes += Block.allocatedSize();
+      Stats.UsedBytes += Block.allocatedSize();
+      return Block;
+    }
+
+    // SectionMemoryManager only ever asks for read-write memory
+    size_t Size = alignTo(NumBytes, PageSize);
+    auto It = FreeRanges.begin();
+    while (It != FreeRanges.end() && It->second.Size < Size)
+      ++It;
+    if (It == FreeRanges.end()) {
+      It = mapSlab(std::max(Size, SlabSize), EC);
+      if (EC)
+        return sys::MemoryBlock();
+    }
+
+    // First fit, from the lowest address, so that blocks freed together
+    // merge back and are reset with a single call
+    char *Base = It->first;
+    Range Free = It->second;
+    if (Free.Dirty) {
+      ++Stats.ProtectCalls;
+      EC = sys::Memory::protectMappedMemory(sys::MemoryBlock(Base, Free.Size),
+                                            sys::Memory::MF_READ |
+                                                sys::Memory::MF_WRITE);
+      if (EC)
+        return sys::MemoryBlock();
+    }
+    FreeRanges.erase(It);
+    if (Free.Size > Size)
+      FreeRanges[Base + Size] = Range{Free.Size - Size, false};
+    UsedRanges[Base] = UsedRange{{Size, false}};
+    slabOf(Base).Used += Size;
+    Stats.UsedBytes += Size;
+    return sys::MemoryBlock(Base, Size);
+  }
+
+  std::error_code protectMappedMemory(const sys::MemoryBlock &Block,
+                                      unsigned Flags) override {
+    std::lock_guard<std::mutex> Lock(PoolMutex);
+    if (SlabSize) {
+      char *Begin = alignDown(static_cast<char *>(Block.base()));
+      char *End = alignDown(static_cast<char *>(Block.base()) +
+                            Block.allocatedSize() + PageSize - 1);
+      UsedRange &Used =
+          std::prev(UsedRanges.upper_bound(Begin))->second;
+      if (Flags == Used.ProtectedFlags && Begin >= Used.ProtectedBegin &&
+          End <= Used.ProtectedEnd)
+        return std::error_code();
+      Used.ProtectedBegin = Begin;
+      Used.ProtectedEnd = End;
+      Used.ProtectedFlags = Flags;
+      if (Flags != (sys::Memory::MF_READ | sys::Memory::MF_WRITE))
+        Used.Dirty = true;
+    }
+    ++Stats.ProtectCalls;
+    return sys::Memory::protectMappedMemory(Block, Flags);
+  }
+
+  std::error_code releaseMappedMemory(sys::MemoryBlock &Block) override {
+    std::lock_guard<std::mutex> Lock(PoolMutex);
+    if (!SlabSize) {
+      ++Stats.UnmapCalls;
+      Stats.ReservedBytes -= Block.allocatedSize();
+      Stats.UsedBytes -= Block.allocatedSize();
+      return sys::Memory::releaseMappedMemory(Block);
+    }
+
+    char *Base = static_cast<char *>(Block.base());
+    auto Used = UsedRanges.find(Base);
+    Range Freed = Used->second;
+    UsedRanges.erase(Used);
+    Stats.UsedBytes -= Freed.Size;
+    Block = sys::MemoryBlock();
+
+    Slab &S = slabOf(Base);
+    S.Used -= Freed.Size;
+    if (S.Used == 0 && hasOtherEmptySlab(Base)) {
+      // Keep a single empty slab around, so that memory usage hovering
+      // around a slab boundary doesn't map and unmap it over and over
+      unmapSlab(Base);
+      return std::error_code();
+    }
+
+    // Merge with the free neighbours within the same slab
+    auto Next = FreeRanges.find(Base + Freed.Size);
+    if (Next != FreeRanges.end() && &slabOf(Next->first) == &S) {
+      Freed.Size += Next->second.Size;
+      Freed.Dirty |= Next->second.Dirty;
+      FreeRanges.erase(Next);
+    }
+    auto Prev = FreeRanges.lower_bound(Base);
+    if (Prev != FreeRanges.begin()) {
+      --Prev;
+      if (Prev->first + Prev->second.Size == Base &&
+          &slabOf(Prev->first) == &S) {
+        Prev->second.Size += Freed.Size;
+        Prev->second.Dirty |= Freed.Dirty;
+        return std::error_code();
+      }
+    }
+    FreeRanges[Base] = Freed;
+    return std::error_code();
+  }
+
+private:
+  std::map<char *, Range>::iterator mapSlab(size_t Size, std::error_code &EC) {
+    // Near the other slabs, as sections of an object reference each other
+    // with 32 bit offsets
+    sys::MemoryBlock Near;
+    if (!Slabs.empty())
+      Near = sys::MemoryBlock(Slabs.begin()->first, Slabs.begin()->second.Size);
+    ++Stats.MapCalls;
+    sys::MemoryBlock Block = sys::Memory::allocateMappedMemory(
+        Size, Slabs.empty() ? nullptr : &Near,
+        sys::Memory::MF_READ | sys::Memory::MF_WRITE, EC);
+    if (EC)
+      return FreeRanges.end();
+
+    char *Base = static_cast<char *>(Block.base());
+    Slabs[Base] = Slab{Block.allocatedSize(), 0};
+    ++Stats.Slabs;
+    Stats.ReservedBytes += Block.allocatedSize();
+    return FreeRanges.emplace(Base, Range{Block.allocatedSize(), false}).first;
+  }
+
+  char *alignDown(char *Address) {
+    return reinterpret_cast<char *>(reinterpret_cast<uintptr_t>(Address) &
+                                    ~(uintptr_t)(PageSize - 1));
+  }
+
+  Slab &slabOf(char *Address) {
+    return std::prev(Slabs.upper_bound(Address))->second;
+  }
+
+  bool hasOtherEmptySlab(char *Address) {
+    Slab *S = &slabOf(Address);
+    for (auto &[Base, Other] : Slabs)
+      if (&Other != S && Other.Used == 0)
+        return true;
+    return false;
+  }
+
+  void unmapSlab(char *Address) {
+    auto It = std::prev(Slabs.upper_bound(Address));
+    char *Base = It->first;
+    size_t Size = It->second.Size;
+    // Every other range of the slab is free
+    FreeRanges.erase(FreeRanges.lower_bound(Base),
+                     FreeRanges.lower_bound(Base + Size));
+    sys::MemoryBlock Block(Base, Size);
+    ++Stats.UnmapCalls;
+    sys::Memory::releaseMappedMemory(Block);
+    Slabs.erase(It);
+    --Stats.Slabs;
+    Stats.ReservedBytes -= Size;
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEMEMORYPOOL_H
@@ -0,0 +1,148 @@
+//===- KaleidoscopeObjectCache.h - On-disk object cache for the JIT -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Persistent object cache for KaleidoscopeJIT. Objects are keyed by a hash
+// of the module's (already optimized) IR and of everything else that
+// affects native codegen, so unchanged definitions skip codegen entirely
+// on the next run.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEOBJECTCACHE_H
+#define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEOBJECTCACHE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA256.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace llvm {
+namespace orc {
+
+class KaleidoscopeObjectCache : public ObjectCache {
+private:
+  std::string CacheDir;
+  // Everything besides the IR that changes the emitted object
+  std::string TargetKey;
+
+  // Keys computed by getObject() for modules being compiled, so that
+  // notifyObjectCompiled() doesn't have to hash them a second time
+  std::mutex PendingMutex;
+  DenseMap<const Module *, std::string> PendingKeys;
+
+  std::atomic<uint64_t> Hits{0};
+  std::atomic<uint64_t> Misses{0};
+
+public:
+  /// OptLevelKey identifies the codegen optimization level, which
+  /// JITTargetMachineBuilder doesn't expose.
+  KaleidoscopeObjectCache(StringRef CacheDir,
+                          const JITTargetMachineBuilder &JTMB,
+                          StringRef OptLevelKey)
+      : CacheDir(CacheDir.str()) {
+    raw_string_ostream OS(TargetKey);
+    OS << JTMB.getTargetTriple().str() << '\n'
+       << JTMB.getCPU() << '\n'
+       << JTMB.getFeatures().getString() << '\n'
+       << OptLevelKey << '\n';
+    // A missing directory just turns every lookup into a miss
+    consumeError(errorCodeToError(sys::fs::create_directories(CacheDir)));
+  }
+
+  uint64_t getHits() const { return Hits; }
+  uint64_t getMisses() const { return Misses; }
+
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+    std::string Key = computeKey(*M);
+
+    auto Obj = MemoryBuffer::getFile(getPath(Key), /*IsText=*/false,
+                                     /*RequiresNullTerminator=*/false);
+    if (Obj) {
+      ++Hits;
+      return std::move(*Obj);
+    }
+
+    ++Misses;
+    std::lock_guard<std::mutex> Lock(PendingMutex);
+    PendingKeys[M] = std::move(Key);
+    return nullptr;
+  }
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+    std::string Key;
+    {
+      std::lock_guard<std::mutex> Lock(PendingMutex);
+      auto It = PendingKeys.find(M);
+      if (It == PendingKeys.end())
+        return;
+      Key = std::move(It->second);
+      PendingKeys.erase(It);
+    }
+
+    // Write to a private file and rename it into place, so concurrent
+    // processes never read a partially written object
+    SmallString<128> Path = getPath(Key);
+    SmallString<128> TmpPath;
+    int FD;
+    if (sys::fs::createUniqueFile(Path + ".tmp-%%%%%%", FD, TmpPath))
+      return;
+    {
+      raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Obj.getBuffer();
+      if (OS.has_error()) {
+        OS.clear_error();
+        sys::fs::remove(TmpPath);
+        return;
+      }
+    }
+    if (sys::fs::rename(TmpPath, Path))
+      sys::fs::remove(TmpPath);
+  }
+
+  /// Called instead of notifyObjectCompiled() when compiling M failed,
+  /// so that its key doesn't stay pending
+  void notifyCompileFailed(const Module *M) {
+    std::lock_guard<std::mutex> Lock(PendingMutex);
+    PendingKeys.erase(M);
+  }
+
+private:
+  std::string computeKey(const Module &M) {
+    std::string IR;
+    raw_string_ostream OS(IR);
+    M.print(OS, nullptr);
+    OS.flush();
+
+    SHA256 Hasher;
+    Hasher.update(TargetKey);
+    Hasher.update(IR);
+    return toHex(Hasher.final(), /*LowerCase=*/true);
+  }
+
+  SmallString<128> getPath(StringRef Key) {
+    SmallString<128> Path(CacheDir);
+    sys::path::append(Path, Key + ".o");
+    return Path;
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEOBJECTCACHE_H
@@ -0,0 +1,173 @@
+//===- KaleidoscopeStubTable.h - Redefinable functions for the JIT -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Indirection stubs for functions that can be redefined while running.
+// Callers (JIT'd code and the host alike) always go through the stub of a
+// function, whose pointer is switched to a new body once that body has
+// been compiled. The module holding the old body is handed back to be
+// removed once no thread can still be running it.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPESTUBTABLE_H
+#define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPESTUBTABLE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/Mangling.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+/// Bodies of redefinable functions compiled by
+/// KaleidoscopeJIT::addRedefinableModule(), not called yet
+struct RedefinedBodies {
+  ResourceTrackerSP RT;
+  /// Function name and address of its new body
+  std::vector<std::pair<std::string, ExecutorAddr>> Bodies;
+};
+
+class KaleidoscopeStubTable : public ResourceManager {
+private:
+  /// Names the original function name on the body of a redefinable
+  /// function
+  static constexpr const char *RedefinesAttr = "kaleidoscope-redefines";
+
+  JITDylib &JD;
+  MangleAndInterner &Mangle;
+  std::unique_ptr<IndirectStubsManager> StubsMgr;
+
+  std::mutex StubsMutex;
+  StringMap<unsigned> Versions;
+  // Module holding the body each stub points to, null once removed
+  StringMap<ResourceTrackerSP> CurrentBodies;
+  // Number of stubs pointing into each module
+  DenseMap<ResourceTracker *, unsigned> LiveBodies;
+
+public:
+  KaleidoscopeStubTable(JITDylib &JD, MangleAndInterner &Mangle,
+                        std::unique_ptr<IndirectStubsManager> StubsMgr)
+      : JD(JD), Mangle(Mangle), StubsMgr(std::move(StubsMgr)) {}
+
+  /// Renames every function defined in M to a new body name, and makes
+  /// the calls to it (recursive ones aside) go through the original name,
+  /// which publish() turns into a stub. As no call can see the body, the
+  /// optimizer can't inline it or propagate its results either.
+  void renameForRedefinition(Module &M) {
+    std::vector<Function *> Definitions;
+    for (Function &F : M)
+      if (!F.isDeclaration() && F.hasExternalLinkage())
+        Definitions.push_back(&F);
+
+    std::lock_guard<std::mutex> Lock(StubsMutex);
+    for (Function *Body : Definitions) {
+      std::string Name = Body->getName().str();
+      // Kaleidoscope identifiers are alphanumeric, so this can't clash
+      Body->setName(Name + ".v" + std::to_string(++Versions[Name]));
+      Body->addFnAttr(RedefinesAttr, Name);
+      Function *Stub = Function::Create(Body->getFunctionType(),
+                                        GlobalValue::ExternalLinkage, Name, M);
+      Body->replaceUsesWithIf(Stub, [Body](Use &U) {
+        auto *I = dyn_cast<Instruction>(U.getUser());
+        return !I || I->getFunction() != Body;
+      });
+    }
+  }
+
+  /// Body names of the functions renamed in M, with their original names
+  static std::vector<std::pair<std::string, std::string>>
+  getRenamedBodies(Module &M) {
+    std::vector<std::pair<std::string, std::string>> Renamed;
+    for (Function &F : M)
+      if (!F.isDeclaration() && F.hasFnAttribute(RedefinesAttr))
+        Renamed.emplace_back(
+            F.getName().str(),
+            F.getFnAttribute(RedefinesAttr).getValueAsString().str());
+    return Renamed;
+  }
+
+  /// Creates the stubs of the names not redefinable yet, before code
+  /// calling them is linked. They point nowhere until publish().
+  Error reserveStubs(const std::vector<std::string> &Names) {
+    std::lock_guard<std::mutex> Lock(StubsMutex);
+    SymbolMap NewStubs;
+    for (const std::string &Name : Names) {
+      if (CurrentBodies.count(Name))
+        continue;
+      if (auto Err = StubsMgr->createStub(
+              Name, ExecutorAddr(),
+              JITSymbolFlags::Exported | JITSymbolFlags::Callable))
+        return Err;
+      NewStubs[Mangle(Name)] = StubsMgr->findStub(Name, true);
+      CurrentBodies[Name] = nullptr;
+    }
+
+    if (NewStubs.empty())
+      return Error::success();
+    return JD.define(absoluteSymbols(std::move(NewStubs)));
+  }
+
+  /// Points the stubs at the bodies in Redefined. Modules left with no
+  /// stub pointing into them are appended to Retired: they should be
+  /// removed once no thread can still be running their code. Threads
+  /// calling through the stubs are never blocked.
+  Error publish(const RedefinedBodies &Redefined,
+                std::vector<ResourceTrackerSP> &Retired) {
+    std::lock_guard<std::mutex> Lock(StubsMutex);
+    for (const auto &[Name, Addr] : Redefined.Bodies) {
+      // A single aligned pointer store: calls already past the stub
+      // finish in the old body, the next ones enter the new one
+      if (auto Err = StubsMgr->updatePointer(Name, Addr))
+        return Err;
+      ResourceTrackerSP &Current = CurrentBodies[Name];
+      if (Current) {
+        auto Live = LiveBodies.find(Current.get());
+        if (--Live->second == 0) {
+          LiveBodies.erase(Live);
+          Retired.push_back(Current);
+        }
+      }
+      Current = Redefined.RT;
+      ++LiveBodies[Redefined.RT.get()];
+    }
+    return Error::success();
+  }
+
+  Error handleRemoveResources(JITDylib &JD, ResourceKey K) override {
+    // The stubs of the removed bodies dangle until their function is
+    // published again, callers must not use them in between
+    std::lock_guard<std::mutex> Lock(StubsMutex);
+    for (auto &Current : CurrentBodies) {
+      ResourceTrackerSP &RT = Current.second;
+      if (RT && RT->getKeyUnsafe() == K) {
+        LiveBodies.erase(RT.get());
+        RT = nullptr;
+      }
+    }
+    return Error::success();
+  }
+
+  void handleTransferResources(JITDylib &JD, ResourceKey DstK,
+                               ResourceKey SrcK) override {
+    // Only happens when trackers are merged, which this JIT never does
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPESTUBTABLE_H
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Results of a pure function, cached by its own code (see
+// 'CodegenVisitor::memo_tables'): a direct-mapped table indexed by a hash
+// of the bits of the arguments. Entries are compared bit for bit too, so
+// 0.0 and -0.0 (or two NaNs) are different keys. Each entry is a seqlock,
+// as the workers of parallel loops may call memoized code at once: a
+// reader that sees it being written (or rewritten meanwhile) just misses.
+class MemoTable {
+    public:
+        static constexpr unsigned log2_entries = 12;
+        // A version, 0 while empty, odd while being written and even once
+        // filled, then the bits of each argument and of the result
+        const unsigned entry_words;
+        std::vector<uint64_t> entries;
+        // Incremented by the memoized code
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+
+        explicit MemoTable(unsigned arity)
+            : entry_words(arity + 2), entries((size_t)entry_words << log2_entries) {}
+};
+
+// Tables of the functions memoization was asked for, by name
+class MemoTables {
+    public:
+        explicit MemoTables(const std::vector<std::string> &names);
+
+        bool requested(std::string_view name) const;
+        // Empty table for a new definition of 'name', nullptr if it isn't
+        // to be memoized. Its address never changes.
+        MemoTable *table_for(std::string_view name, unsigned arity);
+
+        // Hits and misses of each function
+        void print_report(FILE *file) const;
+
+    private:
+        std::map<std::string, std::unique_ptr<MemoTable>, std::less<>> tables;
+};
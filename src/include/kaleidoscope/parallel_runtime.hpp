@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Chunk of a 'parfor' or 'parsum' loop, outlined by the CodegenVisitor:
+// runs iterations [begin, end) and returns the sum of their values.
+// 'captures' holds the variables of the enclosing function.
+using ParallelChunk = double (*)(const double *captures, int64_t begin, int64_t end);
+
+// Most iterations of a parallel loop: the largest double below 2^63, so
+// that the count converts exactly to an int64_t
+constexpr double max_parallel_trips = 9223372036854774784.0;
+
+// Iterations of a loop from 'start' to 'end': ceil(end - start), none if
+// that isn't positive (or is NaN), at most 'max_parallel_trips'. Compiled
+// loops count them the same way.
+inline int64_t parallel_trip_count(double start, double end) {
+    double trips = std::ceil(end - start);
+    if (!(trips > 0.0))
+        return 0;
+    return (int64_t)std::min(trips, max_parallel_trips);
+}
+
+// Called by compiled parallel loops: runs iterations [begin, end) on the
+// pool of 'WorkStealingPool::global()' and returns the sum of their
+// values, added in no particular order. Every KaleidoscopeJIT defines
+// it, objects written by '--emit' must be linked with this library.
+extern "C" double kaleidoscope_parallel_reduce(ParallelChunk chunk, const double *captures, int64_t begin, int64_t end);
+
+// Threads sharing the iterations of a loop. The range is cut into
+// chunks, and each worker starts with a contiguous share of them, which
+// it runs from the front. A worker left without chunks steals the back
+// half of the chunks left to another, so the load evens out without
+// chunks small enough to make their overhead show. Each worker adds up
+// the values of its own chunks, and the partial sums are added up once
+// every chunk has run.
+class WorkStealingPool {
+    public:
+        // Chunks per worker: enough to steal from, few enough for the
+        // calls to the chunk to stay cheap next to the iterations
+        static constexpr unsigned chunks_per_worker = 16;
+
+        // The thread calling 'reduce' is a worker too, so 'num_workers - 1'
+        // threads are started
+        explicit WorkStealingPool(unsigned num_workers);
+        ~WorkStealingPool();
+
+        unsigned size() const { return num_workers; }
+
+        // Runs on the calling thread alone when called from a chunk
+        // (nested loops), or while another thread's loop has the pool
+        double reduce(ParallelChunk chunk, const double *captures, int64_t begin, int64_t end);
+
+        // Pool of 'kaleidoscope_parallel_reduce', started on first use
+        static WorkStealingPool &global();
+        // Number of workers of the global pool, one per hardware thread if
+        // 0. Must not be called while parallel loops are running.
+        static void set_global_size(unsigned num_workers);
+
+    private:
+        struct alignas(64) Worker {
+            // Chunks [front, back) left to the worker, as 'front << 32 |
+            // back', so that both ends change at once
+            std::atomic<uint64_t> range{0};
+            double partial = 0.0;
+        };
+
+        struct Job {
+            ParallelChunk chunk = nullptr;
+            const double *captures = nullptr;
+            int64_t begin = 0, end = 0, chunk_size = 0;
+        };
+
+        const unsigned num_workers;
+        std::unique_ptr<Worker[]> workers;
+        std::vector<std::thread> threads;
+
+        // Held by the thread whose loop runs on the pool
+        std::mutex running_mutex;
+
+        std::mutex job_mutex;
+        std::condition_variable job_started, job_finished;
+        Job job;
+        uint64_t generation = 0;
+        unsigned busy_threads = 0;
+        bool stopping = false;
+
+        void thread_main(unsigned index);
+        // Runs chunks until there are none left to take or steal
+        void work(unsigned index);
+        bool take(Worker &worker, uint32_t &chunk_index);
+        bool steal(unsigned thief);
+};
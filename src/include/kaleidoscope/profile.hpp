@@ -0,0 +1,55 @@
+#pragma once
+
+#include "llvm/IR/Function.h"
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Call counts of the functions of a session (and how often each way of
+// their conditional branches was taken), collected by instrumented
+// code (see 'CodegenVisitor::instrumentation') or read back from a file
+// written by a previous run (e.g. for an ahead-of-time build). They reach
+// the optimizer as function entry counts plus a profile summary, from
+// which passes tell hot code from cold code.
+class Profile {
+    public:
+        // Counter of function 'name', incremented by its instrumented
+        // code. Its address never changes.
+        uint64_t *counter(const std::string &name);
+        // 0 for functions not in the profile
+        uint64_t count(std::string_view name) const;
+        // Also resets the branch counters of the function
+        void reset(std::string_view name);
+
+        // Counters of conditional branch 'index' of function 'name' (in
+        // the order they are emitted): taken when true, then when false
+        uint64_t *branch_counters(std::string_view name, unsigned index);
+        // 'branch_weights' metadata for it, nullptr if it wasn't counted
+        llvm::MDNode *branch_weights(llvm::LLVMContext &context, std::string_view name, unsigned index) const;
+
+        // Marks 'function' hot (and worth inlining) or cold, and gives
+        // definitions their entry count. The module gets the summary of
+        // the whole profile on the first call.
+        void apply(llvm::Function &function, std::string_view name) const;
+
+        // One 'name count' line per function, then one 'name:index true
+        // false' line per branch
+        bool write(const std::string &path) const;
+        // Returns nullptr (after logging) if the file can't be read
+        static std::unique_ptr<Profile> read(const std::string &path);
+
+    private:
+        // Node-based, so counters stay put
+        std::map<std::string, uint64_t, std::less<>> counts;
+        // By 'name:index'
+        std::map<std::string, std::array<uint64_t, 2>, std::less<>> branches;
+
+        static std::string branch_key(std::string_view name, unsigned index);
+
+        void add_summary(llvm::Module &module) const;
+        static uint64_t hot_count_threshold(llvm::Module &module);
+};
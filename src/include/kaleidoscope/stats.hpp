@@ -0,0 +1,108 @@
+#pragma once
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/PassInstrumentation.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "kaleidoscope_jit.hpp"
+
+enum class Phase : uint8_t {
+    lex,
+    parse,
+    codegen,
+    optimize,
+    jit_add,
+    // Native codegen triggered by a lookup, taken out of 'jit_lookup'
+    jit_compile,
+    // Symbol resolution and linking
+    jit_lookup,
+    execute,
+    num_phases,
+};
+
+enum class Counter : uint8_t {
+    tokens,
+    ast_nodes,
+    ir_instructions_before_opt,
+    ir_instructions_after_opt,
+    num_counters,
+};
+
+enum class StatsFormat {
+    none,
+    text,
+    json,
+};
+
+// Where the time of a session goes. Phases nest (e.g. lexing happens
+// while parsing), and each one is only charged its own time, so the
+// phases add up to the total. Not thread-safe: it belongs to the thread
+// driving the Parser and CodegenVisitor.
+class Stats {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        // Also time each optimization pass
+        bool per_pass = false;
+
+        void enter(Phase phase);
+        void leave();
+
+        // Moves up to 'time' from one phase to another, for work that
+        // happened inside 'from' but can only be measured afterwards
+        void move_time(Phase from, Phase to, clock::duration time);
+
+        void add(Counter counter, uint64_t value) {
+            counters[(size_t)counter] += value;
+        }
+
+        uint64_t get(Counter counter) const {
+            return counters[(size_t)counter];
+        }
+
+        // Times every pass run through 'callbacks'
+        void register_pass_callbacks(llvm::PassInstrumentationCallbacks &callbacks);
+
+        // Phases, counters, passes (if timed) and the JIT's own stats,
+        // as a table or as one JSON object per line
+        void print(StatsFormat format, FILE *file, const llvm::orc::KaleidoscopeJITStats &jit_stats) const;
+
+    private:
+        std::array<clock::duration, (size_t)Phase::num_phases> times{};
+        std::array<uint64_t, (size_t)Phase::num_phases> calls{};
+        std::array<uint64_t, (size_t)Counter::num_counters> counters{};
+        std::vector<Phase> open_phases;
+        clock::time_point segment_start;
+
+        struct PassTime {
+            uint64_t runs = 0;
+            clock::duration time{};
+        };
+        llvm::StringMap<PassTime> pass_times;
+        std::vector<clock::time_point> pass_starts;
+};
+
+// Charges the enclosing scope to 'phase'. Does nothing without Stats.
+class ScopedPhase {
+    public:
+        ScopedPhase(Stats *stats, Phase phase) : stats(stats) {
+            if (stats)
+                stats->enter(phase);
+        }
+
+        ~ScopedPhase() {
+            if (stats)
+                stats->leave();
+        }
+
+        ScopedPhase(const ScopedPhase &) = delete;
+        ScopedPhase &operator=(const ScopedPhase &) = delete;
+
+    private:
+        Stats *stats;
+};
@@ -0,0 +1,436 @@
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "include/kaleidoscope/interpreter.hpp"
+#include "include/kaleidoscope/error.hpp"
+#include "include/kaleidoscope/parallel_runtime.hpp"
+
+Interpreter::Interpreter(CodegenVisitor &visitor, uint64_t hotness_threshold) 
+			: hotness_threshold(hotness_threshold), visitor(visitor) {}
+
+bool Interpreter::add_function(std::unique_ptr<FunctionAST> function_node) {
+	const std::string &name = function_node->proto->name;
+	unsigned arity = function_node->proto->args.size();
+	if (function_node->proto->has_vectors()) {
+		log_error("vec4 values are not supported by the interpreter (--tiered).");
+		return false;
+	}
+
+	auto function_it = functions.find(name);
+	bool declared_extern = function_it != functions.end();
+	if (declared_extern) {
+		if (function_it->second.arity != arity) {
+			log_error("Cannot redefine function with different parameter list.");
+			return false;
+		}
+		if (function_it->second.ast) {
+			log_error("Function cannot be redefined.");
+			return false;
+		}
+	} else {
+		function_it = functions.emplace(name, InterpretedFunction{name, arity}).first;
+	}
+
+	// Registered before resolving the body, so recursive calls resolve
+	InterpretedFunction &function = function_it->second;
+	void *extern_native = function.native;
+	function.native = nullptr;
+	function.ast = std::move(function_node);
+	std::optional<unsigned> frame_size = resolve_body(function.ast->body, *function.ast->proto);
+	if (!frame_size) {
+		if (declared_extern) {
+			function.ast.reset();
+			function.native = extern_native;
+		} else {
+			functions.erase(function_it);
+		}
+		return false;
+	}
+
+	function.frame_size = *frame_size;
+
+	// Needed by the CodegenVisitor to declare it once callers get compiled
+	visitor.function_protos[name] = std::make_unique<PrototypeAST>(*function.ast->proto);
+	return true;
+}
+
+bool Interpreter::add_extern(const PrototypeAST &prototype_node) {
+	if (prototype_node.has_vectors()) {
+		log_error("vec4 values are not supported by the interpreter (--tiered).");
+		return false;
+	}
+	auto function_it = functions.find(prototype_node.name);
+	if (function_it != functions.end()) 
+		return function_it->second.arity == prototype_node.args.size();
+
+	functions.emplace(prototype_node.name, InterpretedFunction{prototype_node.name, (unsigned)prototype_node.args.size()});
+	visitor.function_protos[prototype_node.name] = std::make_unique<PrototypeAST>(prototype_node);
+	return true;
+}
+
+bool Interpreter::run_top_level_expr(FunctionAST &function_node, double &result) {
+	std::optional<unsigned> frame_size = resolve_body(function_node.body, *function_node.proto);
+	if (!frame_size)
+		return false;
+
+	llvm::SmallVector<double, 8> frame(*frame_size);
+	result = eval(function_node.body, frame.data());
+	return true;
+}
+
+void Interpreter::print_report() {
+	fprintf(stderr, "Tiered execution (hotness threshold %llu):\n", (unsigned long long)hotness_threshold);
+	for (const auto &[name, function] : functions) {
+		if (!function.ast)
+			continue;
+		fprintf(stderr, "  %s: %llu interpreted, %llu compiled%s\n", name.c_str(), 
+			(unsigned long long)function.interpreted_calls, (unsigned long long)function.compiled_calls,
+			function.native ? "" : " (not promoted)");
+	}
+}
+
+std::optional<unsigned> Interpreter::resolve_body(ExprAST *body, const PrototypeAST &proto) {
+	Scope scope;
+	scope.names.assign(proto.args.begin(), proto.args.end());
+	scope.frame_size = proto.args.size();
+	if (!resolve(body, scope))
+		return std::nullopt;
+	return scope.frame_size;
+}
+
+bool Interpreter::resolve(ExprAST *expr, Scope &scope) {
+	switch (expr->kind) {
+		case ExprKind::number:
+			return true;
+
+		case ExprKind::variable: {
+			// Innermost first, loop variables shadow parameters
+			VariableExprAST *variable_expr = static_cast<VariableExprAST *>(expr);
+			for (unsigned i = scope.names.size(); i-- > 0; ) {
+				if (scope.names[i] == variable_expr->name) {
+					variable_expr->slot = i;
+					return true;
+				}
+			}
+			log_error("Unkown variable name.");
+			return false;
+		}
+
+		case ExprKind::binary: {
+			BinaryExprAST *binary_expr = static_cast<BinaryExprAST *>(expr);
+			return resolve(binary_expr->lhs, scope) && resolve(binary_expr->rhs, scope);
+		}
+
+		case ExprKind::if_expr: {
+			IfExprAST *if_expr = static_cast<IfExprAST *>(expr);
+			return resolve(if_expr->cond, scope) && resolve(if_expr->then_expr, scope) 
+				&& resolve(if_expr->else_expr, scope);
+		}
+
+		case ExprKind::for_expr: {
+			ForExprAST *for_expr = static_cast<ForExprAST *>(expr);
+			if (!resolve(for_expr->start, scope))
+				return false;
+			for_expr->slot = scope.names.size();
+			scope.names.push_back(for_expr->var_name);
+			scope.frame_size = std::max(scope.frame_size, (unsigned)scope.names.size());
+			bool resolved = resolve(for_expr->end, scope) && (!for_expr->step || resolve(for_expr->step, scope)) 
+				&& resolve(for_expr->body, scope);
+			scope.names.pop_back();
+			return resolved;
+		}
+
+		case ExprKind::parallel_for_expr: {
+			// Unlike 'for', the range is evaluated without the variable
+			ParallelForExprAST *parallel_expr = static_cast<ParallelForExprAST *>(expr);
+			if (!resolve(parallel_expr->start, scope) || !resolve(parallel_expr->end, scope))
+				return false;
+			parallel_expr->slot = scope.names.size();
+			scope.names.push_back(parallel_expr->var_name);
+			scope.frame_size = std::max(scope.frame_size, (unsigned)scope.names.size());
+			bool resolved = resolve(parallel_expr->body, scope);
+			scope.names.pop_back();
+			return resolved;
+		}
+
+		case ExprKind::call: {
+			CallExprAST *call_expr = static_cast<CallExprAST *>(expr);
+			if (CodegenVisitor::is_vector_builtin(call_expr->callee)) {
+				log_error("vec4 values are not supported by the interpreter (--tiered).");
+				return false;
+			}
+			auto function_it = functions.find(call_expr->callee);
+			if (function_it == functions.end()) {
+				log_error("Unkown function referenced.");
+				return false;
+			}
+
+			InterpretedFunction &callee = function_it->second;
+			if (callee.arity != call_expr->args.size()) {
+				log_error("Incorrect number of arguments passed to function.");
+				return false;
+			}
+			if (!callee.ast && !resolve_native(callee))
+				return false;
+
+			call_expr->target = &callee;
+			for (ExprAST *arg : call_expr->args) {
+				if (!resolve(arg, scope))
+					return false;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Interpreter::resolve_native(InterpretedFunction &function) {
+	if (function.native)
+		return true;
+
+	if (function.arity > max_native_arity) {
+		log_error("Too many arguments to call an extern from the interpreter.");
+		return false;
+	}
+
+	// Externs come from the host process and cost no compilation
+	llvm::Expected<llvm::orc::ExecutorSymbolDef> symbol = visitor.jit->lookup(function.name);
+	if (!symbol) {
+		llvm::consumeError(symbol.takeError());
+		log_error("Unkown function referenced.");
+		return false;
+	}
+
+	function.native = symbol->toPtr<void *>();
+	return true;
+}
+
+// Same as the 'fcmp one' emitted by CodegenVisitor: NaN is false
+static bool is_true(double value) {
+	return value < 0.0 || value > 0.0;
+}
+
+double Interpreter::eval(ExprAST *expr, double *frame) {
+	switch (expr->kind) {
+		case ExprKind::number:
+			return static_cast<NumberExprAST *>(expr)->val;
+
+		case ExprKind::variable:
+			return frame[static_cast<VariableExprAST *>(expr)->slot];
+
+		case ExprKind::binary: {
+			BinaryExprAST *binary_expr = static_cast<BinaryExprAST *>(expr);
+			double lhs_value = eval(binary_expr->lhs, frame);
+			double rhs_value = eval(binary_expr->rhs, frame);
+
+			// Same semantics as the IR emitted by CodegenVisitor, including
+			// the unordered comparisons (true if either side is NaN)
+			switch (binary_expr->op) {
+				case '+':
+					return lhs_value + rhs_value;
+				case '-':
+					return lhs_value - rhs_value;
+				case '*':
+					return lhs_value * rhs_value;
+				case '/':
+					return lhs_value / rhs_value;
+				case '<':
+					return !(lhs_value >= rhs_value) ? 1.0 : 0.0;
+				case '>':
+					return !(lhs_value <= rhs_value) ? 1.0 : 0.0;
+			}
+			return 0.0;
+		}
+
+		case ExprKind::call: {
+			CallExprAST *call_expr = static_cast<CallExprAST *>(expr);
+			llvm::SmallVector<double, 8> callee_frame;
+			for (ExprAST *arg : call_expr->args)
+				callee_frame.push_back(eval(arg, frame));
+			// Room for the loop variables of the callee
+			if (call_expr->target->frame_size > callee_frame.size())
+				callee_frame.resize(call_expr->target->frame_size);
+			return call(*call_expr->target, callee_frame.data());
+		}
+
+		case ExprKind::if_expr: {
+			IfExprAST *if_expr = static_cast<IfExprAST *>(expr);
+			if (is_true(eval(if_expr->cond, frame)))
+				return eval(if_expr->then_expr, frame);
+			return eval(if_expr->else_expr, frame);
+		}
+
+		case ExprKind::for_expr: {
+			ForExprAST *for_expr = static_cast<ForExprAST *>(expr);
+			double &variable = frame[for_expr->slot];
+			variable = eval(for_expr->start, frame);
+			while (is_true(eval(for_expr->end, frame))) {
+				eval(for_expr->body, frame);
+				variable += for_expr->step ? eval(for_expr->step, frame) : 1.0;
+			}
+			return 0.0;
+		}
+
+		case ExprKind::parallel_for_expr: {
+			// Runs the iterations in order, they run in parallel once the
+			// function is hot enough to be compiled
+			ParallelForExprAST *parallel_expr = static_cast<ParallelForExprAST *>(expr);
+			double start_value = eval(parallel_expr->start, frame);
+			double end_value = eval(parallel_expr->end, frame);
+			double sum = 0.0;
+			for (int64_t i = 0, count = parallel_trip_count(start_value, end_value); i < count; ++i) {
+				frame[parallel_expr->slot] = start_value + (double)i;
+				sum += eval(parallel_expr->body, frame);
+			}
+			return parallel_expr->reduce ? sum : 0.0;
+		}
+	}
+	return 0.0;
+}
+
+double Interpreter::call(InterpretedFunction &function, double *frame) {
+	if (!function.native && function.promotable && function.interpreted_calls >= hotness_threshold)
+		promote(function);
+
+	if (function.native) {
+		++function.compiled_calls;
+		return call_native(function.native, function.arity, frame);
+	}
+
+	++function.interpreted_calls;
+	return eval(function.ast->body, frame);
+}
+
+bool Interpreter::promote(InterpretedFunction &function) {
+	if (function.arity > max_native_arity) {
+		function.promotable = false;
+		return false;
+	}
+
+	// Compiled code can't call back into the interpreter, so every
+	// function reachable from this one is compiled along with it
+	std::vector<InterpretedFunction *> pending;
+	std::set<InterpretedFunction *> seen;
+	collect_uncompiled(function, pending, seen);
+
+	for (InterpretedFunction *pending_function : pending) {
+		if (!pending_function->ast->codegen(visitor)) {
+			function.promotable = false;
+			visitor.reset_module();
+			// The bodies emitted so far went with the module, so they can
+			// be compiled again along with other hot callers
+			for (InterpretedFunction *dropped_function : pending) {
+				visitor.defined_functions.erase(dropped_function->name);
+				visitor.function_protos[dropped_function->name] = std::make_unique<PrototypeAST>(*dropped_function->ast->proto);
+			}
+			return false;
+		}
+	}
+
+	llvm::orc::ThreadSafeModule thread_safe_module = visitor.take_module();
+	llvm::Error err = visitor.jit->addModule(std::move(thread_safe_module));
+	if (err) {
+		fprintf(stderr, "Error: %s\n", llvm::toString(std::move(err)).c_str());
+		function.promotable = false;
+		return false;
+	}
+
+	for (InterpretedFunction *pending_function : pending) {
+		pending_function->compiled = true;
+		if (pending_function->arity > max_native_arity) {
+			pending_function->promotable = false;
+			continue;
+		}
+		llvm::Expected<llvm::orc::ExecutorSymbolDef> symbol = visitor.jit->lookup(pending_function->name);
+		if (!symbol) {
+			fprintf(stderr, "Error: %s\n", llvm::toString(symbol.takeError()).c_str());
+			pending_function->promotable = false;
+			continue;
+		}
+		pending_function->native = symbol->toPtr<void *>();
+	}
+	return function.native != nullptr;
+}
+
+void Interpreter::collect_uncompiled(InterpretedFunction &function, std::vector<InterpretedFunction *> &pending, std::set<InterpretedFunction *> &seen) {
+	if (function.native || function.compiled || !function.ast || !seen.insert(&function).second)
+		return;
+
+	pending.push_back(&function);
+	collect_uncompiled(function.ast->body, pending, seen);
+}
+
+void Interpreter::collect_uncompiled(ExprAST *expr, std::vector<InterpretedFunction *> &pending, std::set<InterpretedFunction *> &seen) {
+	switch (expr->kind) {
+		case ExprKind::number:
+		case ExprKind::variable:
+			return;
+
+		case ExprKind::binary: {
+			BinaryExprAST *binary_expr = static_cast<BinaryExprAST *>(expr);
+			collect_uncompiled(binary_expr->lhs, pending, seen);
+			collect_uncompiled(binary_expr->rhs, pending, seen);
+			return;
+		}
+
+		case ExprKind::if_expr: {
+			IfExprAST *if_expr = static_cast<IfExprAST *>(expr);
+			collect_uncompiled(if_expr->cond, pending, seen);
+			collect_uncompiled(if_expr->then_expr, pending, seen);
+			collect_uncompiled(if_expr->else_expr, pending, seen);
+			return;
+		}
+
+		case ExprKind::for_expr: {
+			ForExprAST *for_expr = static_cast<ForExprAST *>(expr);
+			collect_uncompiled(for_expr->start, pending, seen);
+			collect_uncompiled(for_expr->end, pending, seen);
+			if (for_expr->step)
+				collect_uncompiled(for_expr->step, pending, seen);
+			collect_uncompiled(for_expr->body, pending, seen);
+			return;
+		}
+
+		case ExprKind::parallel_for_expr: {
+			ParallelForExprAST *parallel_expr = static_cast<ParallelForExprAST *>(expr);
+			collect_uncompiled(parallel_expr->start, pending, seen);
+			collect_uncompiled(parallel_expr->end, pending, seen);
+			collect_uncompiled(parallel_expr->body, pending, seen);
+			return;
+		}
+
+		case ExprKind::call: {
+			CallExprAST *call_expr = static_cast<CallExprAST *>(expr);
+			collect_uncompiled(*call_expr->target, pending, seen);
+			for (ExprAST *arg : call_expr->args)
+				collect_uncompiled(arg, pending, seen);
+			return;
+		}
+	}
+}
+
+double Interpreter::call_native(void *native, unsigned arity, const double *args) {
+	using d = double;
+	switch (arity) {
+		case 0:
+			return reinterpret_cast<d (*)()>(native)();
+		case 1:
+			return reinterpret_cast<d (*)(d)>(native)(args[0]);
+		case 2:
+			return reinterpret_cast<d (*)(d, d)>(native)(args[0], args[1]);
+		case 3:
+			return reinterpret_cast<d (*)(d, d, d)>(native)(args[0], args[1], args[2]);
+		case 4:
+			return reinterpret_cast<d (*)(d, d, d, d)>(native)(args[0], args[1], args[2], args[3]);
+		case 5:
+			return reinterpret_cast<d (*)(d, d, d, d, d)>(native)(args[0], args[1], args[2], args[3], args[4]);
+		case 6:
+			return reinterpret_cast<d (*)(d, d, d, d, d, d)>(native)(args[0], args[1], args[2], args[3], args[4], args[5]);
+	}
+	llvm_unreachable("wider functions never get a native entry point");
+}
@@ -4,25 +4,183 @@
 #include "llvm/IR/Value.h"
 #include "llvm/Support/Error.h"
 
+#include <chrono>
 #include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 #include "parser.cpp"
+#include "include/kaleidoscope/aot_emitter.hpp"
 #include "include/kaleidoscope/codegen_visitor.hpp"
+#include "include/kaleidoscope/column_io.hpp"
+#include "include/kaleidoscope/function_library.hpp"
+#include "include/kaleidoscope/interpreter.hpp"
 #include "include/kaleidoscope/kaleidoscope_jit.hpp"
+#include "include/kaleidoscope/profile.hpp"
+#include "include/kaleidoscope/stats.hpp"
 
 class KaleidoscopeConfig {
 	public:
 		llvm::ExitOnError exit_on_err;
 		
 		Parser parser;
-		std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit = std::move(exit_on_err(llvm::orc::KaleidoscopeJIT::Create()));
-		CodegenVisitor visitor = CodegenVisitor(jit);
+		// Null when compiling ahead of time, which only needs the target
+		std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit;
+		llvm::orc::JITTargetMachineBuilder target;
+		CodegenVisitor visitor;
+
+		KaleidoscopeConfig(const llvm::orc::KaleidoscopeJITOptions &jit_options = {}, bool ahead_of_time = false) 
+				: jit(ahead_of_time ? nullptr : exit_on_err(llvm::orc::KaleidoscopeJIT::Create(jit_options))),
+				  target(jit ? jit->getTargetMachineBuilder() : exit_on_err(llvm::orc::KaleidoscopeJIT::detectTarget(jit_options))),
+				  visitor(make_visitor(jit, target)) {}
+
+		// Non-interactive mode: no IR dumps, and every item of the script
+		// is emitted into a single module that is only handed to the JIT
+		// by 'finish_batch()'
+		bool batch_mode = false;
+		// Top-level expressions of the batch, in source order
+		std::vector<std::string> batch_exprs;
+		// Function applied to every row of the input columns by
+		// 'run_map()' once the batch is compiled
+		std::string map_function;
+
+		// Ahead-of-time mode: like batch mode, but the module is written
+		// to disk by 'finish_aot()' instead of being run
+		EmitKind emit_kind = EmitKind::none;
+		unsigned ignored_top_level_exprs = 0;
+
+		// Tiered mode: everything is interpreted until a function gets
+		// hot enough to be compiled by the JIT
+		std::unique_ptr<Interpreter> interpreter;
+
+		// Per-phase times and counters, only collected if enabled
+		std::unique_ptr<Stats> stats;
+
+		void set_optimization(std::optional<llvm::OptimizationLevel> opt_level, bool time_passes) {
+			visitor.opt_level = opt_level;
+			visitor.time_passes = time_passes;
+			visitor.initialize_module_and_managers();
+		}
+
+		// Must come before 'enable_pgo()', re-optimized code keeps them
+		void set_fast_math(llvm::FastMathFlags flags) {
+			visitor.fast_math = flags;
+		}
+
+		// Must come before 'set_optimization()', which sets up the pass
+		// instrumentation
+		void enable_stats(bool per_pass) {
+			stats = std::make_unique<Stats>();
+			stats->per_pass = per_pass;
+			parser.stats = stats.get();
+			visitor.stats = stats.get();
+		}
+
+		// Hot-swap mode: definitions are called through the JIT's stubs,
+		// so that a function can be defined again
+		bool hot_swap = false;
+
+		void enable_hot_swap() {
+			hot_swap = true;
+			visitor.allow_redefinition = true;
+		}
+
+		// Profile-guided mode: functions are first compiled with call
+		// counters, then compiled again through the -O3 pipeline with their
+		// profile once they have been called 'reoptimize_threshold' times.
+		// Implies hot-swap mode, to switch their callers over.
+		std::unique_ptr<Profile> profile;
+		uint64_t reoptimize_threshold = 0;
+
+		// Must come after 'set_optimization()', which only applies to the
+		// instrumented tier. With 'keep_counting' (for a profile written on
+		// exit), re-optimized functions still count their calls, so that
+		// the profile keeps their totals; otherwise they stay counter-free
+		// (and pure, when their body is).
+		void enable_pgo(uint64_t threshold, bool keep_counting) {
+			enable_hot_swap();
+			profile = std::make_unique<Profile>();
+			reoptimize_threshold = threshold;
+			visitor.instrumentation = profile.get();
+
+			reoptimizing_visitor = std::make_unique<CodegenVisitor>(jit);
+			reoptimizing_visitor->opt_level = llvm::OptimizationLevel::O3;
+			reoptimizing_visitor->fast_math = visitor.fast_math;
+			reoptimizing_visitor->stats = stats.get();
+			reoptimizing_visitor->profile = profile.get();
+			if (keep_counting)
+				reoptimizing_visitor->call_counts = profile.get();
+			reoptimizing_visitor->allow_redefinition = true;
+			reoptimizing_visitor->initialize_module_and_managers();
+			reoptimizing_visitor->find_external_proto = [this](std::string_view name) -> std::unique_ptr<PrototypeAST> {
+				auto proto_it = visitor.function_protos.find(name);
+				if (proto_it == visitor.function_protos.end())
+					return nullptr;
+				return std::make_unique<PrototypeAST>(*proto_it->second);
+			};
+		}
+
+		// Counts of a previous run, attached to everything compiled
+		bool use_profile(const std::string &path) {
+			used_profile = Profile::read(path);
+			if (!used_profile)
+				return false;
+			visitor.profile = used_profile.get();
+			return true;
+		}
+
+		// Definitions kept to be inlined into later modules
+		std::unique_ptr<FunctionLibrary> library;
+
+		// Not for hot-swap mode, where callers must not keep a copy of a
+		// function that can be redefined
+		void enable_library(unsigned max_inline_size) {
+			library = std::make_unique<FunctionLibrary>(max_inline_size);
+			visitor.library = library.get();
+		}
+
+		// Pure functions caching their results, reported on exit
+		std::unique_ptr<MemoTables> memo_tables;
+
+		void enable_memoization(const std::vector<std::string> &names) {
+			memo_tables = std::make_unique<MemoTables>(names);
+			visitor.memo_tables = memo_tables.get();
+		}
+
+		void enable_tiered(uint64_t hotness_threshold) {
+			interpreter = std::make_unique<Interpreter>(visitor, hotness_threshold);
+		}
 
 		void handle_definition() {
-			if (std::unique_ptr<FunctionAST> function_node = parser.parse_definition()) {
-				if (llvm::Function *function_ir = function_node->codegen(visitor)) {
+			if (std::unique_ptr<FunctionAST> function_node = in_phase(Phase::parse, [&] { return parser.parse_definition(); })) {
+				if (interpreter) {
+					interpreter->add_function(std::move(function_node));
+					return;
+				}
+
+				if (llvm::Function *function_ir = in_phase(Phase::codegen, [&] { return function_node->codegen(visitor); })) {
+					if (batch_mode || emit_kind != EmitKind::none)
+						return;
+
 					fprintf(stderr, "Read function definition:\n");
 					function_ir->print(llvm::errs());
+
+					if (hot_swap) {
+						add_redefinable_module(visitor);
+						if (profile) {
+							// Counted again from scratch if redefined
+							profile->reset(function_node->proto->name);
+							instrumented_functions[function_node->proto->name] = std::move(function_node);
+						}
+						return;
+					}
+
+					// Definitions live in the JIT for the rest of the session
+					llvm::orc::ThreadSafeModule thread_safe_module = visitor.take_module();
+					exit_on_err(in_phase(Phase::jit_add, [&] { return jit->addModule(std::move(thread_safe_module)); }));
+					if (library)
+						library->add(std::move(function_node));
 				}
 			} else {
 				parser.get_next_token();
@@ -30,10 +188,19 @@ class KaleidoscopeConfig {
 		}
 
 		void handle_extern() {
-			if (std::unique_ptr<PrototypeAST> prototype_node = parser.parse_extern()) {
-				if (llvm::Function *prototype_ir = prototype_node->codegen(visitor)) {
-					fprintf(stderr, "Read extern:\n");
-					prototype_ir->print(llvm::errs());
+			if (std::unique_ptr<PrototypeAST> prototype_node = in_phase(Phase::parse, [&] { return parser.parse_extern(); })) {
+				if (interpreter) {
+					if (!interpreter->add_extern(*prototype_node))
+						log_error("Cannot redefine function with different parameter list.");
+					return;
+				}
+
+				if (llvm::Function *prototype_ir = in_phase(Phase::codegen, [&] { return prototype_node->codegen(visitor); })) {
+					if (!batch_mode && emit_kind == EmitKind::none) {
+						fprintf(stderr, "Read extern:\n");
+						prototype_ir->print(llvm::errs());
+					}
+					visitor.function_protos[prototype_node->name] = std::move(prototype_node);
 				}
 			} else {
 				parser.get_next_token();
@@ -52,8 +219,27 @@ class KaleidoscopeConfig {
 		// }
 
 		void handle_top_level_expr() {
-			if (std::unique_ptr<FunctionAST> function_node = parser.parse_top_level_expr()) {
-				if (llvm::Function *function_ir = function_node->codegen(visitor)) {
+			if (emit_kind != EmitKind::none) {
+				// There is nothing to run them at build time
+				if (in_phase(Phase::parse, [&] { return parser.parse_top_level_expr(); }))
+					++ignored_top_level_exprs;
+				else
+					parser.get_next_token();
+				return;
+			}
+
+			if (interpreter) {
+				handle_interpreted_top_level_expr();
+				return;
+			}
+
+			if (batch_mode) {
+				handle_batch_top_level_expr();
+				return;
+			}
+
+			if (std::unique_ptr<FunctionAST> function_node = in_phase(Phase::parse, [&] { return parser.parse_top_level_expr(); })) {
+				if (llvm::Function *function_ir = in_phase(Phase::codegen, [&] { return function_node->codegen(visitor); })) {
 					// Printing expression's IR
 					fprintf(stderr, "Read top-level expression:\n");
 					function_ir->print(llvm::errs());
@@ -61,23 +247,260 @@ class KaleidoscopeConfig {
 					// Create ResourceTracker for the jit'd memory
 					llvm::orc::ResourceTrackerSP resource_tracker = jit->getMainJITDylib().createResourceTracker();
 
-					llvm::orc::ThreadSafeModule thread_safe_module = llvm::orc::ThreadSafeModule(std::move(visitor.module), std::move(visitor.context));
-					exit_on_err(jit->addModule(std::move(thread_safe_module), resource_tracker));
-					visitor.initialize_module_and_managers();
+					llvm::orc::ThreadSafeModule thread_safe_module = visitor.take_module();
+					exit_on_err(in_phase(Phase::jit_add, [&] { return jit->addModule(std::move(thread_safe_module), resource_tracker); }));
 
 					// Search for the "__anon_expr" symbol in the JIT
-					llvm::orc::ExecutorSymbolDef expr_symbol_def = exit_on_err(jit->lookup("__anon_expr"));
+					llvm::orc::ExecutorSymbolDef expr_symbol_def = lookup_symbol("__anon_expr");
 
 					// Get symbol's address and cast it to the right type,
 					// so we can call it as a native function
 					double (*function_ptr)() = expr_symbol_def.toPtr<double (*)()>();
-					fprintf(stderr, "Evaluated to %f\n", function_ptr());
+					fprintf(stderr, "Evaluated to %f\n", in_phase(Phase::execute, function_ptr));
 
 					// Delete anonymous expression module from the JIT
 					exit_on_err(resource_tracker->remove());
+					visitor.defined_functions.erase("__anon_expr");
+
+					if (profile)
+						reoptimize_hot_functions();
 				}
 			} else {
 				parser.get_next_token();
 			}
 		}
+
+		// Compiles everything gathered in batch mode in one go and runs
+		// the top-level expressions in the order they were read
+		void finish_batch() {
+			if (batch_exprs.empty() && map_function.empty())
+				return;
+
+			// The wrapper goes in the same module, so 'map_function' can
+			// be inlined into its loop
+			if (!map_function.empty() && !visitor.emit_batch_wrapper(map_function))
+				map_function.clear();
+
+			llvm::orc::ThreadSafeModule thread_safe_module = visitor.take_module();
+			exit_on_err(in_phase(Phase::jit_add, [&] { return jit->addModule(std::move(thread_safe_module)); }));
+
+			for (const std::string &expr_name : batch_exprs) {
+				llvm::orc::ExecutorSymbolDef expr_symbol_def = lookup_symbol(expr_name);
+				double (*function_ptr)() = expr_symbol_def.toPtr<double (*)()>();
+				fprintf(stderr, "Evaluated to %f\n", in_phase(Phase::execute, function_ptr));
+			}
+			batch_exprs.clear();
+		}
+
+		// Streams the columns in 'input_paths' through 'map_function' a
+		// chunk at a time, writing the results to 'output_path' (stdout if
+		// empty). With 'scalar_baseline', also times one call per row of
+		// the scalar function, for comparison.
+		bool run_map(const std::vector<std::string> &input_paths, const std::string &output_path, bool scalar_baseline) {
+			static constexpr size_t chunk_rows = 64 * 1024;
+
+			if (map_function.empty())
+				return false;
+			const PrototypeAST &map_proto = *visitor.function_protos.at(map_function);
+			if (map_proto.has_vectors()) {
+				fprintf(stderr, "Error: --map only supports functions of numbers.\n");
+				return false;
+			}
+			unsigned arity = map_proto.args.size();
+			if (arity > max_map_arity) {
+				fprintf(stderr, "Error: --map supports functions of up to %u parameters.\n", max_map_arity);
+				return false;
+			}
+
+			std::unique_ptr<ColumnSource> source = ColumnSource::open(input_paths, arity);
+			std::unique_ptr<ColumnSink> sink = ColumnSink::open(output_path);
+			if (!source || !sink)
+				return false;
+
+			void *batch_ptr = lookup_symbol(map_function + "_batch").toPtr<void *>();
+			void *scalar_ptr = lookup_symbol(map_function).toPtr<void *>();
+
+			std::vector<std::vector<double>> columns(arity, std::vector<double>(chunk_rows));
+			std::vector<double> results(chunk_rows);
+			std::chrono::steady_clock::duration batch_time{}, scalar_time{};
+			uint64_t total_rows = 0;
+
+			while (size_t rows = source->read(columns, chunk_rows)) {
+				auto start = std::chrono::steady_clock::now();
+				in_phase(Phase::execute, [&] { call_batch(batch_ptr, arity, columns, results.data(), rows); });
+				batch_time += std::chrono::steady_clock::now() - start;
+
+				if (scalar_baseline) {
+					start = std::chrono::steady_clock::now();
+					call_scalar_rows(scalar_ptr, arity, columns, results.data(), rows);
+					scalar_time += std::chrono::steady_clock::now() - start;
+				}
+
+				if (!sink->write(results.data(), rows)) {
+					fprintf(stderr, "Error: could not write the results of --map.\n");
+					return false;
+				}
+				total_rows += rows;
+			}
+			if (source->failed)
+				return false;
+
+			report_map_rate("batch", total_rows, batch_time);
+			if (scalar_baseline)
+				report_map_rate("scalar", total_rows, scalar_time);
+			return true;
+		}
+
+		// Writes every definition read so far to 'output_path', plus a C
+		// header next to it for the native formats
+		bool finish_aot(const std::string &output_path) {
+			if (ignored_top_level_exprs > 0)
+				fprintf(stderr, "Warning: %u top-level expression(s) ignored when compiling ahead of time.\n", ignored_top_level_exprs);
+
+			visitor.optimize_module();
+
+			AotEmitter emitter(target);
+			if (!emitter.emit(*visitor.module, emit_kind, output_path))
+				return false;
+
+			if (emit_kind == EmitKind::ll)
+				return true;
+
+			llvm::SmallString<128> header_path(output_path);
+			llvm::sys::path::replace_extension(header_path, ".h");
+			return emitter.emit_header(*visitor.module, std::string(header_path));
+		}
+
+	private:
+		static constexpr unsigned max_map_arity = 6;
+
+		static CodegenVisitor make_visitor(std::shared_ptr<llvm::orc::KaleidoscopeJIT> jit, const llvm::orc::JITTargetMachineBuilder &target) {
+			if (jit)
+				return CodegenVisitor(jit);
+			return CodegenVisitor(target);
+		}
+
+		// Runs 'body' charging its time to 'phase'
+		template <typename Body>
+		std::invoke_result_t<Body &> in_phase(Phase phase, Body &&body) {
+			ScopedPhase scoped_phase(stats.get(), phase);
+			return body();
+		}
+
+		// Symbol lookup, charging the native codegen it triggers to the
+		// 'jit_compile' phase
+		llvm::orc::ExecutorSymbolDef lookup_symbol(llvm::StringRef name) {
+			uint64_t compile_nanos = stats ? jit->getStats().CompileNanos : 0;
+			llvm::orc::ExecutorSymbolDef symbol = exit_on_err(in_phase(Phase::jit_lookup, [&] { return jit->lookup(name); }));
+			if (stats) {
+				std::chrono::nanoseconds compile_time(jit->getStats().CompileNanos - compile_nanos);
+				stats->move_time(Phase::jit_lookup, Phase::jit_compile, compile_time);
+			}
+			return symbol;
+		}
+
+		// Profile-guided mode: emits the functions to re-optimize
+		std::unique_ptr<CodegenVisitor> reoptimizing_visitor;
+		// Instrumented definitions, until they get hot enough
+		std::map<std::string, std::unique_ptr<FunctionAST>, std::less<>> instrumented_functions;
+		// Read by 'use_profile()'
+		std::unique_ptr<Profile> used_profile;
+
+		// Compiles the current module of 'from' and swaps its functions in.
+		// Nothing JIT'd runs while the REPL reads input, so the modules
+		// holding the bodies replaced can be removed right away.
+		void add_redefinable_module(CodegenVisitor &from) {
+			llvm::orc::ResourceTrackerSP resource_tracker = jit->getMainJITDylib().createResourceTracker();
+			llvm::orc::ThreadSafeModule thread_safe_module = from.take_module(true);
+
+			uint64_t compile_nanos = stats ? jit->getStats().CompileNanos : 0;
+			llvm::orc::RedefinedBodies bodies = exit_on_err(in_phase(Phase::jit_add, [&] {
+				return jit->addRedefinableModule(std::move(thread_safe_module), resource_tracker);
+			}));
+			if (stats) {
+				std::chrono::nanoseconds compile_time(jit->getStats().CompileNanos - compile_nanos);
+				stats->move_time(Phase::jit_add, Phase::jit_compile, compile_time);
+			}
+
+			std::vector<llvm::orc::ResourceTrackerSP> retired;
+			exit_on_err(jit->publishRedefinitions(bodies, retired));
+			for (llvm::orc::ResourceTrackerSP &retired_tracker : retired)
+				exit_on_err(retired_tracker->remove());
+		}
+
+		// Compiles the instrumented functions called at least
+		// 'reoptimize_threshold' times again, together, without branch
+		// counters (nor call counters, unless kept by 'enable_pgo()')
+		void reoptimize_hot_functions() {
+			unsigned reoptimized = 0;
+			for (auto function_it = instrumented_functions.begin(); function_it != instrumented_functions.end(); ) {
+				uint64_t calls = profile->count(function_it->first);
+				if (calls < reoptimize_threshold) {
+					++function_it;
+					continue;
+				}
+				if (in_phase(Phase::codegen, [&] { return function_it->second->codegen(*reoptimizing_visitor); })) {
+					fprintf(stderr, "Re-optimizing '%s' after %llu calls\n", function_it->first.c_str(), (unsigned long long)calls);
+					++reoptimized;
+				}
+				function_it = instrumented_functions.erase(function_it);
+			}
+			if (reoptimized > 0)
+				add_redefinable_module(*reoptimizing_visitor);
+		}
+
+		static void call_batch(void *ptr, unsigned arity, std::vector<std::vector<double>> &c, double *out, size_t n) {
+			using D = const double *;
+			switch (arity) {
+				case 0: return ((void (*)(double *, size_t))ptr)(out, n);
+				case 1: return ((void (*)(D, double *, size_t))ptr)(c[0].data(), out, n);
+				case 2: return ((void (*)(D, D, double *, size_t))ptr)(c[0].data(), c[1].data(), out, n);
+				case 3: return ((void (*)(D, D, D, double *, size_t))ptr)(c[0].data(), c[1].data(), c[2].data(), out, n);
+				case 4: return ((void (*)(D, D, D, D, double *, size_t))ptr)(c[0].data(), c[1].data(), c[2].data(), c[3].data(), out, n);
+				case 5: return ((void (*)(D, D, D, D, D, double *, size_t))ptr)(c[0].data(), c[1].data(), c[2].data(), c[3].data(), c[4].data(), out, n);
+				case 6: return ((void (*)(D, D, D, D, D, D, double *, size_t))ptr)(c[0].data(), c[1].data(), c[2].data(), c[3].data(), c[4].data(), c[5].data(), out, n);
+			}
+		}
+
+		static void call_scalar_rows(void *ptr, unsigned arity, std::vector<std::vector<double>> &c, double *out, size_t n) {
+			using d = double;
+			for (size_t i = 0; i < n; ++i) {
+				switch (arity) {
+					case 0: out[i] = ((d (*)())ptr)(); break;
+					case 1: out[i] = ((d (*)(d))ptr)(c[0][i]); break;
+					case 2: out[i] = ((d (*)(d, d))ptr)(c[0][i], c[1][i]); break;
+					case 3: out[i] = ((d (*)(d, d, d))ptr)(c[0][i], c[1][i], c[2][i]); break;
+					case 4: out[i] = ((d (*)(d, d, d, d))ptr)(c[0][i], c[1][i], c[2][i], c[3][i]); break;
+					case 5: out[i] = ((d (*)(d, d, d, d, d))ptr)(c[0][i], c[1][i], c[2][i], c[3][i], c[4][i]); break;
+					case 6: out[i] = ((d (*)(d, d, d, d, d, d))ptr)(c[0][i], c[1][i], c[2][i], c[3][i], c[4][i], c[5][i]); break;
+				}
+			}
+		}
+
+		static void report_map_rate(const char *kind, uint64_t rows, std::chrono::steady_clock::duration time) {
+			double seconds = std::chrono::duration<double>(time).count();
+			fprintf(stderr, "Mapped %llu rows (%s) in %.3f ms, %.1f Mrows/s\n", 
+				(unsigned long long)rows, kind, seconds * 1e3, seconds > 0 ? rows / seconds / 1e6 : 0.0);
+		}
+
+		void handle_interpreted_top_level_expr() {
+			if (std::unique_ptr<FunctionAST> function_node = in_phase(Phase::parse, [&] { return parser.parse_top_level_expr(); })) {
+				double result;
+				if (in_phase(Phase::execute, [&] { return interpreter->run_top_level_expr(*function_node, result); }))
+					fprintf(stderr, "Evaluated to %f\n", result);
+			} else {
+				parser.get_next_token();
+			}
+		}
+
+		void handle_batch_top_level_expr() {
+			if (std::unique_ptr<FunctionAST> function_node = in_phase(Phase::parse, [&] { return parser.parse_top_level_expr(); })) {
+				// Expressions share the module, so each one needs its own symbol
+				function_node->proto->name = "__anon_expr." + std::to_string(batch_exprs.size());
+				if (in_phase(Phase::codegen, [&] { return function_node->codegen(visitor); }))
+					batch_exprs.push_back(function_node->proto->name);
+			} else {
+				parser.get_next_token();
+			}
+		}
 };
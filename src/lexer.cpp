@@ -1,6 +1,10 @@
 #include <cctype>
+#include <charconv>
 #include <cstdio>
-#include <string>
+#include <memory>
+#include <string_view>
+
+#include "source_input.cpp"
 
 enum token {
 	tok_eof = -1,
@@ -12,60 +16,112 @@ enum token {
 	// primary
 	tok_identifier = -4,
 	tok_number = -5,
+
+	// control flow
+	tok_if = -6,
+	tok_then = -7,
+	tok_else = -8,
+	tok_for = -9,
+	tok_in = -10,
+
+	// parallel loops
+	tok_parfor = -11,
+	tok_parsum = -12,
 };
 
 class Lexer {
 	public: 
-		std::string identifier_str;
+		// Slice of the input buffer, only valid until the next 'gettok()'
+		std::string_view identifier_str;
 		double num_val;
-		int last_char = ' ';
+
+		Lexer() : input(std::make_unique<StreamSourceInput>()) {}
+
+		Lexer(std::unique_ptr<SourceInput> input) : input(std::move(input)) {}
+
+		void set_input(std::unique_ptr<SourceInput> new_input) {
+			input = std::move(new_input);
+		}
 
 		int gettok() {
+			const char *mark;
+			int curr_char;
 
-			while (isspace(last_char)) {
-				last_char = getchar();
+			while (true) {
+				mark = input->cur;
+				curr_char = peek(mark);
+				if (!isspace(curr_char))
+					break;
+				++input->cur;
 			}
 
-			if (isalpha(last_char)) {
-				identifier_str = last_char;
-				while (isalnum((last_char = getchar()))) {
-					identifier_str += last_char;
-				}
+			if (isalpha(curr_char)) {
+				do {
+					++input->cur;
+				} while (isalnum(peek(mark)));
+				identifier_str = std::string_view(mark, input->cur - mark);
 
 				if (identifier_str == "def") 
 					return token::tok_def;
 				if (identifier_str == "extern")
 					return token::tok_extern;
+				if (identifier_str == "if")
+					return token::tok_if;
+				if (identifier_str == "then")
+					return token::tok_then;
+				if (identifier_str == "else")
+					return token::tok_else;
+				if (identifier_str == "for")
+					return token::tok_for;
+				if (identifier_str == "in")
+					return token::tok_in;
+				if (identifier_str == "parfor")
+					return token::tok_parfor;
+				if (identifier_str == "parsum")
+					return token::tok_parsum;
 				return token::tok_identifier;
 			}
 
-			if (isdigit(last_char) || last_char == '.') {
-				std::string num_str;
-				bool has_decimal_point = (last_char == '.') ? true : false;
+			if (isdigit(curr_char) || curr_char == '.') {
+				bool has_decimal_point = (curr_char == '.') ? true : false;
 				do {
-					num_str += last_char;
-					last_char = getchar();
-				} while (isdigit(last_char) || (!has_decimal_point && last_char == '.'));
+					++input->cur;
+					curr_char = peek(mark);
+				} while (isdigit(curr_char) || (!has_decimal_point && curr_char == '.'));
 
-				num_val = strtod(num_str.c_str(), 0);
+				// Same result as strtod() on the token, which yields 0 for a lone '.'
+				if (std::from_chars(mark, input->cur, num_val).ec != std::errc())
+					num_val = 0.0;
 				return token::tok_number;
 			}
 
-			if (last_char == '#') {
+			if (curr_char == '#') {
 				do {
-					last_char = getchar();
-				} while (last_char != EOF && last_char != '\n' && last_char != '\r');
+					++input->cur;
+					mark = input->cur;
+					curr_char = peek(mark);
+				} while (curr_char != EOF && curr_char != '\n' && curr_char != '\r');
 
-				if (last_char != EOF) 
+				if (curr_char != EOF) 
 					return gettok();
 			}
 
-			if (last_char == EOF) 
+			if (curr_char == EOF) 
 				return token::tok_eof;
 
 			// returning character as its ascii value
-			int ascii_char = last_char;
-			last_char = getchar();
-			return ascii_char;
+			++input->cur;
+			return curr_char;
+		}
+
+	private:
+		std::unique_ptr<SourceInput> input;
+
+		// Current character without consuming it, refilling the input
+		// (and relocating 'mark') when the buffered window is exhausted
+		int peek(const char *&mark) {
+			if (input->cur == input->end && !input->refill(mark))
+				return EOF;
+			return static_cast<unsigned char>(*input->cur);
 		}
 };
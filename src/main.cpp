@@ -1,18 +1,363 @@
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Path.h"
+
 #include "kaleidoscope_config.cpp"
 
+static llvm::cl::opt<std::string> input_filename(
+	llvm::cl::Positional, 
+	llvm::cl::desc("[script file]"), 
+	llvm::cl::init("")
+);
+
+static llvm::cl::opt<bool> batch(
+	"batch", 
+	llvm::cl::desc("Compile the whole script as one module and run it without prompts or IR dumps")
+);
+
+static llvm::cl::opt<bool> lazy(
+	"lazy", 
+	llvm::cl::desc("Compile each function on its first call instead of when it is defined")
+);
+
+static llvm::cl::opt<unsigned> jit_threads(
+	"jit-threads", 
+	llvm::cl::desc("Number of threads compiling JIT'd code in parallel (0 compiles on the REPL thread)"),
+	llvm::cl::init(0)
+);
+
+static llvm::cl::opt<std::string> object_cache_dir(
+	"object-cache-dir", 
+	llvm::cl::desc("Reuse native code compiled by previous runs, cached in <dir>"),
+	llvm::cl::value_desc("dir"),
+	llvm::cl::init("")
+);
+
+static llvm::cl::opt<unsigned> jit_slab_size(
+	"jit-slab-size", 
+	llvm::cl::desc("Size in KiB of the slabs JIT'd code is allocated from, recycled across modules (0 maps memory per module)"),
+	llvm::cl::value_desc("KiB"),
+	llvm::cl::init(1024)
+);
+
+static llvm::cl::opt<EmitKind> emit(
+	"emit", 
+	llvm::cl::desc("Compile the script's definitions ahead of time instead of running it"),
+	llvm::cl::values(
+		clEnumValN(EmitKind::obj, "obj", "Native object file and C header"),
+		clEnumValN(EmitKind::asm_file, "asm", "Native assembly and C header"),
+		clEnumValN(EmitKind::ll, "ll", "Optimized LLVM IR"),
+		clEnumValN(EmitKind::lib, "lib", "Static library and C header")
+	),
+	llvm::cl::init(EmitKind::none)
+);
+
+static llvm::cl::opt<std::string> output_filename(
+	"o", 
+	llvm::cl::desc("Output file for --emit (defaults to the script name)"),
+	llvm::cl::value_desc("file"),
+	llvm::cl::init("")
+);
+
+static llvm::cl::opt<bool> tiered(
+	"tiered", 
+	llvm::cl::desc("Interpret code and only JIT functions once they get hot")
+);
+
+static llvm::cl::opt<unsigned long long> tier_threshold(
+	"tier-threshold", 
+	llvm::cl::desc("Interpreted calls after which a function is compiled in --tiered mode"),
+	llvm::cl::init(1000)
+);
+
+static llvm::cl::opt<bool> hot_swap(
+	"hot-swap", 
+	llvm::cl::desc("Allow functions to be redefined, their callers switching to the new body through indirection stubs")
+);
+
+static llvm::cl::opt<bool> pgo(
+	"pgo", 
+	llvm::cl::desc("Count the calls of every function, and compile hot ones again with -O3 and their profile")
+);
+
+static llvm::cl::opt<unsigned long long> pgo_threshold(
+	"pgo-threshold", 
+	llvm::cl::desc("Calls after which a function is re-optimized in --pgo mode"),
+	llvm::cl::init(10000)
+);
+
+static llvm::cl::opt<std::string> pgo_output(
+	"pgo-output", 
+	llvm::cl::desc("Write the call counts collected by --pgo to <file> on exit (hot functions keep counting their calls)"),
+	llvm::cl::value_desc("file"),
+	llvm::cl::init("")
+);
+
+static llvm::cl::opt<std::string> pgo_use(
+	"pgo-use", 
+	llvm::cl::desc("Optimize with the call counts in <file>, written by --pgo-output (e.g. for --emit)"),
+	llvm::cl::value_desc("file"),
+	llvm::cl::init("")
+);
+
+static llvm::cl::opt<unsigned> inline_size(
+	"cross-module-inline-size", 
+	llvm::cl::desc("Largest function (in AST nodes) copied into later modules to be inlined by -O1 to -O3 (0 disables)"),
+	llvm::cl::init(40)
+);
+
+static llvm::cl::list<std::string> memoize(
+	"memoize", 
+	llvm::cl::CommaSeparated,
+	llvm::cl::desc("Cache the results of these pure functions, keyed on their arguments"),
+	llvm::cl::value_desc("function,...")
+);
+
+static llvm::cl::opt<unsigned> parallel_workers(
+	"parallel-workers", 
+	llvm::cl::desc("Number of threads running 'parfor' and 'parsum' loops (0 uses one per hardware thread)"),
+	llvm::cl::init(0)
+);
+
+static llvm::cl::opt<char> opt_level(
+	"O", 
+	llvm::cl::desc("Optimize whole modules with the default pipeline of level -O0, -O1, -O2 or -O3"),
+	llvm::cl::Prefix,
+	llvm::cl::init(' ')
+);
+
+static llvm::cl::opt<bool> fast_math(
+	"fast-math", 
+	llvm::cl::desc("Allow every transformation of --fast-math-flags in definitions not marked 'strict'")
+);
+
+enum class FastMathFlag {
+	contract,
+	reassoc,
+	nnan,
+	ninf,
+	nsz,
+	arcp,
+	afn,
+};
+
+static llvm::cl::bits<FastMathFlag> fast_math_flags(
+	"fast-math-flags", 
+	llvm::cl::CommaSeparated,
+	llvm::cl::desc("Allow some floating-point transformations in definitions not marked 'strict':"),
+	llvm::cl::values(
+		clEnumValN(FastMathFlag::contract, "contract", "Fuse multiplications and additions (FMA)"),
+		clEnumValN(FastMathFlag::reassoc, "reassoc", "Reassociate operations"),
+		clEnumValN(FastMathFlag::nnan, "nnan", "Assume no NaNs"),
+		clEnumValN(FastMathFlag::ninf, "ninf", "Assume no infinities"),
+		clEnumValN(FastMathFlag::nsz, "nsz", "Ignore the sign of zeros"),
+		clEnumValN(FastMathFlag::arcp, "arcp", "Multiply by reciprocals instead of dividing"),
+		clEnumValN(FastMathFlag::afn, "afn", "Approximate math functions")
+	)
+);
+
+static llvm::cl::opt<bool> pass_timing(
+	"pass-timing", 
+	llvm::cl::desc("Print the time spent in each pass of the module pipeline, per module")
+);
+
+static llvm::cl::opt<bool> portable(
+	"portable", 
+	llvm::cl::desc("Generate code for the baseline CPU of the target instead of the host CPU")
+);
+
+static llvm::cl::opt<std::string> mcpu(
+	"mcpu", 
+	llvm::cl::desc("Target a specific CPU (e.g. skylake-avx512)"),
+	llvm::cl::value_desc("cpu-name"),
+	llvm::cl::init("")
+);
+
+static llvm::cl::list<std::string> mattrs(
+	"mattr", 
+	llvm::cl::CommaSeparated,
+	llvm::cl::desc("Enable (+) or disable (-) target features (e.g. +avx2,-fma)"),
+	llvm::cl::value_desc("a1,+a2,-a3,...")
+);
+
+static llvm::cl::opt<std::string> map_function(
+	"map", 
+	llvm::cl::desc("Run the script in batch mode, then apply <function> to every row of --map-input"),
+	llvm::cl::value_desc("function"),
+	llvm::cl::init("")
+);
+
+static llvm::cl::list<std::string> map_inputs(
+	"map-input", 
+	llvm::cl::CommaSeparated,
+	llvm::cl::desc("A CSV file with one column per parameter, or one file of raw doubles per parameter"),
+	llvm::cl::value_desc("file,...")
+);
+
+static llvm::cl::opt<std::string> map_output(
+	"map-output", 
+	llvm::cl::desc("Results of --map, as CSV if <file> ends in '.csv' and raw doubles otherwise (defaults to stdout)"),
+	llvm::cl::value_desc("file"),
+	llvm::cl::init("")
+);
+
+static llvm::cl::opt<bool> map_scalar_baseline(
+	"map-scalar-baseline", 
+	llvm::cl::desc("Also time one call per row of the scalar function, for comparison with --map")
+);
+
+static llvm::cl::opt<StatsFormat> stats_format(
+	"phase-stats", 
+	llvm::cl::desc("Print the time spent in each compilation phase and other counters on exit"),
+	llvm::cl::ValueOptional,
+	llvm::cl::values(
+		clEnumValN(StatsFormat::text, "", "Human-readable summary"),
+		clEnumValN(StatsFormat::text, "text", "Human-readable summary"),
+		clEnumValN(StatsFormat::json, "json", "One JSON object per line")
+	),
+	llvm::cl::init(StatsFormat::none)
+);
+
+static llvm::cl::opt<bool> stats_passes(
+	"phase-stats-passes", 
+	llvm::cl::desc("Include the time spent in each optimization pass in --phase-stats")
+);
+
+static llvm::cl::opt<std::string> stats_file(
+	"phase-stats-file", 
+	llvm::cl::desc("Write --phase-stats to <file> instead of stderr"),
+	llvm::cl::value_desc("file"),
+	llvm::cl::init("")
+);
+
 int main(int argc, char* argv[]) {
+	llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
 
 	llvm::InitializeNativeTarget();
 	llvm::InitializeNativeTargetAsmPrinter();
 	llvm::InitializeNativeTargetAsmParser();
 
-	KaleidoscopeConfig kconfig;
-	fprintf(stderr, "ready> ");
+	llvm::orc::KaleidoscopeJITOptions jit_options;
+	jit_options.Lazy = lazy;
+	jit_options.CompileThreads = jit_threads;
+	jit_options.ObjectCacheDir = object_cache_dir;
+	jit_options.MemorySlabSize = (size_t)jit_slab_size * 1024;
+	jit_options.Portable = portable;
+	jit_options.CPU = mcpu;
+	jit_options.Features = llvm::join(mattrs, ",");
+
+	// Nothing runs when compiling ahead of time, so there is no JIT
+	KaleidoscopeConfig kconfig(jit_options, emit != EmitKind::none);
+	std::optional<llvm::OptimizationLevel> pipeline_level;
+	switch (opt_level) {
+		case ' ':
+			// The batch loop is only worth it once inlined and vectorized
+			if (!map_function.empty())
+				pipeline_level = llvm::OptimizationLevel::O3;
+			break;
+		case '0':
+			pipeline_level = llvm::OptimizationLevel::O0;
+			break;
+		case '1':
+			pipeline_level = llvm::OptimizationLevel::O1;
+			break;
+		case '2':
+			pipeline_level = llvm::OptimizationLevel::O2;
+			break;
+		case '3':
+			pipeline_level = llvm::OptimizationLevel::O3;
+			break;
+		default:
+			fprintf(stderr, "Error: invalid optimization level -O%c.\n", opt_level.getValue());
+			return 1;
+	}
+	if (pass_timing && !pipeline_level) {
+		fprintf(stderr, "Error: --pass-timing needs an optimization level (-O0 to -O3).\n");
+		return 1;
+	}
+	if (stats_passes && stats_format == StatsFormat::none)
+		stats_format = StatsFormat::text;
+	if (stats_format != StatsFormat::none)
+		kconfig.enable_stats(stats_passes);
+	kconfig.set_optimization(pipeline_level, pass_timing);
+
+	llvm::FastMathFlags session_fast_math;
+	if (fast_math) {
+		session_fast_math.setFast();
+	} else {
+		session_fast_math.setAllowContract(fast_math_flags.isSet(FastMathFlag::contract));
+		session_fast_math.setAllowReassoc(fast_math_flags.isSet(FastMathFlag::reassoc));
+		session_fast_math.setNoNaNs(fast_math_flags.isSet(FastMathFlag::nnan));
+		session_fast_math.setNoInfs(fast_math_flags.isSet(FastMathFlag::ninf));
+		session_fast_math.setNoSignedZeros(fast_math_flags.isSet(FastMathFlag::nsz));
+		session_fast_math.setAllowReciprocal(fast_math_flags.isSet(FastMathFlag::arcp));
+		session_fast_math.setApproxFunc(fast_math_flags.isSet(FastMathFlag::afn));
+	}
+	kconfig.set_fast_math(session_fast_math);
+
+	bool mapping = !map_function.empty() && emit == EmitKind::none;
+	if (mapping && map_inputs.empty()) {
+		fprintf(stderr, "Error: --map needs at least one --map-input.\n");
+		return 1;
+	}
+
+	kconfig.batch_mode = batch || mapping;
+	kconfig.emit_kind = emit;
+	if (mapping)
+		kconfig.map_function = map_function;
+	else if (tiered && emit == EmitKind::none)
+		kconfig.enable_tiered(tier_threshold);
+	bool interactive = !kconfig.batch_mode && emit == EmitKind::none;
+	if (hot_swap) {
+		if (!interactive || tiered) {
+			fprintf(stderr, "Error: --hot-swap can't be used with --batch, --map, --emit or --tiered.\n");
+			return 1;
+		}
+		kconfig.enable_hot_swap();
+	}
+	if (pgo) {
+		if (!interactive || tiered) {
+			fprintf(stderr, "Error: --pgo can't be used with --batch, --map, --emit or --tiered.\n");
+			return 1;
+		}
+		kconfig.enable_pgo(pgo_threshold, !pgo_output.empty());
+	} else if (!pgo_output.empty()) {
+		fprintf(stderr, "Error: --pgo-output needs --pgo.\n");
+		return 1;
+	}
+	if (interactive && !hot_swap && !pgo && inline_size > 0)
+		kconfig.enable_library(inline_size);
+	if (!pgo_use.empty() && !kconfig.use_profile(pgo_use))
+		return 1;
+	if (!memoize.empty()) {
+		// The tables live in this process, and would keep the results of
+		// the callees of a memoized function after they are redefined
+		if (emit != EmitKind::none || hot_swap || pgo) {
+			fprintf(stderr, "Error: --memoize can't be used with --emit, --hot-swap or --pgo.\n");
+			return 1;
+		}
+		kconfig.enable_memoization(memoize);
+	}
+	WorkStealingPool::set_global_size(parallel_workers.getValue());
+
+	// Scripts given on the command line are mapped instead of streamed
+	if (!input_filename.empty()) {
+		std::unique_ptr<MappedFileSourceInput> file_input = MappedFileSourceInput::open(input_filename.c_str());
+		if (!file_input) {
+			fprintf(stderr, "Error: could not open '%s'.\n", input_filename.c_str());
+			return 1;
+		}
+		kconfig.parser.lexer.set_input(std::move(file_input));
+	}
+
+	if (interactive)
+		fprintf(stderr, "ready> ");
 	kconfig.parser.get_next_token();
 
 	int eof = 0;
 	while (!eof) {
-		fprintf(stderr, "ready> ");
+		if (interactive)
+			fprintf(stderr, "ready> ");
 		switch (kconfig.parser.curr_tok) {
 			case tok_def: 
 				kconfig.handle_definition();
@@ -32,5 +377,49 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
+	if (emit != EmitKind::none) {
+		std::string output_path = output_filename;
+		if (output_path.empty()) {
+			llvm::SmallString<128> default_path(input_filename.empty() ? std::string("a.ks") : input_filename.getValue());
+			llvm::sys::path::replace_extension(default_path, AotEmitter::file_extension(emit));
+			if (emit == EmitKind::lib) {
+				llvm::SmallString<128> lib_path(llvm::sys::path::parent_path(default_path));
+				llvm::sys::path::append(lib_path, "lib" + llvm::sys::path::filename(default_path));
+				default_path = lib_path;
+			}
+			output_path = std::string(default_path);
+		}
+		if (!kconfig.finish_aot(output_path))
+			return 1;
+	} else if (kconfig.batch_mode) {
+		kconfig.finish_batch();
+		if (mapping && !kconfig.run_map(map_inputs, map_output, map_scalar_baseline))
+			return 1;
+	}
+
+	if (kconfig.interpreter)
+		kconfig.interpreter->print_report();
+	if (kconfig.memo_tables)
+		kconfig.memo_tables->print_report(stderr);
+
+	if (!pgo_output.empty() && !kconfig.profile->write(pgo_output))
+		return 1;
+
+	if (kconfig.stats) {
+		FILE *file = stats_file.empty() ? stderr : fopen(stats_file.c_str(), "w");
+		if (!file) {
+			fprintf(stderr, "Error: could not open '%s'.\n", stats_file.c_str());
+			return 1;
+		}
+		kconfig.stats->print(stats_format, file, kconfig.jit ? kconfig.jit->getStats() : llvm::orc::KaleidoscopeJITStats());
+		if (file != stderr)
+			fclose(file);
+	}
+
+	if (const llvm::orc::KaleidoscopeObjectCache *object_cache = kconfig.jit ? kconfig.jit->getObjectCache() : nullptr) {
+		fprintf(stderr, "Object cache: %llu hits, %llu misses\n", 
+			(unsigned long long)object_cache->getHits(), (unsigned long long)object_cache->getMisses());
+	}
+
 	return 0;
 }
@@ -0,0 +1,39 @@
+#include <algorithm>
+
+#include "include/kaleidoscope/memo_table.hpp"
+
+MemoTables::MemoTables(const std::vector<std::string> &names) {
+	for (const std::string &name : names)
+		tables[name] = nullptr;
+}
+
+bool MemoTables::requested(std::string_view name) const {
+	return tables.find(name) != tables.end();
+}
+
+MemoTable *MemoTables::table_for(std::string_view name, unsigned arity) {
+	auto table_it = tables.find(name);
+	if (table_it == tables.end())
+		return nullptr;
+	std::unique_ptr<MemoTable> &table = table_it->second;
+	// Redefinitions keep the parameter list, and code compiled before may
+	// still point to the table: only its entries are dropped
+	if (table && table->entry_words == arity + 2)
+		std::fill(table->entries.begin(), table->entries.end(), 0);
+	else
+		table = std::make_unique<MemoTable>(arity);
+	return table.get();
+}
+
+void MemoTables::print_report(FILE *file) const {
+	fprintf(file, "Memoization (%u entries per function):\n", 1u << MemoTable::log2_entries);
+	for (const auto &[name, table] : tables) {
+		if (!table) {
+			fprintf(file, "  %s: not memoized\n", name.c_str());
+			continue;
+		}
+		uint64_t calls = table->hits + table->misses;
+		fprintf(file, "  %s: %llu calls, %llu hits (%.1f%%)\n", name.c_str(), (unsigned long long)calls,
+			(unsigned long long)table->hits, calls ? 100.0 * table->hits / calls : 0.0);
+	}
+}
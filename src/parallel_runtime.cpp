@@ -0,0 +1,149 @@
+#include <algorithm>
+
+#include "include/kaleidoscope/parallel_runtime.hpp"
+
+// Set on the threads of the pools, and on a thread while its loop runs
+static thread_local bool in_parallel_loop = false;
+
+static uint64_t pack_range(uint32_t front, uint32_t back) {
+	return (uint64_t)front << 32 | back;
+}
+
+extern "C" double kaleidoscope_parallel_reduce(ParallelChunk chunk, const double *captures, int64_t begin, int64_t end) {
+	return WorkStealingPool::global().reduce(chunk, captures, begin, end);
+}
+
+WorkStealingPool::WorkStealingPool(unsigned num_workers)
+			: num_workers(std::max(num_workers, 1u)), workers(std::make_unique<Worker[]>(this->num_workers)) {
+	for (unsigned i = 1; i < this->num_workers; ++i)
+		threads.emplace_back(&WorkStealingPool::thread_main, this, i);
+}
+
+WorkStealingPool::~WorkStealingPool() {
+	{
+		std::lock_guard<std::mutex> lock(job_mutex);
+		stopping = true;
+	}
+	job_started.notify_all();
+	for (std::thread &thread : threads)
+		thread.join();
+}
+
+double WorkStealingPool::reduce(ParallelChunk chunk, const double *captures, int64_t begin, int64_t end) {
+	if (begin >= end)
+		return 0.0;
+	int64_t count = end - begin;
+	if (num_workers == 1 || count == 1 || in_parallel_loop || !running_mutex.try_lock())
+		return chunk(captures, begin, end);
+	std::lock_guard<std::mutex> running(running_mutex, std::adopt_lock);
+
+	// Chunks of equal size, the last one aside
+	int64_t num_chunks = std::min<int64_t>(count, (int64_t)num_workers * chunks_per_worker);
+	int64_t chunk_size = (count + num_chunks - 1) / num_chunks;
+	num_chunks = (count + chunk_size - 1) / chunk_size;
+	for (unsigned i = 0; i < num_workers; ++i)
+		workers[i].range.store(pack_range(num_chunks * i / num_workers, num_chunks * (i + 1) / num_workers), std::memory_order_relaxed);
+
+	{
+		std::lock_guard<std::mutex> lock(job_mutex);
+		job = Job{chunk, captures, begin, end, chunk_size};
+		++generation;
+		busy_threads = num_workers - 1;
+	}
+	job_started.notify_all();
+
+	in_parallel_loop = true;
+	work(0);
+	in_parallel_loop = false;
+	{
+		std::unique_lock<std::mutex> lock(job_mutex);
+		job_finished.wait(lock, [this] { return busy_threads == 0; });
+	}
+
+	double sum = 0.0;
+	for (unsigned i = 0; i < num_workers; ++i)
+		sum += workers[i].partial;
+	return sum;
+}
+
+void WorkStealingPool::thread_main(unsigned index) {
+	in_parallel_loop = true;
+	uint64_t last_generation = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(job_mutex);
+			job_started.wait(lock, [&] { return stopping || generation != last_generation; });
+			if (stopping)
+				return;
+			last_generation = generation;
+		}
+
+		work(index);
+
+		std::lock_guard<std::mutex> lock(job_mutex);
+		if (--busy_threads == 0)
+			job_finished.notify_one();
+	}
+}
+
+void WorkStealingPool::work(unsigned index) {
+	double partial = 0.0;
+	uint32_t chunk_index;
+	do {
+		while (take(workers[index], chunk_index)) {
+			int64_t chunk_begin = job.begin + chunk_index * job.chunk_size;
+			partial += job.chunk(job.captures, chunk_begin, std::min(job.end, chunk_begin + job.chunk_size));
+		}
+	} while (steal(index));
+	workers[index].partial = partial;
+}
+
+bool WorkStealingPool::take(Worker &worker, uint32_t &chunk_index) {
+	uint64_t range = worker.range.load(std::memory_order_acquire);
+	while (true) {
+		uint32_t front = range >> 32, back = (uint32_t)range;
+		if (front >= back)
+			return false;
+		if (worker.range.compare_exchange_weak(range, pack_range(front + 1, back), std::memory_order_acq_rel)) {
+			chunk_index = front;
+			return true;
+		}
+	}
+}
+
+bool WorkStealingPool::steal(unsigned thief) {
+	for (unsigned offset = 1; offset < num_workers; ++offset) {
+		Worker &victim = workers[(thief + offset) % num_workers];
+		uint64_t range = victim.range.load(std::memory_order_acquire);
+		while (true) {
+			uint32_t front = range >> 32, back = (uint32_t)range;
+			if (front >= back)
+				break;
+			// The back half, or the last chunk
+			uint32_t middle = front + (back - front) / 2;
+			if (victim.range.compare_exchange_weak(range, pack_range(front, middle), std::memory_order_acq_rel)) {
+				// Nobody steals from an empty range, so nothing changed it since
+				workers[thief].range.store(pack_range(middle, back), std::memory_order_release);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static std::mutex global_mutex;
+static std::unique_ptr<WorkStealingPool> global_pool;
+static unsigned global_size = 0;
+
+WorkStealingPool &WorkStealingPool::global() {
+	std::lock_guard<std::mutex> lock(global_mutex);
+	if (!global_pool)
+		global_pool = std::make_unique<WorkStealingPool>(global_size ? global_size : std::thread::hardware_concurrency());
+	return *global_pool;
+}
+
+void WorkStealingPool::set_global_size(unsigned num_workers) {
+	std::lock_guard<std::mutex> lock(global_mutex);
+	global_size = num_workers;
+	global_pool.reset();
+}
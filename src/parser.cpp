@@ -5,44 +5,78 @@
 #include "lexer.cpp"
 #include "include/kaleidoscope/ast.hpp"
 #include "include/kaleidoscope/error.hpp"
+#include "include/kaleidoscope/stats.hpp"
 
 class Parser {
 	public:
 		int curr_tok;
 		Lexer lexer;
+		// Token and node counts, lexing time
+		Stats *stats = nullptr;
 
 		std::unique_ptr<FunctionAST> parse_definition() {
+			arena.reset();
 			get_next_token();
-			std::unique_ptr<PrototypeAST> prototype = parse_prototype();
+			std::unique_ptr<PrototypeAST> prototype;
+			if (curr_tok == tok_identifier && (lexer.identifier_str == "strict" || lexer.identifier_str == "fast")) {
+				// A mode, unless followed by the parameter list, as in
+				// 'def fast(x)'
+				std::string word(lexer.identifier_str);
+				get_next_token();
+				if (curr_tok == '(') {
+					prototype = parse_parameters(word);
+				} else {
+					prototype = parse_prototype();
+					if (prototype)
+						prototype->float_mode = word == "strict" ? FloatMode::strict : FloatMode::fast;
+				}
+			} else {
+				prototype = parse_prototype();
+			}
 			if (!prototype) 
 				return nullptr;
 
-			std::unique_ptr<ExprAST> expr = parse_expression();
+			ExprAST *expr = parse_expression();
 			if (expr)
-				return std::make_unique<FunctionAST>(std::move(prototype), std::move(expr));
+				return std::make_unique<FunctionAST>(std::move(prototype), expr, std::move(arena));
 			
 			return nullptr;
 		}
 
 		std::unique_ptr<PrototypeAST> parse_extern() {
 			get_next_token();
-			return parse_prototype();
+			std::unique_ptr<PrototypeAST> prototype = parse_prototype();
+			if (prototype && CodegenVisitor::is_pure_library_function(prototype->name))
+				prototype->pure = prototype->always_returns = true;
+			return prototype;
 		}
 
 		std::unique_ptr<FunctionAST> parse_top_level_expr() {
-			std::unique_ptr<ExprAST> expr = parse_expression();
+			arena.reset();
+			ExprAST *expr = parse_expression();
 			if (expr) {
 				auto prototype = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
-				return std::make_unique<FunctionAST>(std::move(prototype), std::move(expr));
+				return std::make_unique<FunctionAST>(std::move(prototype), expr, std::move(arena));
 			}
 			return nullptr;
 		}
 
 		int get_next_token() {
+			if (!stats)
+				return curr_tok = lexer.gettok();
+
+			ScopedPhase phase(stats, Phase::lex);
+			stats->add(Counter::tokens, 1);
 			return curr_tok = lexer.gettok();
 		}
 
 	private:
+		// Nodes of the item being parsed, handed over to its FunctionAST
+		Arena arena;
+		// Arguments of the calls being parsed, copied into the arena
+		// once each argument list is complete
+		std::vector<ExprAST *> call_args;
+
 		const std::unordered_map<char, int> m_binary_op_precedence = {
 			{'<', 10},
 			{'>', 10},
@@ -54,36 +88,76 @@ class Parser {
 			{'/', 40},
 		};
 
+		template <typename T, typename... Args>
+		T *create_node(Args &&...args) {
+			if (stats)
+				stats->add(Counter::ast_nodes, 1);
+			return arena.create<T>(std::forward<Args>(args)...);
+		}
+
 		std::unique_ptr<PrototypeAST> parse_prototype() {
 			if (curr_tok != tok_identifier) 
 				return log_error_proto("Expected function name in prototype.");
 
-			std::string func_name = lexer.identifier_str;
+			std::string func_name(lexer.identifier_str);
+			if (CodegenVisitor::is_vector_builtin(func_name))
+				return log_error_proto("Cannot redefine builtin function.");
 			get_next_token();
+			return parse_parameters(func_name);
+		}
 
+		// Rest of a prototype, once its name has been read
+		std::unique_ptr<PrototypeAST> parse_parameters(const std::string &func_name) {
 			if (curr_tok != '(')
 				return log_error_proto("Expected '(' in prototype.");
 
 			std::vector<std::string> arg_names;
-			while (get_next_token() == tok_identifier) 
-				arg_names.push_back(lexer.identifier_str);
+			std::vector<ValueType> arg_types;
+			get_next_token();
+			while (curr_tok == tok_identifier) {
+				arg_names.emplace_back(lexer.identifier_str);
+				arg_types.push_back(ValueType::number);
+				if (get_next_token() == ':') {
+					get_next_token();
+					if (!parse_type(arg_types.back()))
+						return nullptr;
+				}
+			}
 			if (curr_tok != ')')
 				return log_error_proto("Expected ')' in prototype.");
 
 			get_next_token();
 			
-			return std::make_unique<PrototypeAST>(func_name, std::move(arg_names));
+			auto prototype = std::make_unique<PrototypeAST>(func_name, std::move(arg_names));
+			prototype->arg_types = std::move(arg_types);
+			if (curr_tok == ':') {
+				get_next_token();
+				if (!parse_type(prototype->return_type))
+					return nullptr;
+			}
+			return prototype;
+		}
+
+		// 'number' or 'vec4', after a ':' in a prototype
+		bool parse_type(ValueType &type) {
+			if (curr_tok != tok_identifier || (lexer.identifier_str != "number" && lexer.identifier_str != "vec4")) {
+				log_error_proto("Expected 'number' or 'vec4' after ':'.");
+				return false;
+			}
+			type = lexer.identifier_str == "vec4" ? ValueType::vec4 : ValueType::number;
+			get_next_token();
+			return true;
 		}
 
-		std::unique_ptr<ExprAST> parse_expression() {
-			std::unique_ptr<ExprAST> lhs = parse_primary();
+		ExprAST *parse_expression() {
+			ExprAST *lhs = parse_primary();
 			if (!lhs) 
 				return nullptr;
 
-			return parse_bin_op_rhs(0, std::move(lhs));
+			return parse_bin_op_rhs(0, lhs);
 		}
 
-		std::unique_ptr<ExprAST>  parse_primary() {
+		ExprAST *parse_primary() {
 			switch (curr_tok) {
 				case token::tok_identifier:
 					return parse_identifier_expr();
@@ -91,12 +165,19 @@ class Parser {
 					return parse_number_expr();
 				case '(':
 					return parse_paren_expr();
+				case token::tok_if:
+					return parse_if_expr();
+				case token::tok_for:
+					return parse_for_expr();
+				case token::tok_parfor:
+				case token::tok_parsum:
+					return parse_parallel_for_expr();
 				default:
 					return log_error("Unkown token when expecting an expression");
 			}
 		}
 
-		std::unique_ptr<ExprAST> parse_bin_op_rhs(int expr_prec, std::unique_ptr<ExprAST> lhs) {
+		ExprAST *parse_bin_op_rhs(int expr_prec, ExprAST *lhs) {
 			while (true) {
 				int tok_prec = get_tok_precedence();
 
@@ -105,30 +186,30 @@ class Parser {
 
 				int bin_op = curr_tok;
 				get_next_token();
-				std::unique_ptr<ExprAST> rhs = parse_primary();
+				ExprAST *rhs = parse_primary();
 				if (!rhs)
 					return nullptr;
 
 				int next_prec = get_tok_precedence();
 				if (next_prec > tok_prec) {
-					rhs = parse_bin_op_rhs(tok_prec+1, std::move(rhs));
+					rhs = parse_bin_op_rhs(tok_prec+1, rhs);
 					if (!rhs)
 						return nullptr;
 				}
 
-				lhs = std::make_unique<BinaryExprAST>(bin_op, std::move(lhs), std::move(rhs));
+				lhs = create_node<BinaryExprAST>(bin_op, lhs, rhs);
 			}
 		}
 
-		std::unique_ptr<ExprAST> parse_number_expr() {
-			std::unique_ptr<NumberExprAST> result = std::make_unique<NumberExprAST>(lexer.num_val);
+		ExprAST *parse_number_expr() {
+			NumberExprAST *result = create_node<NumberExprAST>(lexer.num_val);
 			get_next_token();
-			return std::move(result);
+			return result;
 		}
 
-		std::unique_ptr<ExprAST> parse_paren_expr() {
+		ExprAST *parse_paren_expr() {
 			get_next_token();
-			std::unique_ptr<ExprAST> v = parse_expression();
+			ExprAST *v = parse_expression();
 
 			if (!v) return nullptr;
 			if (curr_tok != ')') return log_error("expected ')'");
@@ -137,34 +218,137 @@ class Parser {
 			return v;
 		}
 
-		std::unique_ptr<ExprAST> parse_identifier_expr() {
-			std::string id_name = lexer.identifier_str;
+		ExprAST *parse_if_expr() {
+			get_next_token();
+			ExprAST *cond = parse_expression();
+			if (!cond)
+				return nullptr;
+
+			if (curr_tok != tok_then)
+				return log_error("Expected 'then'.");
+			get_next_token();
+			ExprAST *then_expr = parse_expression();
+			if (!then_expr)
+				return nullptr;
+
+			if (curr_tok != tok_else)
+				return log_error("Expected 'else'.");
+			get_next_token();
+			ExprAST *else_expr = parse_expression();
+			if (!else_expr)
+				return nullptr;
+
+			return create_node<IfExprAST>(cond, then_expr, else_expr);
+		}
+
+		ExprAST *parse_for_expr() {
+			get_next_token();
+			if (curr_tok != tok_identifier)
+				return log_error("Expected identifier after 'for'.");
+			std::string_view var_name = arena.copy_string(lexer.identifier_str);
+
+			get_next_token();
+			if (curr_tok != '=')
+				return log_error("Expected '=' after 'for' variable.");
+			get_next_token();
+			ExprAST *start = parse_expression();
+			if (!start)
+				return nullptr;
+
+			if (curr_tok != ',')
+				return log_error("Expected ',' after 'for' start value.");
+			get_next_token();
+			ExprAST *end = parse_expression();
+			if (!end)
+				return nullptr;
+
+			ExprAST *step = nullptr;
+			if (curr_tok == ',') {
+				get_next_token();
+				step = parse_expression();
+				if (!step)
+					return nullptr;
+			}
+
+			if (curr_tok != tok_in)
+				return log_error("Expected 'in' after 'for'.");
+			get_next_token();
+			ExprAST *body = parse_expression();
+			if (!body)
+				return nullptr;
+
+			return create_node<ForExprAST>(var_name, start, end, step, body);
+		}
+
+		ExprAST *parse_parallel_for_expr() {
+			bool reduce = curr_tok == tok_parsum;
+			get_next_token();
+			if (curr_tok != tok_identifier)
+				return log_error("Expected identifier after 'parfor' or 'parsum'.");
+			std::string_view var_name = arena.copy_string(lexer.identifier_str);
+
+			get_next_token();
+			if (curr_tok != '=')
+				return log_error("Expected '=' after parallel loop variable.");
+			get_next_token();
+			ExprAST *start = parse_expression();
+			if (!start)
+				return nullptr;
+
+			if (curr_tok != ',')
+				return log_error("Expected ',' after parallel loop start value.");
+			get_next_token();
+			ExprAST *end = parse_expression();
+			if (!end)
+				return nullptr;
+
+			if (curr_tok != tok_in)
+				return log_error("Expected 'in' after parallel loop range.");
+			get_next_token();
+			ExprAST *body = parse_expression();
+			if (!body)
+				return nullptr;
+
+			return create_node<ParallelForExprAST>(var_name, start, end, body, reduce);
+		}
+
+		ExprAST *parse_identifier_expr() {
+			std::string_view id_name = arena.copy_string(lexer.identifier_str);
 
 			get_next_token();
 
 			if (curr_tok != '(') 
-				return std::make_unique<VariableExprAST>(id_name);
+				return create_node<VariableExprAST>(id_name);
 
 			get_next_token();
-			std::vector<std::unique_ptr<ExprAST>> args;
+			size_t args_begin = call_args.size();
 			if (curr_tok != ')') {
 				while (true) {
-					std::unique_ptr<ExprAST> arg = parse_expression();
+					ExprAST *arg = parse_expression();
 					if (arg) {
-						args.push_back(std::move(arg));
+						call_args.push_back(arg);
 					} else {
+						call_args.resize(args_begin);
 						return nullptr;
 					}
 
 					if (curr_tok == ')') break;
 
-					if (curr_tok != ',') return log_error("Expected ')' or ',' in argument list.");
+					if (curr_tok != ',') {
+						call_args.resize(args_begin);
+						return log_error("Expected ')' or ',' in argument list.");
+					}
 					get_next_token();
 				}
 			}
 
+			std::span<ExprAST *> args = arena.copy_array<ExprAST *>(
+				std::span<ExprAST *const>(call_args).subspan(args_begin)
+			);
+			call_args.resize(args_begin);
+
 			get_next_token();
-			return std::make_unique<CallExprAST>(id_name, std::move(args));
+			return create_node<CallExprAST>(id_name, args);
 		}
 
 		int get_tok_precedence() {
@@ -0,0 +1,167 @@
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ProfileSummary.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "include/kaleidoscope/profile.hpp"
+
+// Fraction of all calls (out of 'ProfileSummary::Scale') made to the
+// functions considered hot, as in LLVM's '-profile-summary-cutoff-hot'
+static constexpr uint32_t hot_cutoff = 990000;
+
+uint64_t *Profile::counter(const std::string &name) {
+	return &counts[name];
+}
+
+uint64_t Profile::count(std::string_view name) const {
+	auto count_it = counts.find(name);
+	return count_it == counts.end() ? 0 : count_it->second;
+}
+
+void Profile::reset(std::string_view name) {
+	auto count_it = counts.find(name);
+	if (count_it != counts.end())
+		count_it->second = 0;
+
+	std::string prefix = std::string(name) + ":";
+	for (auto branch_it = branches.lower_bound(prefix); branch_it != branches.end() && branch_it->first.starts_with(prefix); ++branch_it)
+		branch_it->second = {0, 0};
+}
+
+std::string Profile::branch_key(std::string_view name, unsigned index) {
+	return std::string(name) + ":" + std::to_string(index);
+}
+
+uint64_t *Profile::branch_counters(std::string_view name, unsigned index) {
+	return branches[branch_key(name, index)].data();
+}
+
+llvm::MDNode *Profile::branch_weights(llvm::LLVMContext &context, std::string_view name, unsigned index) const {
+	auto branch_it = branches.find(branch_key(name, index));
+	if (branch_it == branches.end())
+		return nullptr;
+	auto [taken, not_taken] = branch_it->second;
+	if (taken == 0 && not_taken == 0)
+		return nullptr;
+
+	// Weights are 32 bit
+	uint64_t scale = std::max(taken, not_taken) / UINT32_MAX + 1;
+	return llvm::MDBuilder(context).createBranchWeights((uint32_t)(taken / scale), (uint32_t)(not_taken / scale));
+}
+
+void Profile::apply(llvm::Function &function, std::string_view name) const {
+	auto count_it = counts.find(name);
+	if (count_it == counts.end())
+		return;
+	llvm::Module &module = *function.getParent();
+	if (!module.getProfileSummary(false))
+		add_summary(module);
+
+	uint64_t count = count_it->second;
+	if (count == 0) {
+		function.addFnAttr(llvm::Attribute::Cold);
+	} else if (count >= hot_count_threshold(module)) {
+		function.addFnAttr(llvm::Attribute::Hot);
+		if (!function.isDeclaration())
+			function.addFnAttr(llvm::Attribute::InlineHint);
+	}
+	// Declarations can't carry profile metadata
+	if (!function.isDeclaration())
+		function.setEntryCount(count);
+}
+
+bool Profile::write(const std::string &path) const {
+	FILE *file = fopen(path.c_str(), "w");
+	if (!file) {
+		fprintf(stderr, "Error: could not open '%s'.\n", path.c_str());
+		return false;
+	}
+	fprintf(file, "# Kaleidoscope profile: calls per function, then true/false counts per branch\n");
+	for (const auto &[name, count] : counts)
+		fprintf(file, "%s %llu\n", name.c_str(), (unsigned long long)count);
+	for (const auto &[key, branch_counts] : branches)
+		fprintf(file, "%s %llu %llu\n", key.c_str(), (unsigned long long)branch_counts[0], (unsigned long long)branch_counts[1]);
+	if (fclose(file) != 0) {
+		fprintf(stderr, "Error: could not write '%s'.\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+std::unique_ptr<Profile> Profile::read(const std::string &path) {
+	llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(path, /*IsText=*/true);
+	if (!buffer) {
+		fprintf(stderr, "Error: could not open '%s'.\n", path.c_str());
+		return nullptr;
+	}
+
+	auto profile = std::make_unique<Profile>();
+	for (llvm::line_iterator line(**buffer, /*SkipBlanks=*/true, '#'); !line.is_at_eof(); ++line) {
+		llvm::SmallVector<llvm::StringRef, 3> fields;
+		line->trim().split(fields, ' ', -1, /*KeepEmpty=*/false);
+		uint64_t count, false_count = 0;
+		bool is_branch = fields.size() == 3 && fields[0].contains(':');
+		if ((fields.size() != 2 && !is_branch) || fields[1].getAsInteger(10, count)
+				|| (is_branch && fields[2].getAsInteger(10, false_count))) {
+			fprintf(stderr, "Error: malformed line %lld in profile '%s'.\n", (long long)line.line_number(), path.c_str());
+			return nullptr;
+		}
+		if (is_branch)
+			profile->branches[fields[0].str()] = {count, false_count};
+		else
+			profile->counts[fields[0].str()] = count;
+	}
+	return profile;
+}
+
+void Profile::add_summary(llvm::Module &module) const {
+	std::vector<uint64_t> sorted_counts;
+	uint64_t total = 0;
+	for (const auto &[name, count] : counts) {
+		sorted_counts.push_back(count);
+		total += count;
+	}
+	if (total == 0)
+		return;
+	std::sort(sorted_counts.begin(), sorted_counts.end(), std::greater<>());
+
+	// For each cutoff (the same as LLVM's ProfileSummaryBuilder), the
+	// smallest count among the hottest functions making up that fraction
+	// of all calls
+	static const uint32_t cutoffs[] = {
+		10000, 100000, 200000, 300000, 400000, 500000, 600000, 700000, 800000,
+		900000, 950000, 990000, 999000, 999900, 999990, 999999,
+	};
+	llvm::SummaryEntryVector detailed_summary;
+	size_t num_counts = 0;
+	uint64_t covered = 0;
+	for (uint32_t cutoff : cutoffs) {
+		uint64_t target = (uint64_t)std::ceil((double)total * cutoff / llvm::ProfileSummary::Scale);
+		while (covered < target)
+			covered += sorted_counts[num_counts++];
+		detailed_summary.emplace_back(cutoff, sorted_counts[num_counts - 1], num_counts);
+	}
+
+	uint64_t max_count = sorted_counts.front();
+	llvm::ProfileSummary summary(llvm::ProfileSummary::PSK_Instr, detailed_summary, total,
+		max_count, 0, max_count, sorted_counts.size(), sorted_counts.size());
+	module.setProfileSummary(summary.getMD(module.getContext()), llvm::ProfileSummary::PSK_Instr);
+}
+
+uint64_t Profile::hot_count_threshold(llvm::Module &module) {
+	llvm::Metadata *summary_metadata = module.getProfileSummary(false);
+	if (!summary_metadata)
+		return UINT64_MAX;
+	std::unique_ptr<llvm::ProfileSummary> summary(llvm::ProfileSummary::getFromMD(summary_metadata));
+	for (const llvm::ProfileSummaryEntry &entry : summary->getDetailedSummary())
+		if (entry.Cutoff >= hot_cutoff)
+			return entry.MinCount;
+	return UINT64_MAX;
+}
@@ -0,0 +1,139 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Contiguous window of source text handed to the Lexer. Tokens are
+// 'std::string_view' slices of [cur, end), so they stay valid until
+// the next call to 'refill()'.
+class SourceInput {
+	public:
+		const char *cur = nullptr;
+		const char *end = nullptr;
+
+		virtual ~SourceInput() = default;
+
+		// Called once [cur, end) is exhausted. Bytes from 'mark' up to
+		// 'end' belong to a token still being scanned and must survive
+		// the refill, so implementations that reuse their buffer move
+		// them to its front and update 'mark' accordingly.
+		// Returns false at end of input.
+		virtual bool refill(const char *&mark) {
+			return false;
+		}
+};
+
+// Source already in memory (e.g. a script embedded by a host program).
+// Owns a copy only when constructed from a 'std::string' rvalue.
+class StringSourceInput : public SourceInput {
+	public:
+		StringSourceInput(std::string_view text) {
+			cur = text.data();
+			end = text.data() + text.size();
+		}
+
+		StringSourceInput(std::string &&text) : owned(std::move(text)) {
+			cur = owned.data();
+			end = owned.data() + owned.size();
+		}
+
+	private:
+		std::string owned;
+};
+
+// Regular file mapped read-only into memory. The whole script is a
+// single window, so the Lexer never needs to refill.
+class MappedFileSourceInput : public SourceInput {
+	public:
+		~MappedFileSourceInput() override {
+			if (mapping)
+				munmap(mapping, length);
+		}
+
+		// Returns nullptr if 'path' cannot be opened or mapped
+		static std::unique_ptr<MappedFileSourceInput> open(const char *path) {
+			int fd = ::open(path, O_RDONLY);
+			if (fd < 0)
+				return nullptr;
+
+			struct stat st;
+			if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+				close(fd);
+				return nullptr;
+			}
+
+			std::unique_ptr<MappedFileSourceInput> input(new MappedFileSourceInput());
+			input->length = st.st_size;
+			// mmap() rejects zero-length mappings, empty files are just EOF
+			if (input->length > 0) {
+				void *addr = mmap(nullptr, input->length, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (addr == MAP_FAILED) {
+					close(fd);
+					return nullptr;
+				}
+				madvise(addr, input->length, MADV_SEQUENTIAL);
+				input->mapping = addr;
+				input->cur = static_cast<const char *>(addr);
+				input->end = input->cur + input->length;
+			}
+			close(fd);
+
+			return input;
+		}
+
+	private:
+		void *mapping = nullptr;
+		size_t length = 0;
+
+		MappedFileSourceInput() = default;
+};
+
+// Pipes, terminals and anything else that can only be read sequentially.
+// Reads are done in large chunks straight into an owned buffer. On a
+// terminal read() returns after each line, so the REPL stays interactive.
+class StreamSourceInput : public SourceInput {
+	public:
+		static constexpr size_t chunk_size = 64 * 1024;
+
+		StreamSourceInput(int fd = STDIN_FILENO) : fd(fd), buffer(chunk_size) {
+			cur = end = buffer.data();
+		}
+
+		bool refill(const char *&mark) override {
+			if (eof)
+				return false;
+
+			// Keep the partially scanned token, dropping everything before it
+			size_t kept = end - mark;
+			if (kept > 0 && mark != buffer.data())
+				std::memmove(buffer.data(), mark, kept);
+			if (buffer.size() - kept < chunk_size)
+				buffer.resize(kept + chunk_size);
+
+			ssize_t n;
+			do {
+				n = read(fd, buffer.data() + kept, buffer.size() - kept);
+			} while (n < 0 && errno == EINTR);
+
+			mark = buffer.data();
+			cur = buffer.data() + kept;
+			end = cur + (n > 0 ? n : 0);
+			if (n <= 0)
+				eof = true;
+
+			return n > 0;
+		}
+
+	private:
+		int fd;
+		bool eof = false;
+		std::vector<char> buffer;
+};
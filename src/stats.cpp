@@ -0,0 +1,151 @@
+#include "llvm/ADT/Any.h"
+#include "llvm/IR/PassManager.h"
+
+#include <algorithm>
+
+#include "include/kaleidoscope/stats.hpp"
+
+static const char *phase_names[] = {
+	"lex", 
+	"parse", 
+	"codegen", 
+	"optimize", 
+	"jit_add", 
+	"jit_compile", 
+	"jit_lookup", 
+	"execute",
+};
+static_assert(std::size(phase_names) == (size_t)Phase::num_phases);
+
+static const char *counter_names[] = {
+	"tokens", 
+	"ast_nodes", 
+	"ir_instructions_before_opt", 
+	"ir_instructions_after_opt",
+};
+static_assert(std::size(counter_names) == (size_t)Counter::num_counters);
+
+void Stats::enter(Phase phase) {
+	clock::time_point now = clock::now();
+	if (!open_phases.empty())
+		times[(size_t)open_phases.back()] += now - segment_start;
+	open_phases.push_back(phase);
+	++calls[(size_t)phase];
+	segment_start = now;
+}
+
+void Stats::leave() {
+	clock::time_point now = clock::now();
+	times[(size_t)open_phases.back()] += now - segment_start;
+	open_phases.pop_back();
+	segment_start = now;
+}
+
+void Stats::move_time(Phase from, Phase to, clock::duration time) {
+	time = std::min(time, times[(size_t)from]);
+	if (time.count() <= 0)
+		return;
+	times[(size_t)from] -= time;
+	times[(size_t)to] += time;
+	++calls[(size_t)to];
+}
+
+void Stats::register_pass_callbacks(llvm::PassInstrumentationCallbacks &callbacks) {
+	// Pass managers and adaptors only run other passes, which are timed
+	// on their own
+	auto is_container = [](llvm::StringRef pass_id) {
+		return pass_id.contains("PassManager") || pass_id.contains("PassAdaptor") || 
+			pass_id.contains("AnalysisManagerProxy") || pass_id.contains("DevirtSCCRepeatedPass") ||
+			pass_id.contains("ModuleInlinerWrapperPass");
+	};
+
+	callbacks.registerBeforeNonSkippedPassCallback([this, is_container](llvm::StringRef pass_id, llvm::Any) {
+		if (!is_container(pass_id))
+			pass_starts.push_back(clock::now());
+	});
+	auto after_pass = [this, is_container](llvm::StringRef pass_id) {
+		if (is_container(pass_id) || pass_starts.empty())
+			return;
+		PassTime &pass_time = pass_times[pass_id];
+		++pass_time.runs;
+		pass_time.time += clock::now() - pass_starts.back();
+		pass_starts.pop_back();
+	};
+	callbacks.registerAfterPassCallback([after_pass](llvm::StringRef pass_id, llvm::Any, const llvm::PreservedAnalyses &) {
+		after_pass(pass_id);
+	});
+	callbacks.registerAfterPassInvalidatedCallback([after_pass](llvm::StringRef pass_id, const llvm::PreservedAnalyses &) {
+		after_pass(pass_id);
+	});
+}
+
+void Stats::print(StatsFormat format, FILE *file, const llvm::orc::KaleidoscopeJITStats &jit_stats) const {
+	auto seconds = [](clock::duration time) {
+		return std::chrono::duration<double>(time).count();
+	};
+	struct NamedValue {
+		const char *name;
+		uint64_t value;
+	};
+	NamedValue jit_counters[] = {
+		{"jit_modules_compiled", jit_stats.ModulesCompiled},
+		{"jit_object_bytes", jit_stats.ObjectBytes},
+		{"jit_memory_in_use_bytes", jit_stats.MemoryInUse},
+		{"jit_memory_peak_bytes", jit_stats.PeakMemoryInUse},
+		{"jit_memory_reserved_bytes", jit_stats.MemoryReserved},
+		{"jit_memory_syscalls", jit_stats.MemorySyscalls},
+		{"jit_symbol_cache_hits", jit_stats.SymbolCacheHits},
+		{"jit_symbol_cache_misses", jit_stats.SymbolCacheMisses},
+	};
+
+	// Passes, slowest first
+	std::vector<std::pair<llvm::StringRef, const PassTime *>> passes;
+	for (const llvm::StringMapEntry<PassTime> &entry : pass_times)
+		passes.emplace_back(entry.getKey(), &entry.getValue());
+	std::sort(passes.begin(), passes.end(), [](const auto &a, const auto &b) {
+		return a.second->time > b.second->time;
+	});
+
+	if (format == StatsFormat::json) {
+		for (size_t i = 0; i < (size_t)Phase::num_phases; ++i)
+			fprintf(file, "{\"type\":\"phase\",\"name\":\"%s\",\"calls\":%llu,\"seconds\":%.9f}\n", 
+				phase_names[i], (unsigned long long)calls[i], seconds(times[i]));
+		for (size_t i = 0; i < (size_t)Counter::num_counters; ++i)
+			fprintf(file, "{\"type\":\"counter\",\"name\":\"%s\",\"value\":%llu}\n", 
+				counter_names[i], (unsigned long long)counters[i]);
+		for (const NamedValue &counter : jit_counters)
+			fprintf(file, "{\"type\":\"counter\",\"name\":\"%s\",\"value\":%llu}\n", 
+				counter.name, (unsigned long long)counter.value);
+		// Pass names are C++ identifiers, nothing to escape
+		for (const auto &[name, pass_time] : passes)
+			fprintf(file, "{\"type\":\"pass\",\"name\":\"%.*s\",\"runs\":%llu,\"seconds\":%.9f}\n", 
+				(int)name.size(), name.data(), (unsigned long long)pass_time->runs, seconds(pass_time->time));
+		return;
+	}
+
+	clock::duration total{};
+	for (clock::duration time : times)
+		total += time;
+
+	fprintf(file, "===== Phases =====\n");
+	for (size_t i = 0; i < (size_t)Phase::num_phases; ++i) {
+		fprintf(file, "  %-12s %10.3f ms %6.1f%% %10llu calls\n", phase_names[i], seconds(times[i]) * 1e3, 
+			total.count() ? 100.0 * times[i].count() / total.count() : 0.0, (unsigned long long)calls[i]);
+	}
+	fprintf(file, "  %-12s %10.3f ms\n", "total", seconds(total) * 1e3);
+	fprintf(file, "  (JIT native codegen: %.3f ms)\n", jit_stats.CompileNanos / 1e6);
+
+	fprintf(file, "===== Counters =====\n");
+	for (size_t i = 0; i < (size_t)Counter::num_counters; ++i)
+		fprintf(file, "  %-28s %12llu\n", counter_names[i], (unsigned long long)counters[i]);
+	for (const NamedValue &counter : jit_counters)
+		fprintf(file, "  %-28s %12llu\n", counter.name, (unsigned long long)counter.value);
+
+	if (passes.empty())
+		return;
+	fprintf(file, "===== Passes =====\n");
+	for (const auto &[name, pass_time] : passes) {
+		fprintf(file, "  %-40.*s %10.3f ms %8llu runs\n", (int)name.size(), name.data(), 
+			seconds(pass_time->time) * 1e3, (unsigned long long)pass_time->runs);
+	}
+}